@@ -5,7 +5,10 @@ LOCAL_FORCE_STATIC_EXECUTABLE := true
 #
 LOCAL_LIB_DIR := $(LOCAL_PATH)
 #
-LOCAL_SRC_FILES += txei_test.c
+LOCAL_SRC_FILES += txei_test.c \
+txei_bench.c \
+txei_load.c \
+txei_sweep.c
 #
 LOCAL_STATIC_LIBRARIES := libcutils libc libtxei
 #
@@ -45,3 +48,95 @@ LOCAL_MODULE := TXEI_SEC_TOOLS
 LOCAL_MODULE_TAGS := eng
 
 include $(BUILD_EXECUTABLE)
+
+
+#####################
+#  Soak test for leaks in the connect/send/receive, DMA, keymaster
+#  and ACD paths (TXEI_SOAK)
+#
+include $(CLEAR_VARS)
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_LIB_DIR := $(LOCAL_PATH)
+LOCAL_KM_DIR := ../libsepkeymaster
+
+LOCAL_SRC_FILES += txei_soak.c \
+$(LOCAL_KM_DIR)/sep_keymaster.c \
+$(LOCAL_KM_DIR)/txei_log.c
+
+LOCAL_STATIC_LIBRARIES := CC6_TXEI_UMIP_ACCESS CC6_ALL_BASIC_LIB liblog libcutils libc libtxei
+
+LOCAL_C_INCLUDES := $(LOCAL_LIB_DIR)/inc/ \
+$(TARGET_OUT_HEADERS)/libtxei             \
+$(LOCAL_PATH)/../Lib/sec_tool_lib/inc/    \
+$(LOCAL_PATH)/../Lib/common/inc/          \
+$(LOCAL_PATH)/$(LOCAL_KM_DIR)/inc
+
+LOCAL_CFLAGS := -DACD_WIPE_TEST
+
+LOCAL_MODULE := TXEI_SOAK
+
+LOCAL_MODULE_TAGS := eng
+
+include $(BUILD_EXECUTABLE)
+
+
+#####################
+#  Byte order kernel benchmark (TXEI_BSWAP_BENCH)
+#
+include $(CLEAR_VARS)
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_SRC_FILES += txei_bswap_bench.c \
+../Lib/common/src/tee_byteorder.c
+
+LOCAL_STATIC_LIBRARIES := libc
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../Lib/common/inc/
+
+LOCAL_MODULE := TXEI_BSWAP_BENCH
+
+LOCAL_MODULE_TAGS := eng
+
+include $(BUILD_EXECUTABLE)
+
+
+#####################
+#  Host side marshalling benchmark (TXEI_MARSHAL_BENCH)
+#
+#  The transport and the heap calls are wrapped at link time: the
+#  transport by a loopback, the heap by allocation counters
+#
+include $(CLEAR_VARS)
+
+LOCAL_KM_DIR := ../libsepkeymaster
+
+LOCAL_SRC_FILES += txei_marshal_bench.c \
+txei_bench.c \
+../Lib/txei_lib.c \
+../Lib/common/src/tee_if.c \
+../Lib/common/src/tee_byteorder.c \
+../Lib/common/src/mei_buf.c \
+../Lib/sec_tool_lib/src/umip_access.c \
+$(LOCAL_KM_DIR)/sep_keymaster.c \
+$(LOCAL_KM_DIR)/txei_log.c
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/inc/ \
+$(LOCAL_PATH)/../Lib/inc/                 \
+$(LOCAL_PATH)/../Lib/sec_tool_lib/inc/    \
+$(LOCAL_PATH)/../Lib/common/inc/          \
+$(LOCAL_PATH)/$(LOCAL_KM_DIR)/inc
+
+LOCAL_CFLAGS := -DBAYTRAIL -DACD_WIPE_TEST
+
+LOCAL_LDFLAGS := -Wl,--wrap=mei_connect,--wrap=mei_disconnect \
+-Wl,--wrap=mei_sndmsg,--wrap=mei_sndmsg_nowait,--wrap=mei_rcvmsg,--wrap=mei_snd_rcv \
+-Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free
+
+LOCAL_LDLIBS := -lpthread -lrt
+
+LOCAL_MODULE := TXEI_MARSHAL_BENCH
+
+LOCAL_MODULE_TAGS := eng
+
+include $(BUILD_HOST_EXECUTABLE)
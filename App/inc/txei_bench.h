@@ -0,0 +1,83 @@
+#ifndef _TXEI_BENCH_H_
+#define _TXEI_BENCH_H_
+
+#include <inttypes.h>
+#include <stdio.h>
+#include "txei.h"
+
+/*
+ * Helpers shared by the TXEI_TEST benchmark modes
+ */
+
+/*
+ * Latency histogram in microseconds. Values below 32 are exact, above
+ * that every power of two is split into 32 buckets, so a reported
+ * percentile is within about 3% of the real value.
+ */
+#define BENCH_HIST_SUB_BITS	5
+#define BENCH_HIST_SUB		(1 << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_BUCKETS	((32 - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB)
+
+struct bench_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint32_t min;
+	uint32_t max;
+	uint64_t buckets[BENCH_HIST_BUCKETS];
+};
+
+void bench_hist_init(struct bench_hist *hist);
+void bench_hist_add(struct bench_hist *hist, uint64_t usec);
+void bench_hist_merge(struct bench_hist *to, const struct bench_hist *from);
+
+/* Returns the value at quantile q (0.5 for the median), 0 if empty */
+uint32_t bench_hist_quantile(const struct bench_hist *hist, double q);
+
+/* Payload size distributions, see bench_size_parse for the syntax */
+#define BENCH_SIZE_MAX_LIST	16
+
+enum {
+	BENCH_SIZE_FIXED = 0,
+	BENCH_SIZE_UNIFORM,
+	BENCH_SIZE_LIST
+};
+
+struct bench_size {
+	int type;
+	unsigned int count;
+	uint32_t sizes[BENCH_SIZE_MAX_LIST];
+};
+
+/*
+ * Parses fixed:<n>, uniform:<min>:<max> or list:<a>,<b>,... with sizes
+ * in bytes (decimal or 0x hex). Returns 0 on success, -1 on bad syntax
+ */
+int bench_size_parse(struct bench_size *spec, const char *str);
+uint32_t bench_size_max(const struct bench_size *spec);
+uint32_t bench_size_draw(const struct bench_size *spec, uint64_t *rng);
+
+/* xorshift64*, the state must not be zero */
+uint64_t bench_random(uint64_t *rng);
+
+/* Monotonic time in microseconds */
+uint64_t bench_now_usec(void);
+void bench_sleep_until(uint64_t usec);
+
+/*
+ * Reads a GUID file in the TXEI_TEST format: eleven hex numbers
+ * separated by spaces. Returns 0 on success, -1 on failure
+ */
+int bench_read_guid(const char *path, GUID *guid);
+void bench_print_guid(FILE *fp, const GUID *guid);
+
+/*
+ * Connects once to read the client properties; returns
+ * MaxMessageLength or 0 if the client cannot be reached
+ */
+uint32_t bench_probe_mtu(const GUID *guid);
+
+/* Benchmark modes, argv[0] is the mode switch itself */
+int txei_load_main(int argc, char **argv);
+int txei_sweep_main(int argc, char **argv);
+
+#endif /* _TXEI_BENCH_H_ */
@@ -69,6 +69,7 @@
 #define PMDB_LOCK_CMD_STR "pmdb-lock"
 #define PMDB_WO_AREA_STR  "WO"
 #define PMDB_WM_AREA_STR  "WM"
+#define ACD_READ_MAX_FIELDS (ACD_MAX_FIELD_INDEX - ACD_MIN_FIELD_INDEX + 1)
 /*
  * gpp_wpgroup - get or set the GPP write protection group
  * gpp_wppart - get or set the GPP partition
@@ -102,6 +103,7 @@ static void usage( const char * const progname )
 		"\n"
 		"Usage: %s <command> [CMD OPTIONS]\n"
 		"       -acd-read  <index> <file name>                              -- read an entry\n"
+		"       -acd-read  <index>,<index>... <file name>                   -- read entries to <file name>.<index>\n"
 		"       -acd-write <index> <file name> <data size> <data max size>  -- write an entry\n"
 		"       -acd-lock                                                   -- lock ACD table\n"
 		"       -acd-prov  <provisioning scheme> <input file> output file   -- key provisioning\n"
@@ -530,10 +532,52 @@ PROVISION_ANDROID_CUSTOMER_DATA_EXIT:
 } /* end provision_android_customer_data() */
 
 
+/*
+ * @brief Reads several ACD fields in one go, each to its own file
+ * @param acdIndex ACD field indexes to read
+ * @param numFields Number of entries in acdIndex
+ * @param outputFilename Base name of the files, the field index is appended
+ * @return EXIT_SUCCESS Every field was read and written
+ * @return EXIT_FAILURE Error occurred
+ */
+static int read_android_customer_data( const uint8_t * const acdIndex,
+				       const uint32_t numFields,
+				       const char * const outputFilename )
+{
+	int status = EXIT_SUCCESS;
+	void *pFieldData[ACD_READ_MAX_FIELDS];
+	int fieldResult[ACD_READ_MAX_FIELDS];
+	char fieldFilename[MAX_STR_SIZE];
+	uint32_t cnt;
+
+	if ( get_customer_data_fields( acdIndex, numFields, pFieldData, fieldResult ) < 0 )
+		status = EXIT_FAILURE;
+
+	for ( cnt = 0; cnt < numFields; cnt++ ) {
+		if ( fieldResult[cnt] < 0 ) {
+			LOGERR("read of index %u failed %d\n", acdIndex[cnt], fieldResult[cnt]);
+		} else {
+			snprintf( fieldFilename, sizeof(fieldFilename), "%s.%u",
+				  outputFilename, acdIndex[cnt] );
+			if ( write_data_to_file( fieldFilename, pFieldData[cnt],
+						 fieldResult[cnt] ) != EXIT_SUCCESS )
+				status = EXIT_FAILURE;
+		}
+		if ( NULL != pFieldData[cnt] )
+			free( pFieldData[cnt] );
+	}
+
+	return status;
+} /* end read_android_customer_data() */
+
+
 int main(int argc, char **argv)
 {
 	int result = EXIT_SUCCESS;
 	uint8_t acdIndex = 0;
+	uint8_t acdReadIndex[ACD_READ_MAX_FIELDS];
+	uint32_t acdReadCount = 0;
+	char *indexStr = NULL;
 	uint16_t dataSize = 0;
 	uint16_t dataMaxSize = 0;
 	enum {
@@ -623,14 +667,27 @@ int main(int argc, char **argv)
 				return EXIT_FAILURE;
 			}
 			what_to_do = DO_ACD_READ;
-			acdIndex = atoi(optarg);
 			/*
-			 * ACD read or write field index range check.
+			 * One index or a comma separated list of them.
 			 */
-			if ( ( acdIndex < ACD_MIN_FIELD_INDEX ) ||
-			     ( acdIndex > ACD_MAX_FIELD_INDEX ) ) {
-				LOGERR("index out of range: valid range is %d to %d\n",
-				       ACD_MIN_FIELD_INDEX, ACD_MAX_FIELD_INDEX);
+			for ( indexStr = strtok(optarg, ","); indexStr != NULL;
+			      indexStr = strtok(NULL, ",") ) {
+				acdIndex = atoi(indexStr);
+				/*
+				 * ACD read or write field index range check.
+				 */
+				if ( ( acdIndex < ACD_MIN_FIELD_INDEX ) ||
+				     ( acdIndex > ACD_MAX_FIELD_INDEX ) ||
+				     ( acdReadCount == ACD_READ_MAX_FIELDS ) ) {
+					LOGERR("index out of range: valid range is %d to %d\n",
+					       ACD_MIN_FIELD_INDEX, ACD_MAX_FIELD_INDEX);
+					usage( argv[ PROGNAME_IDX ] );
+					return EXIT_FAILURE;
+				}
+				acdReadIndex[acdReadCount++] = acdIndex;
+			}
+			if ( acdReadCount == 0 ) {
+				LOGERR("no index given\n");
 				usage( argv[ PROGNAME_IDX ] );
 				return EXIT_FAILURE;
 			}
@@ -874,6 +931,11 @@ int main(int argc, char **argv)
 #endif
 	case DO_ACD_READ:
 		printf("Starting ACD read operation\n");
+		if (acdReadCount > 1) {
+			result = read_android_customer_data( acdReadIndex, acdReadCount,
+							     outputFilename );
+			break;
+		}
 		result = get_customer_data( acdIndex, &pDataBuffer );
 		if (result < 0) {
 			LOGERR("read operaton failed %d\n", result);
@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "txei.h"
+#include "txei_bench.h"
+
+void bench_hist_init(struct bench_hist *hist)
+{
+	memset(hist, 0, sizeof(*hist));
+	hist->min = 0xffffffff;
+}
+
+static unsigned int bench_hist_index(uint32_t value)
+{
+	unsigned int shift;
+
+	if (value < BENCH_HIST_SUB)
+		return value;
+
+	shift = (31 - __builtin_clz(value)) - BENCH_HIST_SUB_BITS;
+	return (shift + 1) * BENCH_HIST_SUB +
+		((value >> shift) & (BENCH_HIST_SUB - 1));
+}
+
+/* Midpoint of the values that land in a bucket */
+static uint32_t bench_hist_value(unsigned int index)
+{
+	unsigned int shift;
+	uint32_t low;
+
+	if (index < BENCH_HIST_SUB)
+		return index;
+
+	shift = index / BENCH_HIST_SUB - 1;
+	low = (uint32_t)(BENCH_HIST_SUB + index % BENCH_HIST_SUB) << shift;
+	return low + ((1u << shift) >> 1);
+}
+
+void bench_hist_add(struct bench_hist *hist, uint64_t usec)
+{
+	uint32_t value = (usec > 0xffffffff) ? 0xffffffff : (uint32_t)usec;
+
+	hist->buckets[bench_hist_index(value)]++;
+	hist->count++;
+	hist->sum += value;
+	if (value < hist->min)
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+void bench_hist_merge(struct bench_hist *to, const struct bench_hist *from)
+{
+	unsigned int a;
+
+	for (a = 0; a < BENCH_HIST_BUCKETS; a++)
+		to->buckets[a] += from->buckets[a];
+	to->count += from->count;
+	to->sum += from->sum;
+	if (from->min < to->min)
+		to->min = from->min;
+	if (from->max > to->max)
+		to->max = from->max;
+}
+
+uint32_t bench_hist_quantile(const struct bench_hist *hist, double q)
+{
+	uint64_t rank;
+	uint64_t seen = 0;
+	unsigned int a;
+
+	if (hist->count == 0)
+		return 0;
+
+	rank = (uint64_t)(q * (double)hist->count);
+	if ((double)rank < q * (double)hist->count)
+		rank++;
+	if (rank == 0)
+		rank = 1;
+
+	for (a = 0; a < BENCH_HIST_BUCKETS; a++) {
+		seen += hist->buckets[a];
+		if (seen >= rank)
+			break;
+	}
+
+	/* Never report outside what was actually measured */
+	if (a == 0 || bench_hist_value(a) < hist->min)
+		return hist->min;
+	if (a >= BENCH_HIST_BUCKETS || bench_hist_value(a) > hist->max)
+		return hist->max;
+	return bench_hist_value(a);
+}
+
+int bench_size_parse(struct bench_size *spec, const char *str)
+{
+	const char *p;
+	char *end;
+	unsigned long value;
+
+	memset(spec, 0, sizeof(*spec));
+
+	if (strncmp(str, "fixed:", 6) == 0) {
+		spec->type = BENCH_SIZE_FIXED;
+		p = str + 6;
+	} else if (strncmp(str, "uniform:", 8) == 0) {
+		spec->type = BENCH_SIZE_UNIFORM;
+		p = str + 8;
+	} else if (strncmp(str, "list:", 5) == 0) {
+		spec->type = BENCH_SIZE_LIST;
+		p = str + 5;
+	} else {
+		return -1;
+	}
+
+	while (*p != '\0') {
+		if (spec->count == BENCH_SIZE_MAX_LIST)
+			return -1;
+		errno = 0;
+		value = strtoul(p, &end, 0);
+		if (end == p || errno != 0 || value == 0 || value > 0xffffffff)
+			return -1;
+		spec->sizes[spec->count++] = (uint32_t)value;
+		p = end;
+		if (*p == ':' || *p == ',')
+			p++;
+		else if (*p != '\0')
+			return -1;
+	}
+
+	switch (spec->type) {
+	case BENCH_SIZE_FIXED:
+		return (spec->count == 1) ? 0 : -1;
+	case BENCH_SIZE_UNIFORM:
+		return (spec->count == 2 && spec->sizes[0] <= spec->sizes[1]) ?
+			0 : -1;
+	default:
+		return (spec->count > 0) ? 0 : -1;
+	}
+}
+
+uint32_t bench_size_max(const struct bench_size *spec)
+{
+	uint32_t max = 0;
+	unsigned int a;
+
+	for (a = 0; a < spec->count; a++) {
+		if (spec->sizes[a] > max)
+			max = spec->sizes[a];
+	}
+	return max;
+}
+
+uint32_t bench_size_draw(const struct bench_size *spec, uint64_t *rng)
+{
+	switch (spec->type) {
+	case BENCH_SIZE_UNIFORM:
+		return spec->sizes[0] + (uint32_t)(bench_random(rng) %
+			(spec->sizes[1] - spec->sizes[0] + 1));
+	case BENCH_SIZE_LIST:
+		return spec->sizes[bench_random(rng) % spec->count];
+	default:
+		return spec->sizes[0];
+	}
+}
+
+uint64_t bench_random(uint64_t *rng)
+{
+	uint64_t x = *rng;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*rng = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+uint64_t bench_now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void bench_sleep_until(uint64_t usec)
+{
+	struct timespec ts;
+	uint64_t now = bench_now_usec();
+
+	if (usec <= now)
+		return;
+
+	usec -= now;
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (long)(usec % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+}
+
+int bench_read_guid(const char *path, GUID *guid)
+{
+	unsigned int read_guid[11] = {0};
+	FILE *fp;
+	int a;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		printf("cannot open guid file %s\n", path);
+		return -1;
+	}
+
+	a = fscanf(fp, "%x %x %x %x %x %x %x %x %x %x %x",
+		&read_guid[0], &read_guid[1], &read_guid[2], &read_guid[3],
+		&read_guid[4], &read_guid[5], &read_guid[6], &read_guid[7],
+		&read_guid[8], &read_guid[9], &read_guid[10]);
+	fclose(fp);
+	if (a != 11) {
+		printf("guid file %s is not in the expected format\n", path);
+		return -1;
+	}
+
+	guid->data1 = read_guid[0];
+	guid->data2 = (unsigned short)read_guid[1];
+	guid->data3 = (unsigned short)read_guid[2];
+	for (a = 0; a < 8; a++)
+		guid->data4[a] = (unsigned char)read_guid[3 + a];
+
+	return 0;
+}
+
+void bench_print_guid(FILE *fp, const GUID *guid)
+{
+	fprintf(fp, "%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+		guid->data1, guid->data2, guid->data3,
+		guid->data4[0], guid->data4[1], guid->data4[2],
+		guid->data4[3], guid->data4[4], guid->data4[5],
+		guid->data4[6], guid->data4[7]);
+}
+
+uint32_t bench_probe_mtu(const GUID *guid)
+{
+	MEI_HANDLE *my_handle_p;
+	uint32_t mtu;
+
+	my_handle_p = mei_connect(guid);
+	if (my_handle_p == NULL)
+		return 0;
+
+	mtu = my_handle_p->client_properties.MaxMessageLength;
+	mei_disconnect(my_handle_p);
+	return mtu;
+}
@@ -0,0 +1,207 @@
+#include <stdlib.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "tee_byteorder.h"
+
+/*
+ * Byte order kernel benchmark (TXEI_BSWAP_BENCH)
+ *
+ * Times every tee_byteorder kernel the CPU supports against the byte
+ * loops copySwap() and swap_byte_order() used before, on operand sizes
+ * from a 32 bit word up to a 4096 bit RSA modulus and beyond, and
+ * checks each result against the old code. Prints CSV, one line per
+ * operation, size and implementation.
+ */
+
+#define BSWAP_MAX_SIZE	8192
+
+static const uint32_t bswap_sizes[] = { 4, 16, 32, 64, 128, 256, 512, 1024, 8192 };
+static const char *bswap_kernels[] = { "scalar", "ssse3", "avx2" };
+
+static uint8_t bswap_src[BSWAP_MAX_SIZE];
+static uint8_t bswap_dst[BSWAP_MAX_SIZE];
+static uint8_t bswap_ref[BSWAP_MAX_SIZE];
+
+/* copySwap() as it was: an unrolled byte loop entered Duff style */
+static void legacy_copy_swap(void *vDst, const void *vSrc, uint32_t length)
+{
+	uint8_t *pDst = vDst;
+	const uint8_t *pSrc = (const uint8_t *)vSrc + length;
+	uint32_t quickSwap = length & 7;
+
+	while (pSrc != (const uint8_t *)vSrc) {
+		switch (quickSwap) {
+		case 0: *pDst++ = *(--pSrc);
+		case 7: *pDst++ = *(--pSrc);
+		case 6: *pDst++ = *(--pSrc);
+		case 5: *pDst++ = *(--pSrc);
+		case 4: *pDst++ = *(--pSrc);
+		case 3: *pDst++ = *(--pSrc);
+		case 2: *pDst++ = *(--pSrc);
+		default: *pDst++ = *(--pSrc);
+		}
+		quickSwap = 0;
+	}
+}
+
+/* swap_byte_order() as it was */
+static void legacy_swap_byte_order(uint8_t *buf, uint32_t buf_len)
+{
+	uint32_t i;
+
+	for (i = 0; i < (buf_len / 2); i++) {
+		buf[i] ^= buf[(buf_len - 1) - i];
+		buf[(buf_len - 1) - i] ^= buf[i];
+		buf[i] ^= buf[(buf_len - 1) - i];
+	}
+}
+
+static void legacy_swap32(uint8_t *dst, const uint8_t *src, uint32_t len)
+{
+	uint32_t i;
+
+	for (i = 0; i + 4 <= len; i += 4)
+		legacy_copy_swap(dst + i, src + i, 4);
+}
+
+static uint64_t bswap_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+enum {
+	OP_COPY = 0,	/* copySwap */
+	OP_INPLACE,	/* swap_byte_order */
+	OP_SWAP32,	/* array of 32 bit words */
+	OP_COUNT
+};
+
+static const char *bswap_ops[OP_COUNT] = { "copy", "inplace", "swap32" };
+
+static void bswap_run(int op, const char *impl, uint32_t size,
+		      unsigned int iterations)
+{
+	unsigned int reps = iterations;
+	uint64_t start, elapsed;
+	unsigned int a;
+	int legacy = !strcmp(impl, "legacy");
+
+	/* Keep the work per line roughly the same across sizes */
+	if (size > 64)
+		reps = (unsigned int)((uint64_t)iterations * 64 / size);
+	if (reps < 16)
+		reps = 16;
+
+	start = bswap_nsec();
+	for (a = 0; a < reps; a++) {
+		switch (op) {
+		case OP_COPY:
+			if (legacy)
+				legacy_copy_swap(bswap_dst, bswap_src, size);
+			else
+				tee_bswap_buf(bswap_dst, bswap_src, size);
+			break;
+		case OP_INPLACE:
+			if (legacy)
+				legacy_swap_byte_order(bswap_dst, size);
+			else
+				tee_bswap_buf_inplace(bswap_dst, size);
+			break;
+		default:
+			if (legacy)
+				legacy_swap32(bswap_dst, bswap_src, size);
+			else
+				tee_bswap32_array(bswap_dst, bswap_src, size / 4);
+			break;
+		}
+		/* Keep the compiler from dropping repeated work */
+		__asm__ volatile ("" : : "r" (bswap_dst) : "memory");
+	}
+	elapsed = bswap_nsec() - start;
+
+	/* Reference result from the old code, in place ops run reps times */
+	memcpy(bswap_dst, bswap_src, size);
+	memcpy(bswap_ref, bswap_src, size);
+	switch (op) {
+	case OP_COPY:
+		legacy_copy_swap(bswap_ref, bswap_src, size);
+		if (!legacy)
+			tee_bswap_buf(bswap_dst, bswap_src, size);
+		else
+			legacy_copy_swap(bswap_dst, bswap_src, size);
+		break;
+	case OP_INPLACE:
+		legacy_swap_byte_order(bswap_ref, size);
+		if (!legacy)
+			tee_bswap_buf_inplace(bswap_dst, size);
+		else
+			legacy_swap_byte_order(bswap_dst, size);
+		break;
+	default:
+		legacy_swap32(bswap_ref, bswap_src, size);
+		if (!legacy)
+			tee_bswap32_array(bswap_dst, bswap_src, size / 4);
+		else
+			legacy_swap32(bswap_dst, bswap_src, size);
+		break;
+	}
+
+	printf("%s,%u,%s,%u,%.1f,%.1f,%s\n", bswap_ops[op], size, impl, reps,
+	       (double)elapsed / reps,
+	       (double)size * reps * 1e3 / (elapsed ? elapsed : 1),
+	       memcmp(bswap_dst, bswap_ref, size) ? "MISMATCH" : "ok");
+}
+
+static void bswap_usage(const char *prog)
+{
+	printf("Byte order benchmark: %s [options]\n", prog);
+	printf("	-n <n>		iterations at 64 bytes, scaled down for\n");
+	printf("			larger sizes (default 200000)\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int iterations = 200000;
+	unsigned int s, k;
+	int op, opt;
+
+	while ((opt = getopt(argc, argv, "n:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			bswap_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (iterations == 0) {
+		bswap_usage(argv[0]);
+		return 1;
+	}
+
+	for (s = 0; s < BSWAP_MAX_SIZE; s++)
+		bswap_src[s] = (uint8_t)(s * 131 + 7);
+
+	printf("# default kernel %s\n", tee_bswap_kernel());
+	printf("op,bytes,impl,reps,ns_per_op,mbyte_per_s,check\n");
+	for (op = 0; op < OP_COUNT; op++) {
+		for (s = 0; s < sizeof(bswap_sizes) / sizeof(bswap_sizes[0]); s++) {
+			bswap_run(op, "legacy", bswap_sizes[s], iterations);
+			for (k = 0; k < sizeof(bswap_kernels) / sizeof(bswap_kernels[0]); k++) {
+				if (tee_bswap_select(bswap_kernels[k]))
+					continue;
+				bswap_run(op, bswap_kernels[k], bswap_sizes[s],
+					  iterations);
+			}
+		}
+	}
+
+	return 0;
+}
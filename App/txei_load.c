@@ -0,0 +1,373 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "txei.h"
+#include "txei_bench.h"
+
+/*
+ * Load generator mode of TXEI_TEST
+ *
+ * Every thread is one client of the firmware. In closed loop mode each
+ * thread sends its next request as soon as the previous response is
+ * in, so the offered concurrency is the thread count. With a target
+ * rate the threads send on a fixed schedule and latency is measured
+ * from the scheduled send time, so a stalled firmware shows up in the
+ * tail instead of silently lowering the offered load.
+ */
+
+#define LOAD_MAX_THREADS	64
+
+struct load_config {
+	GUID guid;
+	unsigned int threads;
+	unsigned int rate;
+	unsigned int duration;
+	unsigned int warmup;
+	int persistent;
+	int use_request;
+	int json;
+	struct bench_size snd_size;
+	uint32_t rcv_size;
+	uint64_t seed;
+	uint64_t start_usec;
+	uint64_t measure_usec;
+	uint64_t end_usec;
+};
+
+struct load_thread {
+	pthread_t tid;
+	unsigned int index;
+	struct load_config *cfg;
+	struct bench_hist hist;
+	uint64_t rng;
+	uint64_t requests;
+	uint64_t ok;
+	uint64_t connect_err;
+	uint64_t send_err;
+	uint64_t recv_err;
+	uint64_t snd_bytes;
+	uint64_t rcv_bytes;
+};
+
+static void load_usage(void)
+{
+	printf("Load generator: TXEI_TEST -load <guid file> [options]\n");
+	printf("	-t <n>		threads, one firmware client each (default 1)\n");
+	printf("	-r <n>		target requests per second over all threads;\n");
+	printf("			0 runs closed loop (default 0)\n");
+	printf("	-s <spec>	request size: fixed:<n>, uniform:<min>:<max>\n");
+	printf("			or list:<a>,<b>,... (default fixed:64)\n");
+	printf("	-R <n>		response buffer size (default MaxMessageLength)\n");
+	printf("	-d <sec>	measured duration (default 10)\n");
+	printf("	-w <sec>	warm-up before measuring (default 2)\n");
+	printf("	-p		keep one connection per thread instead of\n");
+	printf("			connecting for every request\n");
+	printf("	-q		send through mei_request\n");
+	printf("	-S <n>		random seed (default 1)\n");
+	printf("	-j		print the report as JSON\n");
+}
+
+static int load_one(struct load_thread *thr, MEI_HANDLE **handle,
+	uint8_t *snd_buf, uint32_t snd_size, uint8_t *rcv_buf)
+{
+	struct load_config *cfg = thr->cfg;
+	MEI_HANDLE *my_handle_p = *handle;
+	int rv;
+
+	if (cfg->use_request) {
+		rv = mei_request(&cfg->guid, snd_buf, snd_size, rcv_buf,
+			cfg->rcv_size);
+		if (rv < 0) {
+			thr->send_err++;
+			return -1;
+		}
+		thr->rcv_bytes += rv;
+		return 0;
+	}
+
+	if (my_handle_p == NULL) {
+		my_handle_p = mei_connect(&cfg->guid);
+		if (my_handle_p == NULL) {
+			thr->connect_err++;
+			return -1;
+		}
+	}
+
+	rv = mei_sndmsg(my_handle_p, snd_buf, snd_size);
+	if (rv != (int)snd_size) {
+		thr->send_err++;
+		goto error;
+	}
+
+	rv = mei_rcvmsg(my_handle_p, rcv_buf, cfg->rcv_size);
+	if (rv < 0) {
+		thr->recv_err++;
+		goto error;
+	}
+	thr->rcv_bytes += rv;
+
+	if (cfg->persistent)
+		*handle = my_handle_p;
+	else
+		mei_disconnect(my_handle_p);
+	return 0;
+
+error:
+	/* A failed exchange may leave a response queued; start over */
+	mei_disconnect(my_handle_p);
+	*handle = NULL;
+	return -1;
+}
+
+static void *load_thread_main(void *arg)
+{
+	struct load_thread *thr = arg;
+	struct load_config *cfg = thr->cfg;
+	MEI_HANDLE *my_handle_p = NULL;
+	uint8_t *snd_buf;
+	uint8_t *rcv_buf;
+	uint64_t interval = 0;
+	uint64_t next;
+	uint64_t start;
+	uint64_t now;
+	uint32_t snd_size;
+	int rv;
+
+	snd_buf = malloc(bench_size_max(&cfg->snd_size));
+	rcv_buf = malloc(cfg->rcv_size);
+	if (snd_buf == NULL || rcv_buf == NULL) {
+		printf("load: thread %u cannot allocate buffers\n", thr->index);
+		goto exit;
+	}
+	memset(snd_buf, 0x5a, bench_size_max(&cfg->snd_size));
+
+	/* Spread the threads' schedules evenly over one interval */
+	next = cfg->start_usec;
+	if (cfg->rate) {
+		interval = (uint64_t)cfg->threads * 1000000 / cfg->rate;
+		next += interval * thr->index / cfg->threads;
+	}
+
+	while ((now = bench_now_usec()) < cfg->end_usec) {
+		if (cfg->rate) {
+			if (now < next) {
+				bench_sleep_until(next);
+				continue;
+			}
+			start = next;
+			next += interval;
+		} else {
+			start = now;
+		}
+
+		snd_size = bench_size_draw(&cfg->snd_size, &thr->rng);
+		rv = load_one(thr, &my_handle_p, snd_buf, snd_size, rcv_buf);
+		now = bench_now_usec();
+
+		if (start < cfg->measure_usec)
+			continue;
+
+		thr->requests++;
+		if (rv == 0) {
+			thr->ok++;
+			thr->snd_bytes += snd_size;
+			bench_hist_add(&thr->hist, now - start);
+		}
+	}
+
+exit:
+	if (my_handle_p != NULL)
+		mei_disconnect(my_handle_p);
+	free(snd_buf);
+	free(rcv_buf);
+	return NULL;
+}
+
+static void load_report(struct load_config *cfg, struct load_thread *thr)
+{
+	struct bench_hist hist;
+	uint64_t requests = 0;
+	uint64_t ok = 0;
+	uint64_t connect_err = 0;
+	uint64_t send_err = 0;
+	uint64_t recv_err = 0;
+	uint64_t bytes = 0;
+	double secs = (double)cfg->duration;
+	unsigned int a;
+
+	bench_hist_init(&hist);
+	for (a = 0; a < cfg->threads; a++) {
+		bench_hist_merge(&hist, &thr[a].hist);
+		requests += thr[a].requests;
+		ok += thr[a].ok;
+		connect_err += thr[a].connect_err;
+		send_err += thr[a].send_err;
+		recv_err += thr[a].recv_err;
+		bytes += thr[a].snd_bytes + thr[a].rcv_bytes;
+	}
+
+	if (cfg->json) {
+		printf("{\"guid\":\"");
+		bench_print_guid(stdout, &cfg->guid);
+		printf("\",\"threads\":%u,\"rate\":%u,\"persistent\":%d,"
+			"\"duration_s\":%u,\"warmup_s\":%u,",
+			cfg->threads, cfg->rate, cfg->persistent,
+			cfg->duration, cfg->warmup);
+		printf("\"requests\":%" PRIu64 ",\"ok\":%" PRIu64 ","
+			"\"errors\":{\"connect\":%" PRIu64 ",\"send\":%" PRIu64
+			",\"recv\":%" PRIu64 "},",
+			requests, ok, connect_err, send_err, recv_err);
+		printf("\"throughput_rps\":%.1f,\"throughput_kbps\":%.1f,",
+			ok / secs, bytes / secs / 1024);
+		printf("\"latency_us\":{\"min\":%u,\"p50\":%u,\"p99\":%u,"
+			"\"p999\":%u,\"max\":%u,\"mean\":%" PRIu64 "}}\n",
+			hist.count ? hist.min : 0,
+			bench_hist_quantile(&hist, 0.5),
+			bench_hist_quantile(&hist, 0.99),
+			bench_hist_quantile(&hist, 0.999),
+			hist.max,
+			hist.count ? hist.sum / hist.count : 0);
+		return;
+	}
+
+	printf("load: guid ");
+	bench_print_guid(stdout, &cfg->guid);
+	printf(" threads %u %s %s\n", cfg->threads,
+		cfg->rate ? "open loop" : "closed loop",
+		cfg->persistent ? "persistent" : "connect per request");
+	printf("load: requests %" PRIu64 " ok %" PRIu64 " errors connect %"
+		PRIu64 " send %" PRIu64 " recv %" PRIu64 "\n",
+		requests, ok, connect_err, send_err, recv_err);
+	printf("load: throughput %.1f req/s %.1f KB/s\n",
+		ok / secs, bytes / secs / 1024);
+	printf("load: latency us min %u p50 %u p99 %u p999 %u max %u mean %"
+		PRIu64 "\n",
+		hist.count ? hist.min : 0,
+		bench_hist_quantile(&hist, 0.5),
+		bench_hist_quantile(&hist, 0.99),
+		bench_hist_quantile(&hist, 0.999),
+		hist.max,
+		hist.count ? hist.sum / hist.count : 0);
+}
+
+int txei_load_main(int argc, char **argv)
+{
+	struct load_config cfg;
+	struct load_thread *thr;
+	const char *size_spec = "fixed:64";
+	uint32_t mtu;
+	unsigned int a;
+	int opt;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.threads = 1;
+	cfg.duration = 10;
+	cfg.warmup = 2;
+	cfg.seed = 1;
+
+	if (argc < 2) {
+		load_usage();
+		return -1;
+	}
+	if (bench_read_guid(argv[1], &cfg.guid) != 0) {
+		load_usage();
+		return -1;
+	}
+
+	optind = 2;
+	while ((opt = getopt(argc, argv, "t:r:s:R:d:w:pqS:j")) != -1) {
+		switch (opt) {
+		case 't':
+			cfg.threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			cfg.rate = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			size_spec = optarg;
+			break;
+		case 'R':
+			cfg.rcv_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			cfg.duration = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			cfg.warmup = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			cfg.persistent = 1;
+			break;
+		case 'q':
+			cfg.use_request = 1;
+			break;
+		case 'S':
+			cfg.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'j':
+			cfg.json = 1;
+			break;
+		default:
+			load_usage();
+			return -1;
+		}
+	}
+
+	if (cfg.threads == 0 || cfg.threads > LOAD_MAX_THREADS ||
+	    cfg.duration == 0) {
+		printf("load: need 1 to %d threads and a non zero duration\n",
+			LOAD_MAX_THREADS);
+		return -1;
+	}
+	if (bench_size_parse(&cfg.snd_size, size_spec) != 0) {
+		printf("load: bad size spec %s\n", size_spec);
+		load_usage();
+		return -1;
+	}
+
+	mtu = bench_probe_mtu(&cfg.guid);
+	if (mtu == 0) {
+		printf("load: cannot connect to client\n");
+		return -1;
+	}
+	if (cfg.rcv_size == 0)
+		cfg.rcv_size = mtu;
+	if (bench_size_max(&cfg.snd_size) > mtu)
+		printf("load: warning, requests up to %u bytes exceed "
+			"MaxMessageLength %u\n", bench_size_max(&cfg.snd_size), mtu);
+
+	thr = calloc(cfg.threads, sizeof(struct load_thread));
+	if (thr == NULL) {
+		printf("load: cannot allocate thread state\n");
+		return -1;
+	}
+
+	cfg.start_usec = bench_now_usec();
+	cfg.measure_usec = cfg.start_usec + (uint64_t)cfg.warmup * 1000000;
+	cfg.end_usec = cfg.measure_usec + (uint64_t)cfg.duration * 1000000;
+
+	for (a = 0; a < cfg.threads; a++) {
+		thr[a].index = a;
+		thr[a].cfg = &cfg;
+		thr[a].rng = cfg.seed * 0x9E3779B97F4A7C15ULL + a + 1;
+		bench_hist_init(&thr[a].hist);
+		if (pthread_create(&thr[a].tid, NULL, load_thread_main,
+			&thr[a]) != 0) {
+			printf("load: cannot start thread %u\n", a);
+			cfg.threads = a;
+			break;
+		}
+	}
+	for (a = 0; a < cfg.threads; a++)
+		pthread_join(thr[a].tid, NULL);
+
+	if (cfg.threads)
+		load_report(&cfg, thr);
+	free(thr);
+
+	return 0;
+}
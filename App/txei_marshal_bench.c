@@ -0,0 +1,553 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "txei.h"
+#include "txei_bench.h"
+#include "tee_if.h"
+#include "tee_error.h"
+#include "umip_access.h"
+#include "acd_cmd_structs.h"
+#define LOG_TAG "TXEI_MARSHAL_BENCH"
+#include "txei_log.h"
+/*
+ * android_heci_agent.h defines ANDROID_HECI_AGENT_GUID, which
+ * sep_keymaster.c already does, so this copy gets a name of its own
+ */
+#define ANDROID_HECI_AGENT_GUID marshal_heci_agent_guid
+#include "sep_keymaster.h"
+#undef ANDROID_HECI_AGENT_GUID
+
+/*
+ * Host side marshalling benchmark (TXEI_MARSHAL_BENCH)
+ *
+ * Times the code that builds and parses firmware messages: the keymaster
+ * request builders and response parser, copySwap(), process_cmd()
+ * parameter validation and gathering, ACD field reads and txei_log
+ * formatting. The TXEI transport is replaced at link time (--wrap) by a
+ * loopback that answers every request at once, so no device is needed
+ * and only host CPU time is measured. The heap calls of the code under
+ * test are wrapped the same way and counted. Payloads and ACD field
+ * indexes come from a fixed seed, so two runs do the same work.
+ *
+ * Prints CSV, one line per case: ns_per_op is the mean over the timed
+ * iterations after one untimed warm up call, allocs_per_op counts
+ * malloc, calloc and realloc calls.
+ */
+
+#define MARSHAL_RSA_BYTES	256
+#define MARSHAL_KEY_OPAQUE	1024
+#define MARSHAL_MAX_MSG		ANDROID_HECI_AGENT_MAX_MTU
+
+/* Client the process_cmd cases talk to, never reaches a device */
+static const GUID marshal_guid = {0x6d617273, 0x6861, 0x6c6c, {0x62, 0x65, 0x6e, 0x63, 0x68, 0x00, 0x00, 0x01}};
+
+static uint64_t marshal_rng;
+static FILE *marshal_null_fp;
+
+static uint8_t marshal_cmd_buf[MARSHAL_MAX_MSG] __attribute__((aligned(8)));
+static uint8_t marshal_fw_rsp[MARSHAL_MAX_MSG] __attribute__((aligned(8)));
+static uint8_t marshal_rsp_buf[MARSHAL_MAX_MSG] __attribute__((aligned(8)));
+static uint8_t marshal_src[MARSHAL_MAX_MSG];
+static uint8_t marshal_dst[MARSHAL_MAX_MSG];
+
+/*
+ * Heap accounting. Only calls from the objects linked with --wrap are
+ * seen, allocations made inside libc itself are not
+ */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+static uint64_t marshal_allocs;
+
+void *__wrap_malloc(size_t size)
+{
+	__atomic_add_fetch(&marshal_allocs, 1, __ATOMIC_RELAXED);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&marshal_allocs, 1, __ATOMIC_RELAXED);
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&marshal_allocs, 1, __ATOMIC_RELAXED);
+	return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr)
+{
+	__real_free(ptr);
+}
+
+/*
+ * Loopback transport. Every send succeeds and every receive is answered
+ * by marshal_respond, which the case under test sets up. The handle fd
+ * is a pipe holding one byte that is never read, so polling it for a
+ * response returns at once
+ */
+static MEI_HANDLE marshal_handle;
+static int marshal_pipe[2] = {-1, -1};
+static void (*marshal_respond)(uint8_t *buf, ssize_t size);
+
+MEI_HANDLE *__wrap_mei_connect(const GUID *guid)
+{
+	if (marshal_pipe[0] < 0) {
+		if (pipe(marshal_pipe) != 0 || write(marshal_pipe[1], "", 1) != 1) {
+			printf("cannot create loopback pipe, errno: %x\n", errno);
+			return NULL;
+		}
+	}
+
+	memset(&marshal_handle, 0, sizeof(marshal_handle));
+	marshal_handle.fd = marshal_pipe[0];
+	memcpy(&marshal_handle.guid, guid, sizeof(GUID));
+	marshal_handle.client_properties.MaxMessageLength = MARSHAL_MAX_MSG;
+	return &marshal_handle;
+}
+
+void __wrap_mei_disconnect(MEI_HANDLE *my_handle_p)
+{
+	(void)my_handle_p;
+}
+
+int __wrap_mei_sndmsg(MEI_HANDLE *my_handle_p, uint8_t *buf, ssize_t my_size)
+{
+	(void)my_handle_p;
+	(void)buf;
+	return (int)my_size;
+}
+
+int __wrap_mei_sndmsg_nowait(MEI_HANDLE *my_handle_p, uint8_t *buf, ssize_t my_size)
+{
+	(void)my_handle_p;
+	(void)buf;
+	return (int)my_size;
+}
+
+int __wrap_mei_rcvmsg(MEI_HANDLE *my_handle_p, uint8_t *buf, ssize_t my_size)
+{
+	(void)my_handle_p;
+	if (marshal_respond)
+		marshal_respond(buf, my_size);
+	return (int)my_size;
+}
+
+int __wrap_mei_snd_rcv(MEI_HANDLE *my_handle_p, void *snd_buf, ssize_t snd_size,
+		       void *rcv_buf, ssize_t rcv_size)
+{
+	(void)my_handle_p;
+	(void)snd_buf;
+	(void)snd_size;
+	if (marshal_respond)
+		marshal_respond(rcv_buf, rcv_size);
+	return 0;
+}
+
+static uint64_t marshal_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void marshal_fill(uint8_t *buf, uint32_t size)
+{
+	uint64_t word = 0;
+	uint32_t i;
+
+	for (i = 0; i < size; i++) {
+		if ((i & 7) == 0)
+			word = bench_random(&marshal_rng);
+		buf[i] = (uint8_t)(word >> ((i & 7) * 8));
+	}
+}
+
+struct marshal_case {
+	const char *name;
+	uint32_t bytes;		/* payload size, 0 where it does not apply */
+	int arg;
+	void (*setup)(const struct marshal_case *mc);
+	int (*run)(const struct marshal_case *mc);	/* 0 on success */
+};
+
+/* Keymaster requests, one case per command */
+
+static void km_respond_caps(uint8_t *buf, ssize_t size)
+{
+	ANDROID_HECI_KEYMASTER_CMD_GET_CAPS_RESPONSE *resp = (void *)buf;
+	ANDROID_HECI_KEYMASTER_RSA_CAPS_PARAMS *params;
+
+	memset(buf, 0, size);
+	resp->Header.ResponseCode = ANDROID_HECI_AGENT_RESPONSE_CODE_SUCCESS;
+	resp->NumAlgs = 1;
+	resp->KeyCapabilities[0].Type = ANDROID_HECI_KEYMASTER_KEY_TYPE_RSA;
+	resp->KeyCapabilities[0].Length = sizeof(*params);
+	params = (void *)resp->KeyCapabilities[0].Value;
+	params->KeyOpaqueSize = MARSHAL_KEY_OPAQUE;
+}
+
+static void km_setup_cmd(const struct marshal_case *mc)
+{
+	intel_keymaster_firmware_cmd_t *cmd = (void *)marshal_cmd_buf;
+
+	marshal_fill(marshal_cmd_buf, sizeof(marshal_cmd_buf));
+	cmd->cmd_id = mc->arg;
+
+	switch (mc->arg) {
+	case KEYMASTER_CMD_GENERATE_KEYPAIR: {
+		intel_keymaster_keygen_params_t *keygen = (void *)cmd->cmd_data;
+		intel_keymaster_rsa_keygen_params_t *rsa = (void *)keygen->key_params;
+
+		keygen->key_type = KEY_TYPE_RSA;
+		rsa->modulus_size = MARSHAL_RSA_BYTES * 8;
+		rsa->reserved = 0;
+		rsa->public_exponent = 0x10001;
+		cmd->cmd_data_length = sizeof(*keygen) + sizeof(*rsa);
+		break;
+	}
+	case KEYMASTER_CMD_IMPORT_KEYPAIR: {
+		intel_keymaster_import_key_t *key = (void *)cmd->cmd_data;
+		intel_keymaster_rsa_key_t *rsa = (void *)key->key_data;
+
+		key->key_type = KEY_TYPE_RSA;
+		rsa->modulus_length = MARSHAL_RSA_BYTES;
+		rsa->public_exponent_length = 3;
+		rsa->private_exponent_length = MARSHAL_RSA_BYTES;
+		cmd->cmd_data_length = sizeof(*key) + sizeof(*rsa) +
+			2 * MARSHAL_RSA_BYTES + 3;
+		break;
+	}
+	case KEYMASTER_CMD_GET_KEYPAIR_PUBLIC: {
+		intel_keymaster_key_blob_t *blob = (void *)cmd->cmd_data;
+
+		blob->key_blob_length = MARSHAL_KEY_OPAQUE;
+		cmd->cmd_data_length = sizeof(*blob) + MARSHAL_KEY_OPAQUE;
+		break;
+	}
+	case KEYMASTER_CMD_SIGN_DATA: {
+		intel_keymaster_signing_cmd_data_t *sign = (void *)cmd->cmd_data;
+
+		sign->key_blob_length = MARSHAL_KEY_OPAQUE;
+		sign->data_length = MARSHAL_RSA_BYTES;
+		cmd->cmd_data_length = sizeof(*sign) + MARSHAL_KEY_OPAQUE +
+			MARSHAL_RSA_BYTES;
+		break;
+	}
+	default: {
+		intel_keymaster_verification_data_t *verify = (void *)cmd->cmd_data;
+
+		verify->key_blob_length = MARSHAL_KEY_OPAQUE;
+		verify->data_length = MARSHAL_RSA_BYTES;
+		verify->signature_length = MARSHAL_RSA_BYTES;
+		cmd->cmd_data_length = sizeof(*verify) + MARSHAL_KEY_OPAQUE +
+			2 * MARSHAL_RSA_BYTES;
+		break;
+	}
+	}
+}
+
+static int km_run_cmd(const struct marshal_case *mc)
+{
+	uint8_t *request = NULL;
+	uint32_t len = 0;
+	sep_keymaster_return_t ret;
+
+	(void)mc;
+	ret = generate_cmd_buf((intel_keymaster_firmware_cmd_t *)marshal_cmd_buf,
+			       &request, &len);
+	mei_buf_put(request);
+	return ret != SEP_KEYMASTER_SUCCESS;
+}
+
+/* Keymaster responses, arg is the firmware command id */
+
+static void km_setup_rsp(const struct marshal_case *mc)
+{
+	ANDROID_HECI_AGENT_RESP_HEADER *hdr = (void *)marshal_fw_rsp;
+
+	marshal_fill(marshal_fw_rsp, sizeof(marshal_fw_rsp));
+	hdr->CmdClass = ANDROID_HECI_AGENT_CMD_CLASS_KEY_MASTER;
+	hdr->CmdId = mc->arg;
+	hdr->ResponseCode = ANDROID_HECI_AGENT_RESPONSE_CODE_SUCCESS;
+
+	switch (mc->arg) {
+	case ANDROID_HECI_KEYMASTER_CMD_ID_RSA_GEN_KEY:
+		hdr->OutputSize = MARSHAL_KEY_OPAQUE;
+		break;
+	case ANDROID_HECI_KEYMASTER_CMD_ID_RSA_GET_PUBLIC_KEY:
+		((ANDROID_HECI_KEYMASTER_CMD_RSA_GET_PUBLIC_KEY_RESPONSE *)
+			marshal_fw_rsp)->KeySize = MARSHAL_RSA_BYTES;
+		break;
+	case ANDROID_HECI_KEYMASTER_CMD_ID_RSA_SIGN_DATA_NOPAD:
+		((ANDROID_HECI_KEYMASTER_CMD_RSA_SIGN_DATA_NOPAD_RESPONSE *)
+			marshal_fw_rsp)->SignatureSize = MARSHAL_RSA_BYTES;
+		break;
+	case ANDROID_HECI_KEYMASTER_CMD_ID_RSA_VERIFY_DATA_NOPAD:
+		((ANDROID_HECI_KEYMASTER_CMD_RSA_VERIFY_DATA_NOPAD_RESPONSE *)
+			marshal_fw_rsp)->Verified = 1;
+		break;
+	default:
+		/* Error status, the path every failed command takes */
+		hdr->ResponseCode = ANDROID_HECI_AGENT_RESPONSE_CODE_FAILURE;
+		break;
+	}
+}
+
+static int km_run_rsp(const struct marshal_case *mc)
+{
+	uint32_t len = 0;
+
+	(void)mc;
+	return set_response_status_and_data(marshal_fw_rsp,
+			(intel_keymaster_firmware_rsp_t *)marshal_rsp_buf, &len,
+			sizeof(marshal_rsp_buf)) != SEP_KEYMASTER_SUCCESS;
+}
+
+/* copySwap, arg is the tee_swap_flag */
+
+static void swap_setup(const struct marshal_case *mc)
+{
+	(void)mc;
+	marshal_fill(marshal_src, sizeof(marshal_src));
+}
+
+static int swap_run(const struct marshal_case *mc)
+{
+	copySwap(marshal_dst, marshal_src, mc->bytes, mc->arg);
+	/* Keep the compiler from dropping repeated work */
+	__asm__ volatile ("" : : "r" (marshal_dst) : "memory");
+	return 0;
+}
+
+/*
+ * process_cmd over the loopback. arg is the number of further inline
+ * inputs of mc->bytes each, gathered into the message after the first
+ */
+static void *marshal_tee;
+static struct data_buffer tee_in[16];
+static struct data_buffer tee_out[16];
+static uint32_t tee_params;
+
+static void tee_setup(const struct marshal_case *mc)
+{
+	uint32_t cnt;
+
+	marshal_respond = NULL;
+	marshal_fill(marshal_src, sizeof(marshal_src));
+	memset(tee_in, 0, sizeof(tee_in));
+	memset(tee_out, 0, sizeof(tee_out));
+
+	INIT_FROM_HOST_PARAM_BUF(tee_in[0], marshal_src, mc->bytes);
+	INIT_TO_HOST_PARAM_BUF(tee_out[0], marshal_dst, mc->bytes);
+	for (cnt = 1; cnt <= (uint32_t)mc->arg; cnt++)
+		INIT_FROM_HOST_PARAM_BUF(tee_in[cnt], marshal_src + cnt * mc->bytes, mc->bytes);
+	tee_params = mc->arg + 1;
+}
+
+static int tee_run(const struct marshal_case *mc)
+{
+	uint32_t ret;
+
+	ret = process_cmd(marshal_tee, 0x100, tee_in, tee_out, tee_params);
+	return ret != 0;
+}
+
+/* ACD reads, bytes is the field length the loopback answers with */
+
+static uint32_t acd_bytes;
+
+static void acd_respond(uint8_t *buf, ssize_t size)
+{
+	struct acd_read_cmd_to_host *resp = (void *)buf;
+
+	if (size < (ssize_t)sizeof(*resp))
+		return;
+	resp->acd_status = ACD_READ_SUCCESS;
+	resp->bytes_read = acd_bytes;
+	memcpy(resp->buf, marshal_src, acd_bytes);
+}
+
+static void acd_setup(const struct marshal_case *mc)
+{
+	marshal_fill(marshal_src, sizeof(marshal_src));
+	acd_bytes = mc->bytes;
+	marshal_respond = acd_respond;
+}
+
+static uint8_t acd_draw_index(void)
+{
+	return ACD_MIN_FIELD_INDEX + bench_random(&marshal_rng) %
+		(ACD_MAX_FIELD_INDEX - ACD_MIN_FIELD_INDEX + 1);
+}
+
+static int acd_run(const struct marshal_case *mc)
+{
+	void *data = NULL;
+	int ret;
+
+	ret = get_customer_data(acd_draw_index(), &data);
+	free(data);
+	return ret != (int)mc->bytes;
+}
+
+/* txei_log, arg is the minimum level */
+
+static void log_setup(const struct marshal_case *mc)
+{
+	txei_log_set_dest(TXEI_LOG_DEST_FILE, marshal_null_fp, marshal_null_fp);
+	txei_log_set_level(mc->arg);
+	marshal_fill(marshal_src, sizeof(marshal_src));
+}
+
+static int log_run(const struct marshal_case *mc)
+{
+	(void)mc;
+	LOGDBG("cmd-id=0x%08x size=%u status=%d\n", 0x80000006, 4096, 0);
+	return 0;
+}
+
+static int log_run_buf(const struct marshal_case *mc)
+{
+	LOGDBGBUF("response", marshal_src, mc->bytes);
+	return 0;
+}
+
+static const struct marshal_case marshal_cases[] = {
+	{ "km_cmd_generate", 0, KEYMASTER_CMD_GENERATE_KEYPAIR, km_setup_cmd, km_run_cmd },
+	{ "km_cmd_import", 0, KEYMASTER_CMD_IMPORT_KEYPAIR, km_setup_cmd, km_run_cmd },
+	{ "km_cmd_get_public", 0, KEYMASTER_CMD_GET_KEYPAIR_PUBLIC, km_setup_cmd, km_run_cmd },
+	{ "km_cmd_sign", 0, KEYMASTER_CMD_SIGN_DATA, km_setup_cmd, km_run_cmd },
+	{ "km_cmd_verify", 0, KEYMASTER_CMD_VERIFY_DATA, km_setup_cmd, km_run_cmd },
+	{ "km_rsp_generate", 0, ANDROID_HECI_KEYMASTER_CMD_ID_RSA_GEN_KEY, km_setup_rsp, km_run_rsp },
+	{ "km_rsp_get_public", 0, ANDROID_HECI_KEYMASTER_CMD_ID_RSA_GET_PUBLIC_KEY, km_setup_rsp, km_run_rsp },
+	{ "km_rsp_sign", 0, ANDROID_HECI_KEYMASTER_CMD_ID_RSA_SIGN_DATA_NOPAD, km_setup_rsp, km_run_rsp },
+	{ "km_rsp_verify", 0, ANDROID_HECI_KEYMASTER_CMD_ID_RSA_VERIFY_DATA_NOPAD, km_setup_rsp, km_run_rsp },
+	{ "km_rsp_failure", 0, 0, km_setup_rsp, km_run_rsp },
+	{ "copyswap_copy", 32, DONT_SWAP, swap_setup, swap_run },
+	{ "copyswap_copy", 256, DONT_SWAP, swap_setup, swap_run },
+	{ "copyswap_swap", 32, DO_SWAP, swap_setup, swap_run },
+	{ "copyswap_swap", 256, DO_SWAP, swap_setup, swap_run },
+	{ "copyswap_swap", 4096, DO_SWAP, swap_setup, swap_run },
+	{ "process_cmd", 64, 0, tee_setup, tee_run },
+	{ "process_cmd", 1024, 0, tee_setup, tee_run },
+	{ "process_cmd_gather", 64, 7, tee_setup, tee_run },
+	{ "acd_read", 16, 0, acd_setup, acd_run },
+	{ "acd_read", ACD_FIELD_LENGTH, 0, acd_setup, acd_run },
+	{ "txei_log", 0, TXEI_LOG_LEVEL_DBG, log_setup, log_run },
+	{ "txei_log_filtered", 0, TXEI_LOG_LEVEL_ERR, log_setup, log_run },
+	{ "txei_log_buf", 64, TXEI_LOG_LEVEL_DBG, log_setup, log_run_buf },
+};
+
+static void marshal_run(const struct marshal_case *mc, unsigned int iterations)
+{
+	uint64_t start, elapsed, allocs;
+	unsigned int a;
+	int failed;
+
+	mc->setup(mc);
+	failed = mc->run(mc);
+
+	allocs = __atomic_load_n(&marshal_allocs, __ATOMIC_RELAXED);
+	start = marshal_nsec();
+	for (a = 0; a < iterations; a++)
+		failed |= mc->run(mc);
+	elapsed = marshal_nsec() - start;
+	allocs = __atomic_load_n(&marshal_allocs, __ATOMIC_RELAXED) - allocs;
+
+	printf("%s,%u,%u,%.1f,%.2f,%s\n", mc->name, mc->bytes, iterations,
+	       (double)elapsed / iterations, (double)allocs / iterations,
+	       failed ? "FAIL" : "ok");
+}
+
+static void marshal_usage(const char *prog)
+{
+	printf("Marshalling benchmark: %s [options]\n", prog);
+	printf("	-n <n>		iterations per case (default 100000)\n");
+	printf("	-s <n>		random seed (default 1)\n");
+	printf("	-f <name>	only run cases whose name contains <name>\n");
+	printf("	-v		keep the library's stderr logging\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int iterations = 100000;
+	uint64_t seed = 1;
+	const char *filter = NULL;
+	int verbose = 0;
+	unsigned int c;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:f:vh")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			marshal_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (iterations == 0) {
+		marshal_usage(argv[0]);
+		return 1;
+	}
+
+	marshal_null_fp = fopen("/dev/null", "w");
+	if (!marshal_null_fp) {
+		printf("cannot open /dev/null: %s\n", strerror(errno));
+		return 1;
+	}
+	/*
+	 * Host builds of the ACD and TEE code log to stderr where the target
+	 * logs to logcat; the cost stays in the numbers, the noise does not
+	 */
+	if (!verbose)
+		dup2(fileno(marshal_null_fp), STDERR_FILENO);
+	txei_log_set_dest(TXEI_LOG_DEST_FILE, marshal_null_fp, marshal_null_fp);
+
+	/* The keymaster builders size requests by the key blob size */
+	marshal_respond = km_respond_caps;
+	if (get_caps() != SEP_KEYMASTER_SUCCESS) {
+		printf("keymaster capabilities not accepted\n");
+		return 1;
+	}
+	marshal_respond = NULL;
+
+	if (tee_init(&marshal_guid, &marshal_tee) != 0) {
+		printf("tee_init failed\n");
+		return 1;
+	}
+
+	printf("# seed %" PRIu64 ", key blob %u bytes\n", seed, MARSHAL_KEY_OPAQUE);
+	printf("case,bytes,iterations,ns_per_op,allocs_per_op,check\n");
+	for (c = 0; c < sizeof(marshal_cases) / sizeof(marshal_cases[0]); c++) {
+		if (filter && !strstr(marshal_cases[c].name, filter))
+			continue;
+		/* Same payloads for a case whichever cases ran before it */
+		marshal_rng = seed * 0x9E3779B97F4A7C15ULL + c + 1;
+		marshal_run(&marshal_cases[c], iterations);
+	}
+
+	tee_deinit(marshal_tee);
+	fclose(marshal_null_fp);
+	return 0;
+}
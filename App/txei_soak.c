@@ -0,0 +1,295 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include "txei.h"
+#include "umip_access.h"
+#include "intelkeymaster_firmware_api.h"
+
+/*
+ * Long running soak of the TXEI user space paths. Every cycle does a
+ * raw connect/send/receive/disconnect, a DMA buffer alloc/free, a
+ * keymaster command and an ACD read. Resource usage is sampled at a
+ * fixed interval and the run fails if RSS, open fds or meimm mappings
+ * have grown past the allowed slack by the end.
+ *
+ * Without a TXE, build libtxei with TXEI_FAULT_INJECTION=1 and run
+ * with TXEI_FAULT=standin=1 so the loopback stand-in serves requests.
+ */
+
+/*
+ * sep_keymaster.h cannot be included here: android_heci_agent.h
+ * defines ANDROID_HECI_AGENT_GUID, which sep_keymaster.c already does
+ */
+int sep_keymaster_send_cmd(const uint8_t *cmd_buffer, uint32_t cmd_length,
+	uint8_t *rsp_buffer, uint32_t *rsp_length);
+
+#define SOAK_MSG_SIZE		(64)
+#define SOAK_DMA_SIZE		(4096)
+#define SOAK_KM_RSP_SIZE	(512)
+#define SOAK_ACD_INDEX		(1)
+
+const GUID soak_guid = {0xafa19346, 0x7459, 0x4f09, {0x9d, 0xad, 0x36, 0x61, 0x1f, 0xe4, 0x28, 0x58}};
+
+struct soak_sample {
+	unsigned long rss_kb;
+	unsigned int fds;
+	unsigned int meimm_maps;
+};
+
+struct soak_counts {
+	unsigned long cycles;
+	unsigned long raw_fail;
+	unsigned long dma_fail;
+	unsigned long km_fail;
+	unsigned long acd_fail;
+};
+
+void print_usage(void)
+{
+	printf("Following arguments are needed\n");
+	printf("	1. Duration of the soak in seconds\n");
+	printf("	Following arguments are optional\n");
+	printf("	2. Sampling interval in seconds (default 10)\n");
+	printf("	3. Allowed RSS growth in KB (default 256)\n");
+	printf("	4. Allowed open fd growth (default 0)\n");
+	printf("	The first sample is taken after one interval so that\n");
+	printf("	lazily initialised state is part of the baseline.\n");
+}
+
+static unsigned long soak_rss_kb(void)
+{
+	unsigned long size = 0;
+	unsigned long resident = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/self/statm", "r");
+	if (fp == NULL)
+		return 0;
+	if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+	fclose(fp);
+
+	return resident * (unsigned long)(sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static unsigned int soak_fds(void)
+{
+	struct dirent *entry;
+	unsigned int count = 0;
+	DIR *dir;
+
+	dir = opendir("/proc/self/fd");
+	if (dir == NULL)
+		return 0;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] != '.')
+			count++;
+	}
+	closedir(dir);
+
+	/* Do not count the descriptor opendir itself holds */
+	return count ? count - 1 : 0;
+}
+
+static unsigned int soak_meimm_maps(void)
+{
+	char line[512];
+	unsigned int count = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/self/maps", "r");
+	if (fp == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strstr(line, "meimm") != NULL)
+			count++;
+	}
+	fclose(fp);
+
+	return count;
+}
+
+static void soak_sample(struct soak_sample *sample)
+{
+	sample->rss_kb = soak_rss_kb();
+	sample->fds = soak_fds();
+	sample->meimm_maps = soak_meimm_maps();
+}
+
+static int soak_raw(void)
+{
+	uint8_t snd_buf[SOAK_MSG_SIZE];
+	uint8_t rcv_buf[SOAK_MSG_SIZE];
+	MEI_HANDLE *my_handle_p;
+	int rv;
+
+	my_handle_p = mei_connect(&soak_guid);
+	if (my_handle_p == NULL)
+		return -1;
+
+	memset(snd_buf, 0x5a, sizeof(snd_buf));
+	rv = mei_sndmsg(my_handle_p, snd_buf, sizeof(snd_buf));
+	if (rv == sizeof(snd_buf))
+		rv = mei_rcvmsg(my_handle_p, rcv_buf, sizeof(rcv_buf));
+
+	mei_disconnect(my_handle_p);
+	return (rv < 0) ? -1 : 0;
+}
+
+static int soak_dma(void)
+{
+	MEI_MM_DMA *my_dma;
+
+	my_dma = mei_alloc_dma(SOAK_DMA_SIZE);
+	if (my_dma == NULL)
+		return -1;
+
+	memset(my_dma->dmabuffer, 0xa5, SOAK_DMA_SIZE);
+	mei_clear_dma(my_dma);
+	return 0;
+}
+
+static int soak_keymaster(void)
+{
+	intel_keymaster_firmware_cmd_t cmd;
+	uint8_t rsp_buf[SOAK_KM_RSP_SIZE];
+	uint32_t rsp_length = sizeof(rsp_buf);
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd_id = KEYMASTER_CMD_DELETE_ALL;
+	cmd.cmd_data_length = 0;
+
+	return sep_keymaster_send_cmd((uint8_t *)&cmd, sizeof(cmd), rsp_buf,
+		&rsp_length) ? -1 : 0;
+}
+
+static int soak_acd(void)
+{
+	void *field_data = NULL;
+	int rv;
+
+	rv = get_customer_data(SOAK_ACD_INDEX, &field_data);
+	if (field_data != NULL)
+		free(field_data);
+
+	return (rv < 0) ? -1 : 0;
+}
+
+static void soak_cycle(struct soak_counts *counts)
+{
+	if (soak_raw() != 0)
+		counts->raw_fail++;
+	if (soak_dma() != 0)
+		counts->dma_fail++;
+	if (soak_keymaster() != 0)
+		counts->km_fail++;
+	if (soak_acd() != 0)
+		counts->acd_fail++;
+	counts->cycles++;
+}
+
+int main(int argc, char **argv)
+{
+	struct soak_counts counts;
+	struct soak_sample base;
+	struct soak_sample now;
+	unsigned long duration = 0;
+	unsigned long interval = 10;
+	unsigned long rss_slack = 256;
+	unsigned int fd_slack = 0;
+	time_t start;
+	time_t next;
+	time_t t;
+	int ret_val = 0;
+
+	if ((argc < 2) || (argc > 5)) {
+		printf("Incorrected number of arguments %d\n", argc);
+		print_usage();
+		return -1;
+	}
+
+	if (sscanf(argv[1], "%lu", &duration) != 1 || duration == 0) {
+		printf("could not read duration\n");
+		print_usage();
+		return -1;
+	}
+	if ((argc > 2) && (sscanf(argv[2], "%lu", &interval) != 1 ||
+		interval == 0)) {
+		printf("could not read interval\n");
+		print_usage();
+		return -1;
+	}
+	if ((argc > 3) && (sscanf(argv[3], "%lu", &rss_slack) != 1)) {
+		printf("could not read rss growth\n");
+		print_usage();
+		return -1;
+	}
+	if ((argc > 4) && (sscanf(argv[4], "%u", &fd_slack) != 1)) {
+		printf("could not read fd growth\n");
+		print_usage();
+		return -1;
+	}
+	if (duration <= interval) {
+		printf("duration must be longer than one interval\n");
+		print_usage();
+		return -1;
+	}
+
+	memset(&counts, 0, sizeof(counts));
+	memset(&base, 0, sizeof(base));
+
+	/* Warm up for one interval before taking the baseline */
+	start = time(NULL);
+	next = start + interval;
+	while (time(NULL) < next)
+		soak_cycle(&counts);
+	soak_sample(&base);
+
+	printf("soak: elapsed cycles rss_kb fds meimm_maps\n");
+	printf("soak: %lu %lu %lu %u %u\n", (unsigned long)interval,
+		counts.cycles, base.rss_kb, base.fds, base.meimm_maps);
+
+	now = base;
+	next += interval;
+	while ((t = time(NULL)) < start + (time_t)duration) {
+		soak_cycle(&counts);
+		if (t < next)
+			continue;
+
+		soak_sample(&now);
+		printf("soak: %lu %lu %lu %u %u\n", (unsigned long)(t - start),
+			counts.cycles, now.rss_kb, now.fds, now.meimm_maps);
+		next += interval;
+	}
+	soak_sample(&now);
+
+	printf("soak: %lu cycles, failures raw %lu dma %lu keymaster %lu acd %lu\n",
+		counts.cycles, counts.raw_fail, counts.dma_fail, counts.km_fail,
+		counts.acd_fail);
+
+	if (now.rss_kb > base.rss_kb + rss_slack) {
+		printf("soak: FAIL rss grew from %lu to %lu KB\n",
+			base.rss_kb, now.rss_kb);
+		ret_val = -1;
+	}
+	if (now.fds > base.fds + fd_slack) {
+		printf("soak: FAIL open fds grew from %u to %u\n",
+			base.fds, now.fds);
+		ret_val = -1;
+	}
+	if (now.meimm_maps > base.meimm_maps) {
+		printf("soak: FAIL meimm mappings grew from %u to %u\n",
+			base.meimm_maps, now.meimm_maps);
+		ret_val = -1;
+	}
+	if (ret_val == 0)
+		printf("soak: PASS\n");
+
+	return ret_val;
+}
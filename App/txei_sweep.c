@@ -0,0 +1,330 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "txei.h"
+#include "txei_bench.h"
+
+/*
+ * Message size sweep mode of TXEI_TEST
+ *
+ * Sends requests of increasing size to one client, from a few bytes to
+ * beyond its MaxMessageLength, and records round trip latency and the
+ * effective bandwidth at every size. Sizes step geometrically with a
+ * configurable number of points per doubling. Sizes the client rejects
+ * stay in the curve with their error count, which is how the usable
+ * MTU shows up.
+ */
+
+#define SWEEP_MAX_POINTS	256
+
+enum {
+	SWEEP_BOTH = 0,	/* request size and response buffer move together */
+	SWEEP_REQ,	/* response buffer fixed */
+	SWEEP_RSP	/* request size fixed */
+};
+
+struct sweep_config {
+	GUID guid;
+	uint32_t min_size;
+	uint32_t max_size;
+	uint32_t fixed_size;
+	unsigned int per_octave;
+	unsigned int iterations;
+	unsigned int warmup;
+	int dimension;
+	int per_request;
+	int json;
+};
+
+struct sweep_point {
+	uint32_t snd_size;
+	uint32_t rcv_size;
+	uint64_t ok;
+	uint64_t errors;
+	uint64_t snd_bytes;
+	uint64_t rcv_bytes;
+	struct bench_hist hist;
+};
+
+static void sweep_usage(void)
+{
+	printf("Size sweep: TXEI_TEST -sweep <guid file> [options]\n");
+	printf("	-m <n>		smallest size in bytes (default 4)\n");
+	printf("	-M <n>		largest size in bytes (default twice\n");
+	printf("			MaxMessageLength)\n");
+	printf("	-k <n>		sizes per doubling (default 2)\n");
+	printf("	-x <dim>	both, req or rsp: sweep the request and\n");
+	printf("			response buffer together, or only one of\n");
+	printf("			them (default both)\n");
+	printf("	-s <n>		size of the side that is not swept (default 64)\n");
+	printf("	-n <n>		measured round trips per size (default 200)\n");
+	printf("	-w <n>		unmeasured round trips per size (default 20)\n");
+	printf("	-c		connect for every round trip instead of\n");
+	printf("			once per size\n");
+	printf("	-j		print the curve as JSON instead of CSV\n");
+}
+
+static int sweep_round_trip(struct sweep_config *cfg, MEI_HANDLE **handle,
+	uint8_t *snd_buf, uint32_t snd_size, uint8_t *rcv_buf,
+	uint32_t rcv_size)
+{
+	MEI_HANDLE *my_handle_p = *handle;
+	int rv;
+
+	if (my_handle_p == NULL) {
+		my_handle_p = mei_connect(&cfg->guid);
+		if (my_handle_p == NULL)
+			return -1;
+	}
+
+	rv = mei_sndmsg(my_handle_p, snd_buf, snd_size);
+	if (rv == (int)snd_size)
+		rv = mei_rcvmsg(my_handle_p, rcv_buf, rcv_size);
+	else
+		rv = -1;
+
+	if (rv < 0 || cfg->per_request) {
+		mei_disconnect(my_handle_p);
+		my_handle_p = NULL;
+	}
+	*handle = my_handle_p;
+	return rv;
+}
+
+static void sweep_point_run(struct sweep_config *cfg, struct sweep_point *pt,
+	uint8_t *snd_buf, uint8_t *rcv_buf)
+{
+	MEI_HANDLE *my_handle_p = NULL;
+	uint64_t start;
+	unsigned int a;
+	int rv;
+
+	bench_hist_init(&pt->hist);
+
+	for (a = 0; a < cfg->warmup + cfg->iterations; a++) {
+		start = bench_now_usec();
+		rv = sweep_round_trip(cfg, &my_handle_p, snd_buf, pt->snd_size,
+			rcv_buf, pt->rcv_size);
+		if (a < cfg->warmup)
+			continue;
+
+		if (rv < 0) {
+			pt->errors++;
+			continue;
+		}
+		bench_hist_add(&pt->hist, bench_now_usec() - start);
+		pt->ok++;
+		pt->snd_bytes += pt->snd_size;
+		pt->rcv_bytes += rv;
+	}
+
+	if (my_handle_p != NULL)
+		mei_disconnect(my_handle_p);
+}
+
+/* Bytes moved per microsecond of mean round trip is MB/s */
+static double sweep_bandwidth(const struct sweep_point *pt)
+{
+	if (pt->hist.sum == 0)
+		return 0;
+	return (double)(pt->snd_bytes + pt->rcv_bytes) / (double)pt->hist.sum;
+}
+
+static void sweep_report(struct sweep_config *cfg, uint32_t mtu,
+	struct sweep_point *pts, unsigned int num)
+{
+	unsigned int a;
+
+	if (cfg->json) {
+		printf("{\"guid\":\"");
+		bench_print_guid(stdout, &cfg->guid);
+		printf("\",\"max_message_length\":%u,\"iterations\":%u,"
+			"\"connect_per_request\":%d,\"points\":[",
+			mtu, cfg->iterations, cfg->per_request);
+		for (a = 0; a < num; a++) {
+			printf("%s{\"req_bytes\":%u,\"rsp_buf_bytes\":%u,"
+				"\"rsp_bytes_avg\":%" PRIu64 ",\"ok\":%" PRIu64
+				",\"errors\":%" PRIu64 ",\"min_us\":%u,"
+				"\"p50_us\":%u,\"p99_us\":%u,\"mean_us\":%" PRIu64
+				",\"bw_mbyte_s\":%.3f}",
+				a ? "," : "", pts[a].snd_size, pts[a].rcv_size,
+				pts[a].ok ? pts[a].rcv_bytes / pts[a].ok : 0,
+				pts[a].ok, pts[a].errors,
+				pts[a].ok ? pts[a].hist.min : 0,
+				bench_hist_quantile(&pts[a].hist, 0.5),
+				bench_hist_quantile(&pts[a].hist, 0.99),
+				pts[a].ok ? pts[a].hist.sum / pts[a].ok : 0,
+				sweep_bandwidth(&pts[a]));
+		}
+		printf("]}\n");
+		return;
+	}
+
+	printf("# guid ");
+	bench_print_guid(stdout, &cfg->guid);
+	printf(" MaxMessageLength %u\n", mtu);
+	printf("req_bytes,rsp_buf_bytes,rsp_bytes_avg,ok,errors,min_us,"
+		"p50_us,p99_us,mean_us,bw_mbyte_s\n");
+	for (a = 0; a < num; a++) {
+		printf("%u,%u,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%u,%u,%u,%"
+			PRIu64 ",%.3f\n",
+			pts[a].snd_size, pts[a].rcv_size,
+			pts[a].ok ? pts[a].rcv_bytes / pts[a].ok : 0,
+			pts[a].ok, pts[a].errors,
+			pts[a].ok ? pts[a].hist.min : 0,
+			bench_hist_quantile(&pts[a].hist, 0.5),
+			bench_hist_quantile(&pts[a].hist, 0.99),
+			pts[a].ok ? pts[a].hist.sum / pts[a].ok : 0,
+			sweep_bandwidth(&pts[a]));
+	}
+}
+
+/*
+ * Fills sizes with min, then per_octave steps per doubling up to max.
+ * Integer only, so no libm is needed
+ */
+static unsigned int sweep_sizes(struct sweep_config *cfg, uint32_t *sizes)
+{
+	unsigned int num = 0;
+	unsigned int step;
+	uint64_t base;
+	uint64_t size;
+	uint64_t last = 0;
+
+	for (base = cfg->min_size; base <= cfg->max_size; base *= 2) {
+		for (step = 0; step < cfg->per_octave; step++) {
+			size = base + base * step / cfg->per_octave;
+			if (size > cfg->max_size || num == SWEEP_MAX_POINTS)
+				return num;
+			if (size == last)
+				continue;
+			sizes[num++] = (uint32_t)size;
+			last = size;
+		}
+	}
+	return num;
+}
+
+int txei_sweep_main(int argc, char **argv)
+{
+	struct sweep_config cfg;
+	struct sweep_point *pts;
+	uint32_t sizes[SWEEP_MAX_POINTS];
+	uint8_t *snd_buf;
+	uint8_t *rcv_buf;
+	uint32_t mtu;
+	uint32_t buf_size;
+	unsigned int num;
+	unsigned int a;
+	int opt;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.min_size = 4;
+	cfg.fixed_size = 64;
+	cfg.per_octave = 2;
+	cfg.iterations = 200;
+	cfg.warmup = 20;
+
+	if (argc < 2) {
+		sweep_usage();
+		return -1;
+	}
+	if (bench_read_guid(argv[1], &cfg.guid) != 0) {
+		sweep_usage();
+		return -1;
+	}
+
+	optind = 2;
+	while ((opt = getopt(argc, argv, "m:M:k:x:s:n:w:cj")) != -1) {
+		switch (opt) {
+		case 'm':
+			cfg.min_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'M':
+			cfg.max_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			cfg.per_octave = strtoul(optarg, NULL, 0);
+			break;
+		case 'x':
+			if (strcmp(optarg, "both") == 0) {
+				cfg.dimension = SWEEP_BOTH;
+			} else if (strcmp(optarg, "req") == 0) {
+				cfg.dimension = SWEEP_REQ;
+			} else if (strcmp(optarg, "rsp") == 0) {
+				cfg.dimension = SWEEP_RSP;
+			} else {
+				sweep_usage();
+				return -1;
+			}
+			break;
+		case 's':
+			cfg.fixed_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			cfg.iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			cfg.warmup = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			cfg.per_request = 1;
+			break;
+		case 'j':
+			cfg.json = 1;
+			break;
+		default:
+			sweep_usage();
+			return -1;
+		}
+	}
+
+	mtu = bench_probe_mtu(&cfg.guid);
+	if (mtu == 0) {
+		printf("sweep: cannot connect to client\n");
+		return -1;
+	}
+	if (cfg.max_size == 0)
+		cfg.max_size = 2 * mtu;
+
+	if (cfg.min_size == 0 || cfg.min_size > cfg.max_size ||
+	    cfg.per_octave == 0 || cfg.iterations == 0 ||
+	    cfg.fixed_size == 0) {
+		printf("sweep: bad sizes or counts\n");
+		sweep_usage();
+		return -1;
+	}
+
+	num = sweep_sizes(&cfg, sizes);
+
+	buf_size = (cfg.max_size > cfg.fixed_size) ? cfg.max_size : cfg.fixed_size;
+	pts = calloc(num, sizeof(struct sweep_point));
+	snd_buf = malloc(buf_size);
+	rcv_buf = malloc(buf_size);
+	if (pts == NULL || snd_buf == NULL || rcv_buf == NULL) {
+		printf("sweep: cannot allocate buffers\n");
+		free(pts);
+		free(snd_buf);
+		free(rcv_buf);
+		return -1;
+	}
+	memset(snd_buf, 0x5a, buf_size);
+
+	for (a = 0; a < num; a++) {
+		pts[a].snd_size = (cfg.dimension == SWEEP_RSP) ?
+			cfg.fixed_size : sizes[a];
+		pts[a].rcv_size = (cfg.dimension == SWEEP_REQ) ?
+			cfg.fixed_size : sizes[a];
+		sweep_point_run(&cfg, &pts[a], snd_buf, rcv_buf);
+	}
+
+	sweep_report(&cfg, mtu, pts, num);
+
+	free(pts);
+	free(snd_buf);
+	free(rcv_buf);
+	return 0;
+}
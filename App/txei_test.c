@@ -10,6 +10,7 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 #include "txei.h"
+#include "txei_bench.h"
 #include <time.h>
 
 #define GUID_BUF_LENGTH	(11)
@@ -37,6 +38,10 @@ void print_usage(void)
 	printf("	5. Name of output message file (binary file) - means no file\n");
 	printf("	6. Name of second output message file (binary file) - means no file\n");
 	printf("	7. Timeout in seconds, prior to disconnect. - means no timeout.\n");
+	printf("\nTXEI_TEST -load <guid file> [options] runs the load generator.\n");
+	printf("TXEI_TEST -sweep <guid file> [options] measures latency and\n");
+	printf("bandwidth over a range of message sizes.\n");
+	printf("Either mode with no further arguments lists its options.\n");
 }
 
 int main(int argc, char **argv)
@@ -67,6 +72,11 @@ int main(int argc, char **argv)
 	/* By default disconnect timeout is set to 1 seconds */
 	uint32_t disconnect_timeout = 1;
 
+	if ((argc > 1) && (strcmp(argv[1], "-load") == 0))
+		return txei_load_main(argc - 1, argv + 1);
+	if ((argc > 1) && (strcmp(argv[1], "-sweep") == 0))
+		return txei_sweep_main(argc - 1, argv + 1);
+
 	if ((argc != 6) && (argc != 7) && (argc != 8)) {
 		printf("Incorrected number of arguments %d\n", argc);
 		print_usage();
@@ -8,10 +8,18 @@ LOCAL_COPY_HEADERS_TO := libtxei
 LOCAL_COPY_HEADERS += inc/txei.h
 
 LOCAL_SRC_FILES += txei_lib.c
+LOCAL_SRC_FILES += common/src/mei_buf.c
+#
+# Build with TXEI_FAULT_INJECTION=1 to get the latency and fault
+# injection shim, see inc/txei_fault.h
+ifneq ($(TXEI_FAULT_INJECTION),)
+LOCAL_SRC_FILES += txei_fault.c
+LOCAL_CFLAGS += -DTXEI_FAULT_INJECTION
+endif
 #
 LOCAL_SHARED_LIBRARIES := libcutils libc
 #
-LOCAL_C_INCLUDES := $(LOCAL_PATH)/inc
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/inc $(LOCAL_PATH)/common/inc
 #
 LOCAL_MODULE := libtxei
 #
@@ -26,10 +34,18 @@ LOCAL_COPY_HEADERS_TO := libtxei
 LOCAL_COPY_HEADERS += inc/txei.h
 
 LOCAL_SRC_FILES += txei_lib.c
+LOCAL_SRC_FILES += common/src/mei_buf.c
+#
+# Build with TXEI_FAULT_INJECTION=1 to get the latency and fault
+# injection shim, see inc/txei_fault.h
+ifneq ($(TXEI_FAULT_INJECTION),)
+LOCAL_SRC_FILES += txei_fault.c
+LOCAL_CFLAGS += -DTXEI_FAULT_INJECTION
+endif
 #
 LOCAL_STATIC_LIBRARIES := libcutils libc
 #
-LOCAL_C_INCLUDES := $(LOCAL_PATH)/inc
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/inc $(LOCAL_PATH)/common/inc
 #
 LOCAL_MODULE := libtxei
 #
@@ -58,7 +74,9 @@ sec_tool_lib/inc/acds_module_error.h \
 
 LOCAL_SRC_FILES += txei_lib.c   \
 $(LOCAL_SEC_DIR)/src/umip_access.c                   \
-$(LOCAL_COMMON_DIR)/src/tee_if.c
+$(LOCAL_COMMON_DIR)/src/tee_if.c                     \
+$(LOCAL_COMMON_DIR)/src/tee_byteorder.c              \
+$(LOCAL_COMMON_DIR)/src/mei_buf.c
 
 LOCAL_CFLAGS := -DBAYTRAIL -DACD_WIPE_TEST
 
@@ -18,6 +18,8 @@ LOCAL_EXPORT_C_INCLUDE_DIRS := inc
 LOCAL_SRC_FILES += \
 	$(TXEI_LIB_DIR)/txei_lib.c          \
 	$(TXEI_LIB_DIR)/common/src/tee_if.c \
+	$(TXEI_LIB_DIR)/common/src/tee_byteorder.c \
+	$(TXEI_LIB_DIR)/common/src/mei_buf.c        \
 	src/ipt_tee_interface.c             \
 	src/ipt.c                           \
 	src/mvfw_api.c
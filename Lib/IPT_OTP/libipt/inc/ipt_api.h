@@ -47,4 +47,23 @@ uint32_t ipt_send_message(uint16_t data_in_length,
                           uint16_t *data_out_length,
                           uint8_t  *out_data);
 
+/*!
+ * @brief completion of ipt_send_message_async, status is what
+ * ipt_send_message would have returned
+ */
+typedef void (*ipt_send_callback)(void *ctx, uint32_t status);
+
+/*!
+ * @brief send data to chaabi ipt applet without waiting for the reply.
+ * data_out_length and out_data are filled in, as by ipt_send_message,
+ * before callback runs from tee_async_poll() and must stay valid until
+ * then. callback does not run when an error is returned.
+ */
+uint32_t ipt_send_message_async(uint16_t data_in_length,
+                                uint8_t  *in_data,
+                                uint16_t *data_out_length,
+                                uint8_t  *out_data,
+                                ipt_send_callback callback,
+                                void *ctx);
+
 #endif // __IPT_API_H__
@@ -78,4 +78,21 @@ uint32_t mvsepfw_sendmessage(const uint8_t  *in_data,
                              uint8_t *data_out,
                              uint32_t *out_data_length);
 
+/*!
+ * @brief completion of mvsepfw_sendmessage_async, status is what
+ * mvsepfw_sendmessage would have returned
+ */
+typedef void (*mvfw_send_callback)(void *ctx, uint32_t status);
+
+/*!
+ * @brief sends mediavault message to chaabi ipt applet without waiting
+ * for the reply, see mvsepfw_sendmessage_async in mvfw_api.c
+ */
+uint32_t mvsepfw_sendmessage_async(const uint8_t  *in_data,
+                                   const uint32_t data_in_length,
+                                   uint8_t *data_out,
+                                   uint32_t *out_data_length,
+                                   mvfw_send_callback callback,
+                                   void *ctx);
+
 #endif // __MVFW_API_H__
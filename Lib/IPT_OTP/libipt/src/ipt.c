@@ -22,6 +22,7 @@
  *************************************************************************/
 
 #include <inttypes.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "tee_types.h"
@@ -79,21 +80,13 @@ uint32_t ipt_disconnect()
 struct ipt_send_msg_cmd_from_host g_req_param;
 struct ipt_send_msg_cmd_to_host g_resp_param;
 /*
- * @brief ipt send/receive data
+ * @brief checks the arguments of ipt_send_message
  */
-uint32_t ipt_send_message(uint16_t in_data_length,
-                          uint8_t *in_data,
-                          uint16_t *out_data_length,
-                          uint8_t *out_data)
+static uint32_t ipt_check_params(uint16_t in_data_length,
+                                 const uint8_t *in_data,
+                                 const uint16_t *out_data_length,
+                                 const uint8_t *out_data)
 {
-    uint32_t ret = IPT_SUCCESS;
-    struct data_buffer cmd_data_in;
-    struct data_buffer cmd_data_out;
-	void *ptrHandle;
-    struct timeval t_val; // TEMP
-
-    Enter("");
-
     if (in_data == NULL ||
         out_data_length == NULL ||
         out_data == NULL)
@@ -109,23 +102,31 @@ uint32_t ipt_send_message(uint16_t in_data_length,
         return IPT_FAIL_INVALID_PARAM;
     }
 
-	ret = ipt_tee_intf_init(&IPT_HECI_CLIENT_GUID, &ptrHandle);
-	if ((ret != IPT_SUCCESS) || (ptrHandle == NULL)) {
-		LOGERR("Failed to init IPT TEE interface, err=0x%X\n", ret);
-		return ret;
-	}
+    return IPT_SUCCESS;
+}
 
-    /*! Initialize API return params */
-    memset(out_data, 0, *out_data_length);
+/*
+ * @brief builds the send message request and links the request and
+ * response into the TEE parameters
+ */
+static void ipt_fill_request(struct ipt_send_msg_cmd_from_host *req_param,
+                             struct ipt_send_msg_cmd_to_host *resp_param,
+                             struct data_buffer *cmd_data_in,
+                             struct data_buffer *cmd_data_out,
+                             uint16_t in_data_length,
+                             const uint8_t *in_data,
+                             uint16_t out_data_length)
+{
+    struct timeval t_val; // TEMP
 
     /*! Initialize fw parameters to zero */
-    memset(&g_req_param, 0, sizeof(g_req_param));
-    memset(&g_resp_param, 0, sizeof(g_resp_param));
-    memset(&cmd_data_in, 0, sizeof(cmd_data_in));
-    memset(&cmd_data_out, 0, sizeof(cmd_data_out));
+    memset(req_param, 0, sizeof(*req_param));
+    memset(resp_param, 0, sizeof(*resp_param));
+    memset(cmd_data_in, 0, sizeof(*cmd_data_in));
+    memset(cmd_data_out, 0, sizeof(*cmd_data_out));
 
-	g_req_param.header.cmd_id = IPT_SEND_MSG_CMD_ID;
-	g_req_param.header.status = IPT_SUCCESS;
+	req_param->header.cmd_id = IPT_SEND_MSG_CMD_ID;
+	req_param->header.status = IPT_SUCCESS;
 
     /* As Chaabi is dword aligned, we have to make sure
      * each data field in the data blob that we send to it
@@ -134,19 +135,76 @@ uint32_t ipt_send_message(uint16_t in_data_length,
      * With this casting effort, we may isolate libiha
      * from h/w specific requirements on data alignment.
      */
-    g_req_param.in_data_length = (uint32_t)in_data_length;
-    g_req_param.expected_out_data_length = (uint32_t)(*out_data_length);
+    req_param->in_data_length = (uint32_t)in_data_length;
+    req_param->expected_out_data_length = (uint32_t)out_data_length;
 
     /* Initialize fw parameters to data values */
-    memcpy(g_req_param.in_data, in_data, in_data_length);
+    memcpy(req_param->in_data, in_data, in_data_length);
 
     //TODO: remove this once SRTC is enabled in the firmware
     gettimeofday(&t_val, NULL);
-    g_req_param.time = t_val.tv_sec;
+    req_param->time = t_val.tv_sec;
 
     /*! Initialize TEE parameters */
-    INIT_FROM_HOST_PARAM_BUF(cmd_data_in, &g_req_param, sizeof(g_req_param));
-    INIT_TO_HOST_PARAM_BUF(cmd_data_out, &g_resp_param, sizeof(g_resp_param));
+    INIT_FROM_HOST_PARAM_BUF(cmd_data_in[0], req_param, sizeof(*req_param));
+    INIT_TO_HOST_PARAM_BUF(cmd_data_out[0], resp_param, sizeof(*resp_param));
+}
+
+/*
+ * @brief returns the firmware status of a response and copies its data
+ * out when the command succeeded
+ */
+static uint32_t ipt_read_response(const struct ipt_send_msg_cmd_to_host *resp_param,
+                                  uint16_t *out_data_length,
+                                  uint8_t *out_data)
+{
+    /* Only the lower two bytes of out_data_length is used. This
+     * is safe when copying out_data_length bytes of data to out_data.
+     */
+	if (resp_param->header.status != IPT_SUCCESS) {
+		LOGERR("IPT command failed status=%u\n", resp_param->header.status);
+		return resp_param->header.status;
+	}
+
+    *out_data_length = (uint16_t)(resp_param->out_data_length);
+	if (resp_param->out_data_length != 0) {
+	    memcpy(out_data, resp_param->out_data, (uint16_t)(resp_param->out_data_length));
+	}
+
+    return IPT_SUCCESS;
+}
+
+/*
+ * @brief ipt send/receive data
+ */
+uint32_t ipt_send_message(uint16_t in_data_length,
+                          uint8_t *in_data,
+                          uint16_t *out_data_length,
+                          uint8_t *out_data)
+{
+    uint32_t ret = IPT_SUCCESS;
+    struct data_buffer cmd_data_in;
+    struct data_buffer cmd_data_out;
+	void *ptrHandle;
+
+    Enter("");
+
+    ret = ipt_check_params(in_data_length, in_data, out_data_length, out_data);
+    if (ret != IPT_SUCCESS) {
+        return ret;
+    }
+
+	ret = ipt_tee_intf_init(&IPT_HECI_CLIENT_GUID, &ptrHandle);
+	if ((ret != IPT_SUCCESS) || (ptrHandle == NULL)) {
+		LOGERR("Failed to init IPT TEE interface, err=0x%X\n", ret);
+		return ret;
+	}
+
+    /*! Initialize API return params */
+    memset(out_data, 0, *out_data_length);
+
+    ipt_fill_request(&g_req_param, &g_resp_param, &cmd_data_in, &cmd_data_out,
+                     in_data_length, in_data, *out_data_length);
 
 	/* Currently the second argument cmd_id is NOT being used.
 	 * So just pass it with IPT_SEND_MSG_CMD_ID.
@@ -161,29 +219,110 @@ uint32_t ipt_send_message(uint16_t in_data_length,
         goto disconnect_mei;
     }
 
-    /* Only the lower two bytes of out_data_length is used. This
-     * is safe when copying out_data_length bytes of data to out_data.
-     */
-	if (g_resp_param.header.status != IPT_SUCCESS) {
-		LOGERR("IPT command failed status=%u\n", g_resp_param.header.status);
-		ret = g_resp_param.header.status;
-		goto disconnect_mei;
-	}
-
-    *out_data_length = (uint16_t)(g_resp_param.out_data_length);
-	if (g_resp_param.out_data_length != 0) {
-	    memcpy(out_data, g_resp_param.out_data, (uint16_t)(g_resp_param.out_data_length));
-	}
+    ret = ipt_read_response(&g_resp_param, out_data_length, out_data);
 
 disconnect_mei:
 	if (ptrHandle != NULL)
 	{
-		if ((ret = ipt_tee_intf_deinit(ptrHandle)) != IPT_SUCCESS)
+		/* Do not let a clean deinit hide the status of the command */
+		if (ipt_tee_intf_deinit(ptrHandle) != IPT_SUCCESS)
 		{
-			LOGERR("Failed to deinit IPT TEE interface, err=%u\n", ret);
+			LOGERR("Failed to deinit IPT TEE interface\n");
 		}
 		ptrHandle = NULL;
 	}
 
     return ret;
 }
+
+/*
+ * State of one ipt_send_message_async call. The message buffers live
+ * here rather than in g_req_param and g_resp_param, since several calls
+ * can be outstanding at once
+ */
+struct ipt_send_async {
+    void *ptrHandle;
+    struct ipt_send_msg_cmd_from_host req_param;
+    struct ipt_send_msg_cmd_to_host resp_param;
+    uint16_t *out_data_length;
+    uint8_t *out_data;
+    ipt_send_callback callback;
+    void *ctx;
+};
+
+static void ipt_send_done(void *ctx, uint32_t status)
+{
+    struct ipt_send_async *op = ctx;
+    uint32_t ret = status;
+
+    if (ret != IPT_SUCCESS)
+        LOGERR("process_cmd failed. error(0x%x)\n", ret);
+    else
+        ret = ipt_read_response(&op->resp_param, op->out_data_length, op->out_data);
+
+    if (ipt_tee_intf_deinit(op->ptrHandle) != IPT_SUCCESS)
+        LOGERR("Failed to deinit IPT TEE interface\n");
+
+    op->callback(op->ctx, ret);
+    free(op);
+}
+
+/*
+ * @brief ipt send data, the response is delivered to callback
+ */
+uint32_t ipt_send_message_async(uint16_t in_data_length,
+                                uint8_t *in_data,
+                                uint16_t *out_data_length,
+                                uint8_t *out_data,
+                                ipt_send_callback callback,
+                                void *ctx)
+{
+    uint32_t ret = IPT_SUCCESS;
+    struct data_buffer cmd_data_in;
+    struct data_buffer cmd_data_out;
+    struct ipt_send_async *op;
+
+    Enter("");
+
+    if (callback == NULL) {
+        LOGERR("Invalid NULL params.\n");
+        return IPT_FAIL_NULL_PARAM;
+    }
+    ret = ipt_check_params(in_data_length, in_data, out_data_length, out_data);
+    if (ret != IPT_SUCCESS) {
+        return ret;
+    }
+
+    op = calloc(1, sizeof(*op));
+    if (op == NULL) {
+        LOGERR("Failed to allocate the request\n");
+        return IPT_FAILURE;
+    }
+    op->out_data_length = out_data_length;
+    op->out_data = out_data;
+    op->callback = callback;
+    op->ctx = ctx;
+
+	ret = ipt_tee_intf_init(&IPT_HECI_CLIENT_GUID, &op->ptrHandle);
+	if ((ret != IPT_SUCCESS) || (op->ptrHandle == NULL)) {
+		LOGERR("Failed to init IPT TEE interface, err=0x%X\n", ret);
+		free(op);
+		return ret;
+	}
+
+    /*! Initialize API return params */
+    memset(out_data, 0, *out_data_length);
+
+    ipt_fill_request(&op->req_param, &op->resp_param, &cmd_data_in, &cmd_data_out,
+                     in_data_length, in_data, *out_data_length);
+
+    ret = process_cmd_async(op->ptrHandle, IPT_SEND_MSG_CMD_ID, &cmd_data_in,
+                            &cmd_data_out, 1, ipt_send_done, op);
+    if (ret != IPT_SUCCESS) {
+        LOGERR("process_cmd_async failed. error(0x%x)\n", ret);
+        ipt_tee_intf_deinit(op->ptrHandle);
+        free(op);
+    }
+
+    return ret;
+}
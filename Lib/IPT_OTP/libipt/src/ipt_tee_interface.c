@@ -33,12 +33,15 @@
 #define LOG_TAG      "libipt"
 #include "sepdrm-log.h"
 
+/* IPT and MVFW calls each open the client, keep it open between them */
+#define IPT_SESSION_IDLE_MS	30000
+
 uint32_t ipt_tee_intf_init(const GUID *guid, void **ptrHandle)
 {
 	uint32_t ret = IPT_SUCCESS;
 
 	Enter("");
-	ret = tee_init(guid, ptrHandle);
+	ret = tee_init_shared(guid, ptrHandle, IPT_SESSION_IDLE_MS);
 	if (ret != IPT_SUCCESS)
 		LOGERR("tee_init() failed, err=0x%X", ret);
 
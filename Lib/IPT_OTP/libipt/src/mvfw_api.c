@@ -49,6 +49,74 @@ extern GUID IPT_HECI_CLIENT_GUID;
 extern struct ipt_send_msg_cmd_from_host g_req_param;
 extern struct ipt_send_msg_cmd_to_host g_resp_param;
 
+/*
+ * Builds the request for cmd_id and links the request and response into
+ * the TEE parameters
+ */
+static void mvfw_fill_request(
+		const uint32_t cmd_id,
+		struct ipt_send_msg_cmd_from_host *req_param,
+		struct ipt_send_msg_cmd_to_host *resp_param,
+		struct data_buffer *cmd_data_in,
+		struct data_buffer *cmd_data_out,
+		const uint8_t * const in_data,
+		const uint32_t in_data_length,
+		const uint32_t * const out_data_length)
+{
+	/*! Initialize fw parameters to zero */
+	memset(req_param, 0, sizeof(*req_param));
+	memset(resp_param, 0, sizeof(*resp_param));
+	memset(cmd_data_in, 0, sizeof(*cmd_data_in));
+	memset(cmd_data_out, 0, sizeof(*cmd_data_out));
+
+	req_param->header.cmd_id = cmd_id;
+	req_param->header.status = MVFW_SUCCESS;
+
+	resp_param->header.cmd_id = cmd_id;
+	resp_param->header.status = MVFW_SUCCESS;
+
+	if (cmd_id == MVFW_SEND_MSG_CMD_ID) {
+		/* Initialize fw parameters to data values */
+		req_param->in_data_length = in_data_length;
+		req_param->expected_out_data_length = *out_data_length;
+		memcpy(req_param->in_data, in_data, in_data_length);
+
+		resp_param->out_data_length = *out_data_length;
+	}
+
+	/*! Initialize TEE parameters */
+	INIT_FROM_HOST_PARAM_BUF(cmd_data_in[0], req_param, sizeof(*req_param));
+	INIT_TO_HOST_PARAM_BUF(cmd_data_out[0], resp_param, sizeof(*resp_param));
+}
+
+/*
+ * Returns the firmware status carried back in the response and, for a
+ * message that succeeded, copies its data out
+ */
+static uint32_t mvfw_read_response(
+		const uint32_t cmd_id,
+		const struct ipt_send_msg_cmd_to_host *resp_param,
+		uint8_t * const out_data,
+		uint32_t * const out_data_length)
+{
+	/* The return status from the firmware is carried back in resp_param->header */
+	uint32_t ret = resp_param->header.status;
+
+	if (cmd_id == MVFW_SEND_MSG_CMD_ID) {
+		if (ret != MVFW_SUCCESS) {
+			LOGERR("MVFW command process failed, status=%u\n", resp_param->header.status);
+			return ret;
+		}
+
+		*out_data_length = resp_param->out_data_length;
+		if (resp_param->out_data_length != 0) {
+			memcpy(out_data, resp_param->out_data, resp_param->out_data_length);
+		}
+	}
+
+	return ret;
+}
+
 static uint32_t mvfw_cmd(
 		const uint32_t cmd_id,
 		const uint8_t * const in_data,
@@ -78,30 +146,8 @@ static uint32_t mvfw_cmd(
 		return ret;
 	}
 
-	/*! Initialize fw parameters to zero */
-	memset(&g_req_param, 0, sizeof(g_req_param));
-	memset(&g_resp_param, 0, sizeof(g_resp_param));
-	memset(&cmd_data_in, 0, sizeof(cmd_data_in));
-	memset(&cmd_data_out, 0, sizeof(cmd_data_out));
-
-	g_req_param.header.cmd_id = cmd_id;
-	g_req_param.header.status = MVFW_SUCCESS;
-
-	g_resp_param.header.cmd_id = cmd_id;
-	g_resp_param.header.status = MVFW_SUCCESS;
-
-	if (cmd_id == MVFW_SEND_MSG_CMD_ID) {
-		/* Initialize fw parameters to data values */
-		g_req_param.in_data_length = in_data_length;
-		g_req_param.expected_out_data_length = *out_data_length;
-		memcpy(g_req_param.in_data, in_data, in_data_length);
-
-		g_resp_param.out_data_length = *out_data_length;
-	}
-
-	/*! Initialize TEE parameters */
-	INIT_FROM_HOST_PARAM_BUF(cmd_data_in, &g_req_param, sizeof(g_req_param));
-	INIT_TO_HOST_PARAM_BUF(cmd_data_out, &g_resp_param, sizeof(g_resp_param));
+	mvfw_fill_request(cmd_id, &g_req_param, &g_resp_param, &cmd_data_in, &cmd_data_out,
+			  in_data, in_data_length, out_data_length);
 
 	/* Currently the second argument cmd_id is NOT being used.
 	 * So just pass it with cmd_id.
@@ -116,20 +162,7 @@ static uint32_t mvfw_cmd(
 		goto disconnect_mei;
 	}
 
-	/* The return status from the firmware is carried back in g_resp_param.header */
-	ret = g_resp_param.header.status;
-
-	if (cmd_id == MVFW_SEND_MSG_CMD_ID) {
-		if (ret != MVFW_SUCCESS) {
-			LOGERR("MVFW command process failed, status=%u\n", g_resp_param.header.status);
-			goto disconnect_mei;
-		}
-
-		*out_data_length = g_resp_param.out_data_length;
-		if (g_resp_param.out_data_length != 0) {
-			memcpy(out_data, g_resp_param.out_data, g_resp_param.out_data_length);
-		}
-	}
+	ret = mvfw_read_response(cmd_id, &g_resp_param, out_data, out_data_length);
 
 disconnect_mei:
 	if (ptrHandle != NULL)
@@ -215,3 +248,110 @@ uint32_t mvsepfw_sendmessage(const uint8_t *in_data,
 
 	return MVFW_SUCCESS;
 }
+
+/*
+ * State of one mvsepfw_sendmessage_async call. The message buffers live
+ * here rather than in g_req_param and g_resp_param, since several calls
+ * can be outstanding at once
+ */
+struct mvfw_send_async {
+	void *ptrHandle;
+	struct ipt_send_msg_cmd_from_host req_param;
+	struct ipt_send_msg_cmd_to_host resp_param;
+	uint8_t *out_data;
+	uint32_t *out_data_length;
+	mvfw_send_callback callback;
+	void *ctx;
+};
+
+static void mvfw_send_done(void *ctx, uint32_t status)
+{
+	struct mvfw_send_async *op = ctx;
+	uint32_t ret = status;
+
+	if (ret)
+		LOGERR("tee_process_cmd failed. error(0x%x)\n", ret);
+	else
+		ret = mvfw_read_response(MVFW_SEND_MSG_CMD_ID, &op->resp_param,
+					 op->out_data, op->out_data_length);
+
+	if (ipt_tee_intf_deinit(op->ptrHandle) != MVFW_SUCCESS)
+		LOGERR("Failed to deinit IPT TEE interface\n");
+
+	op->callback(op->ctx, ret);
+	free(op);
+}
+
+/**
+ * mvsepfw_sendmessage_async
+ *
+ * Send message to Chaabi FW without waiting for the response.
+ *
+ * Parameters
+ *  @param[in]     in_data - Pointer to message to be sent.
+ *  @param[in]     in_data_length - Length of message to be sent.
+ *  @param[out]    out_data  - Pointer to buffer to receive response.
+ *  @param[in/out] out_data_length - Pointer to length of output buffer.
+ *      Updated to response length before callback runs.
+ *  @param[in]     callback - Called from tee_async_poll() with the status
+ *      mvsepfw_sendmessage would have returned. Not called when an
+ *      error is returned.
+ *  @param[in]     ctx - Passed to callback.
+ *
+ */
+uint32_t mvsepfw_sendmessage_async(const uint8_t *in_data,
+								   const uint32_t in_data_length,
+								   uint8_t *out_data,
+								   uint32_t *out_data_length,
+								   mvfw_send_callback callback,
+								   void *ctx)
+{
+	uint32_t ret = MVFW_SUCCESS;
+	struct data_buffer cmd_data_in;
+	struct data_buffer cmd_data_out;
+	struct mvfw_send_async *op;
+
+	Enter("");
+	/* Check parameters */
+	if ((in_data == NULL) || (in_data_length == 0) ||
+			(in_data_length > MAX_MSG_FROM_HOST_LENGTH_IN_BYTES) ||
+			(out_data == NULL) || (out_data_length == NULL) ||
+			(callback == NULL)) {
+		LOGERR("Invalid input\n");
+		return MVFW_FAIL_INVALID_PARAM;
+	}
+
+	op = calloc(1, sizeof(*op));
+	if (op == NULL) {
+		LOGERR("Failed to allocate the request\n");
+		return MVFW_FAIL_MALLOC;
+	}
+	op->out_data = out_data;
+	op->out_data_length = out_data_length;
+	op->callback = callback;
+	op->ctx = ctx;
+
+	ret = ipt_tee_intf_init(&IPT_HECI_CLIENT_GUID, &op->ptrHandle);
+	if ((ret != MVFW_SUCCESS) || (op->ptrHandle == NULL)) {
+		LOGERR("Failed to init IPT TEE interface, err=0x%X\n", ret);
+		free(op);
+		return ret;
+	}
+
+	/*! Initialize API return params */
+	memset(out_data, 0, *out_data_length);
+
+	mvfw_fill_request(MVFW_SEND_MSG_CMD_ID, &op->req_param, &op->resp_param,
+			  &cmd_data_in, &cmd_data_out, in_data, in_data_length,
+			  out_data_length);
+
+	ret = process_cmd_async(op->ptrHandle, MVFW_SEND_MSG_CMD_ID, &cmd_data_in,
+				&cmd_data_out, 1, mvfw_send_done, op);
+	if (ret) {
+		LOGERR("tee_process_cmd failed. error(0x%x)\n", ret);
+		ipt_tee_intf_deinit(op->ptrHandle);
+		free(op);
+	}
+
+	return ret;
+}
@@ -0,0 +1,50 @@
+/**********************************************************************
+ * Copyright (C) 2012 Intel Corporation. All rights reserved.
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **********************************************************************/
+/*
+ * mei_buf.h
+ *
+ * Per thread cache of firmware message buffers, shared by libtxei and
+ * the keymaster driver. Both export it as mei_buf_get/mei_buf_put.
+ */
+
+#ifndef __MEI_BUF_H_
+#define __MEI_BUF_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Gets a message buffer of at least size bytes from the calling
+ * thread's cache. Contents are not cleared. Returns NULL if memory is
+ * exhausted
+ */
+void *mei_buf_get(size_t size);
+
+/*
+ * Wipes the size bytes asked for and returns the buffer to the calling
+ * thread's cache, or frees it if the cache for its size is full. NULL
+ * is ignored
+ */
+void mei_buf_put(void *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __MEI_BUF_H_ */
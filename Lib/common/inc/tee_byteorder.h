@@ -0,0 +1,64 @@
+/**********************************************************************
+ * Copyright (C) 2012 Intel Corporation. All rights reserved.
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **********************************************************************/
+/*
+ * tee_byteorder.h
+ *
+ * Byte order conversion of firmware operands: whole buffer reversal for
+ * big numbers such as RSA moduli and exponents, and swapping of arrays
+ * of 16, 32 and 64 bit words. The kernel is picked once from cpuid:
+ * AVX2, then SSSE3, then plain C.
+ */
+
+#ifndef __TEE_BYTEORDER_H_
+#define __TEE_BYTEORDER_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Writes the len bytes of src to dst in reverse order. dst may equal
+ * src, any other overlap is undefined
+ */
+void tee_bswap_buf(void *dst, const void *src, size_t len);
+
+/* Reverses the len bytes of buf in place */
+void tee_bswap_buf_inplace(void *buf, size_t len);
+
+/*
+ * Byte swaps count 16, 32 or 64 bit words from src into dst, which may
+ * be the same buffer. Neither needs to be aligned
+ */
+void tee_bswap16_array(void *dst, const void *src, size_t count);
+void tee_bswap32_array(void *dst, const void *src, size_t count);
+void tee_bswap64_array(void *dst, const void *src, size_t count);
+
+/* Name of the kernel in use: "avx2", "ssse3" or "scalar" */
+const char *tee_bswap_kernel(void);
+
+/*
+ * Pins the kernel for benchmarks and tests. Returns 0, or -1 when the
+ * CPU or the build does not have it
+ */
+int tee_bswap_select(const char *kernel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TEE_BYTEORDER_H_ */
@@ -164,9 +164,46 @@ enum tee_cmd_type {
 };
 
 
+/*
+ * tee_init opens a connection to the client and tee_deinit closes it.
+ * Once an idle timeout is set with tee_session_set_idle_timeout, the
+ * connection is shared with every other tee_init of the same GUID in
+ * the process and tee_deinit only drops the reference: a connection
+ * nobody references is kept open for the idle timeout and reused by
+ * the next tee_init. process_cmd serializes the commands sent on a
+ * shared connection.
+ */
 uint32_t tee_init(const GUID *guid, void **ptrHandle);
 uint32_t tee_deinit(void *ptrHandle);
 
+/*
+ * Same as tee_init, sharing the connection and keeping it open for
+ * idle_ms after the last tee_deinit whatever the process wide timeout;
+ * 0 uses that timeout, as tee_init does. Client libraries that make
+ * many short calls, such as ACD and IPT, open their connections this
+ * way.
+ */
+uint32_t tee_init_shared(const GUID *guid, void **ptrHandle, uint32_t idle_ms);
+
+/*
+ * Sets how long a connection from tee_init stays open unreferenced; 0,
+ * the default, stops tee_init from caching and closes every idle
+ * connection
+ */
+void tee_session_set_idle_timeout(uint32_t msec);
+
+/* Closes every connection that is not referenced */
+void tee_session_flush(void);
+
+/*
+ * Sends the first num_params entries of buf_ptr_in to firmware as one
+ * message and reads the response into buf_ptr_out. Inline parameters
+ * are concatenated in order, so a payload can stay in caller memory
+ * instead of being copied into the command struct, and the response
+ * fills the inline outputs in order. Entries with a NULL buffer or zero
+ * size are skipped. A failed command is retried as its
+ * tee_retry_policy allows.
+ */
 uint32_t process_cmd(
 	MEI_HANDLE *ptrHandle,
 	uint32_t cmd_id,
@@ -174,6 +211,185 @@ uint32_t process_cmd(
 	struct data_buffer buf_ptr_out[],
 	uint32_t num_params);
 
+/*
+ * How process_cmd retries a command. An entry matches cmd_id and the
+ * bits of sub_mask in the request header word (see tee_cmd_stats);
+ * sub_mask 0 matches every request with that cmd_id.
+ *
+ * Commands that are not idempotent are resent only when the driver
+ * refused the request before writing it (EAGAIN, EBUSY). Idempotent
+ * ones are also resent when a transfer fails with an errno in
+ * retry_errno, by default EINTR, EAGAIN, EBUSY, ETIMEDOUT and EIO, or
+ * when the 32 bit firmware status at status_offset in the first inline
+ * output is in retry_status. A request that was written but got no
+ * response is resent on a new connection to the client, the handle
+ * stays the same.
+ *
+ * The wait before attempt n + 1 is backoff_ms << (n - 1), capped at
+ * max_backoff_ms and moved by up to jitter_pct percent either way. No
+ * attempt is started that would begin after deadline_ms from the
+ * first one, if set. Commands without an entry get a single attempt.
+ * Lists end at the first 0.
+ */
+#define TEE_RETRY_NO_STATUS	0xFFFFFFFF
+#define TEE_RETRY_MAX_STATUS	4
+#define TEE_RETRY_MAX_ERRNO	8
+
+struct tee_retry_policy {
+	uint32_t cmd_id;
+	uint32_t sub_opcode;
+	uint32_t sub_mask;
+	int idempotent;
+	uint32_t max_attempts;
+	uint32_t backoff_ms;
+	uint32_t max_backoff_ms;
+	uint32_t jitter_pct;
+	uint32_t deadline_ms;
+	uint32_t status_offset;
+	uint32_t retry_status[TEE_RETRY_MAX_STATUS];
+	int retry_errno[TEE_RETRY_MAX_ERRNO];
+};
+
+/*
+ * Adds a table of policies, which must stay valid for the life of the
+ * process. Tables are searched in the order they were registered;
+ * registering the same table again does nothing.
+ */
+uint32_t tee_retry_register(const struct tee_retry_policy *policies, uint32_t num);
+
+/*
+ * One command of a process_cmd_pipelined run. status is set to what
+ * process_cmd would have returned for it, TEE_FAILURE if it was never
+ * sent.
+ */
+struct tee_cmd {
+	uint32_t cmd_id;
+	struct data_buffer *buf_ptr_in;
+	struct data_buffer *buf_ptr_out;
+	uint32_t num_params;
+	uint32_t status;
+};
+
+#define TEE_PIPELINE_MAX_DEPTH	16
+
+/*
+ * Runs independent commands on one connection, sending up to the
+ * pipeline depth of its GUID before waiting for the oldest response.
+ * With depth 1 this is process_cmd in a loop. A transport error stops
+ * the run and marks the connection broken. Returns the status of the
+ * first command that failed, or TEE_SUCCESSFUL.
+ */
+uint32_t process_cmd_pipelined(
+	MEI_HANDLE *ptrHandle,
+	struct tee_cmd cmds[],
+	uint32_t num_cmds);
+
+/*
+ * Pipeline depth of a firmware client: how many requests it queues.
+ * Every GUID starts at 1. The depth applies to process_cmd_pipelined
+ * and to process_cmd_async queues created after it is set.
+ */
+uint32_t tee_pipeline_get_depth(const GUID *guid);
+uint32_t tee_pipeline_set_depth(const GUID *guid, uint32_t depth);
+
+/*
+ * Finds the pipeline depth of the client behind ptrHandle by sending
+ * 2, 3, ... max_depth copies of probe back to back and checking that
+ * every response arrives, then records it as by tee_pipeline_set_depth.
+ * probe must be side effect free. A failed round leaves the connection
+ * marked broken, so tee_deinit and tee_init again before further use.
+ */
+uint32_t tee_pipeline_probe(
+	MEI_HANDLE *ptrHandle,
+	const struct tee_cmd *probe,
+	uint32_t max_depth,
+	uint32_t *depth);
+
+/*
+ * Completion of process_cmd_async: status is what process_cmd would
+ * have returned for the command
+ */
+typedef void (*tee_cmd_callback)(void *ctx, uint32_t status);
+
+/*
+ * Queues a command and returns without waiting for its response, which
+ * tee_async_poll() later reads into buf_ptr_out before calling
+ * callback. The parameter arrays are copied, but the buffers they
+ * point to and the handle must stay valid until then. Commands on one
+ * handle complete in order, up to the pipeline depth of its GUID on
+ * the wire at once; commands on different handles overlap. The
+ * command is written when the queue has room, but no call waits for a
+ * response. Returns TEE_SUCCESSFUL once queued, or an error without
+ * calling callback if the command could not be queued or this call
+ * failed to send it; a failed send made by another call is reported
+ * through callback.
+ */
+uint32_t process_cmd_async(
+	MEI_HANDLE *ptrHandle,
+	uint32_t cmd_id,
+	struct data_buffer buf_ptr_in[],
+	struct data_buffer buf_ptr_out[],
+	uint32_t num_params,
+	tee_cmd_callback callback,
+	void *ctx);
+
+/*
+ * Waits up to timeout_ms (negative for no limit) for responses to
+ * queued commands, sends the commands queued behind them and runs the
+ * callbacks of everything that completed. Returns the number of
+ * callbacks run, or -1 if polling failed; returns 0 at once when
+ * nothing is queued. Callbacks may queue further commands.
+ */
+int tee_async_poll(int timeout_ms);
+
+/* Number of queued commands that have not completed */
+uint32_t tee_async_pending(void);
+
+/*
+ * Counters for the commands sent with one cmd_id and request header.
+ * sub_opcode is the first 32 bit word of the first inline input: the
+ * main and sub opcode pair of ACD requests, the command id of IPT and
+ * MVFW requests. bytes_in is the size of the input buffers, bytes_out
+ * the length of the response as read. A process_cmd call counts once
+ * however often it was retried, its latency running from the first
+ * send until the last response has been read. Pipelined and
+ * asynchronous commands include their time in the queue of the
+ * firmware client.
+ */
+struct tee_cmd_stats {
+	uint32_t cmd_id;
+	uint32_t sub_opcode;
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+
+/* cmd_id and sub_opcode of the entry counting keys past a thread's table */
+#define TEE_METRICS_OTHER	0xFFFFFFFF
+
+/*
+ * Sums the counters of every thread since the process started into
+ * stats, one entry per cmd_id and sub_opcode, and returns the number of
+ * entries filled in. Keys that do not fit in max entries are left out.
+ */
+uint32_t tee_metrics_snapshot(struct tee_cmd_stats *stats, uint32_t max);
+
+/*
+ * Same as process_cmd, for commands without side effects in firmware.
+ * Identical requests issued concurrently to the same client are collapsed:
+ * the first caller goes to firmware and the others get a copy of its
+ * response, so N concurrent duplicates cost one round trip.
+ */
+uint32_t process_cmd_idempotent(
+	MEI_HANDLE *ptrHandle,
+	uint32_t cmd_id,
+	struct data_buffer buf_ptr_in[],
+	struct data_buffer buf_ptr_out[],
+	uint32_t num_params);
+
 void copySwap( void *vDst, const void *vSrc, const uint32_t length, const tee_swap_flag flag );
 
 #endif /* __TEE_IF_H_ */
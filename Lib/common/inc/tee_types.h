@@ -35,6 +35,7 @@
 #ifndef __ACD_TYPES_H__
 #define __ACD_TYPES_H__
 
+#include <stdint.h>
 #include <byteswap.h>
 #ifdef MSVS
 #include "dx_pal_types.h"
@@ -0,0 +1,155 @@
+/**********************************************************************
+ * Copyright (C) 2012 Intel Corporation. All rights reserved.
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **********************************************************************/
+/**
+ * @file    mei_buf.c
+ * @brief   Per thread message buffers, see mei_buf.h
+ *
+ * mei_buf_get() hands out buffers from a small per thread cache of
+ * power of two size classes, large enough for the biggest client
+ * MaxMessageLength. A thread making the same firmware calls over and
+ * over stops touching the heap once its cache is warm. Requests above
+ * the largest class fall through to malloc. The cache lives in a
+ * pthread key since bionic has no __thread.
+ *
+ * Requests and responses carry key material, e.g. keymaster RSA keys,
+ * so mei_buf_put() wipes what the caller could have written before the
+ * buffer is reused or goes back to the heap.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "mei_buf.h"
+
+#define MEI_BUF_MIN_SHIFT	6	/* 64 bytes */
+#define MEI_BUF_NUM_CLASSES	11	/* up to 64KB */
+#define MEI_BUF_PER_CLASS	4
+#define MEI_BUF_UNCACHED	0xffffffff
+
+struct mei_buf_hdr {
+	uint32_t buf_class;
+	uint32_t size;		/* bytes asked for, wiped on release */
+	uint32_t reserved[2];	/* keeps the payload 16 byte aligned */
+};
+
+struct mei_buf_arena {
+	unsigned int count[MEI_BUF_NUM_CLASSES];
+	struct mei_buf_hdr *cached[MEI_BUF_NUM_CLASSES][MEI_BUF_PER_CLASS];
+};
+
+static pthread_once_t mei_buf_once = PTHREAD_ONCE_INIT;
+static pthread_key_t mei_buf_key;
+
+static void mei_buf_arena_free(void *ptr)
+{
+	struct mei_buf_arena *arena = ptr;
+	unsigned int a;
+
+	for (a = 0; a < MEI_BUF_NUM_CLASSES; a++) {
+		while (arena->count[a])
+			free(arena->cached[a][--arena->count[a]]);
+	}
+	free(arena);
+}
+
+static void mei_buf_key_create(void)
+{
+	pthread_key_create(&mei_buf_key, mei_buf_arena_free);
+}
+
+static struct mei_buf_arena *mei_buf_get_arena(void)
+{
+	struct mei_buf_arena *arena;
+
+	pthread_once(&mei_buf_once, mei_buf_key_create);
+	arena = pthread_getspecific(mei_buf_key);
+	if (arena == NULL) {
+		arena = calloc(sizeof(struct mei_buf_arena), 1);
+		if (arena != NULL && pthread_setspecific(mei_buf_key, arena) != 0) {
+			free(arena);
+			arena = NULL;
+		}
+	}
+	return arena;
+}
+
+/*
+ * Clears the payload of hdr. The empty asm keeps the compiler from
+ * dropping the memset ahead of a free
+ */
+static void mei_buf_wipe(struct mei_buf_hdr *hdr)
+{
+	memset(hdr + 1, 0, hdr->size);
+	__asm__ __volatile__("" : : "r"(hdr) : "memory");
+}
+
+void *mei_buf_get(size_t size)
+{
+	struct mei_buf_arena *arena;
+	struct mei_buf_hdr *hdr = NULL;
+	unsigned int buf_class = 0;
+
+	if ((uint64_t)size > UINT32_MAX)
+		return NULL;
+
+	while (buf_class < MEI_BUF_NUM_CLASSES &&
+	       ((size_t)1 << (buf_class + MEI_BUF_MIN_SHIFT)) < size)
+		buf_class++;
+
+	if (buf_class == MEI_BUF_NUM_CLASSES) {
+		hdr = malloc(sizeof(struct mei_buf_hdr) + size);
+		if (hdr == NULL)
+			return NULL;
+		hdr->buf_class = MEI_BUF_UNCACHED;
+		hdr->size = size;
+		return hdr + 1;
+	}
+
+	arena = mei_buf_get_arena();
+	if (arena != NULL && arena->count[buf_class])
+		hdr = arena->cached[buf_class][--arena->count[buf_class]];
+	else
+		hdr = malloc(sizeof(struct mei_buf_hdr) +
+			((size_t)1 << (buf_class + MEI_BUF_MIN_SHIFT)));
+	if (hdr == NULL)
+		return NULL;
+
+	hdr->buf_class = buf_class;
+	hdr->size = size;
+	return hdr + 1;
+}
+
+void mei_buf_put(void *buf)
+{
+	struct mei_buf_arena *arena;
+	struct mei_buf_hdr *hdr;
+
+	if (buf == NULL)
+		return;
+
+	hdr = (struct mei_buf_hdr *)buf - 1;
+	mei_buf_wipe(hdr);
+	if (hdr->buf_class != MEI_BUF_UNCACHED) {
+		arena = mei_buf_get_arena();
+		if (arena != NULL &&
+		    arena->count[hdr->buf_class] < MEI_BUF_PER_CLASS) {
+			arena->cached[hdr->buf_class][arena->count[hdr->buf_class]++] = hdr;
+			return;
+		}
+	}
+	free(hdr);
+}
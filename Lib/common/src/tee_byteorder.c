@@ -0,0 +1,337 @@
+/**********************************************************************
+ * Copyright (C) 2012 Intel Corporation. All rights reserved.
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ * http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **********************************************************************/
+/**
+ * @file    tee_byteorder.c
+ * @brief   Byte order conversion kernels, see tee_byteorder.h
+ *
+ * The SIMD kernels reverse 16 or 32 bytes with one pshufb, the AVX2
+ * whole buffer reversal also swaps the two 128 bit lanes. In place
+ * reversal loads a block from each end and stores them crosswise, so
+ * it never needs a scratch buffer. Tails shorter than a vector go to
+ * the next smaller kernel.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "tee_byteorder.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+/* target() on functions using intrinsics needs gcc 4.9 or clang */
+#if defined(__clang__) || __GNUC__ > 4 || \
+	(__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#define TEE_BSWAP_TARGETS
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+#endif /* __i386__ || __x86_64__ */
+
+struct tee_bswap_ops {
+	const char *name;
+	void (*rev)(uint8_t *dst, const uint8_t *src, size_t len);
+	void (*rev_inplace)(uint8_t *buf, size_t len);
+	void (*words)(uint8_t *dst, const uint8_t *src, size_t len,
+		      unsigned int width);
+};
+
+static void rev_scalar(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	uint64_t x;
+	size_t i = 0;
+
+	for (; len - i >= 8; i += 8) {
+		memcpy(&x, src + len - i - 8, 8);
+		x = __builtin_bswap64(x);
+		memcpy(dst + i, &x, 8);
+	}
+	for (; i < len; i++)
+		dst[i] = src[len - 1 - i];
+}
+
+static void rev_inplace_scalar(uint8_t *buf, size_t len)
+{
+	uint8_t *lo = buf;
+	uint8_t *hi = buf + len;
+	uint64_t a, b;
+	uint8_t c;
+
+	while (hi - lo >= 16) {
+		memcpy(&a, lo, 8);
+		memcpy(&b, hi - 8, 8);
+		a = __builtin_bswap64(a);
+		b = __builtin_bswap64(b);
+		memcpy(lo, &b, 8);
+		memcpy(hi - 8, &a, 8);
+		lo += 8;
+		hi -= 8;
+	}
+	while (hi - lo >= 2) {
+		c = *lo;
+		*lo++ = *--hi;
+		*hi = c;
+	}
+}
+
+static void words_scalar(uint8_t *dst, const uint8_t *src, size_t len,
+			 unsigned int width)
+{
+	uint16_t w16;
+	uint32_t w32;
+	uint64_t w64;
+	size_t i;
+
+	for (i = 0; i + width <= len; i += width) {
+		switch (width) {
+		case 2:
+			memcpy(&w16, src + i, 2);
+			w16 = (uint16_t)((w16 >> 8) | (w16 << 8));
+			memcpy(dst + i, &w16, 2);
+			break;
+		case 4:
+			memcpy(&w32, src + i, 4);
+			w32 = __builtin_bswap32(w32);
+			memcpy(dst + i, &w32, 4);
+			break;
+		default:
+			memcpy(&w64, src + i, 8);
+			w64 = __builtin_bswap64(w64);
+			memcpy(dst + i, &w64, 8);
+			break;
+		}
+	}
+}
+
+static const struct tee_bswap_ops tee_bswap_scalar = {
+	"scalar", rev_scalar, rev_inplace_scalar, words_scalar
+};
+
+#if defined(TEE_BSWAP_TARGETS)
+/* pshufb controls: reverse each 2, 4, 8 or all 16 bytes */
+static const uint8_t tee_bswap_masks[4][16] __attribute__((aligned(16))) = {
+	{ 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 },
+	{ 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 },
+	{ 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 },
+	{ 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0 },
+};
+
+#define MASK_WORDS(width)	((width) == 2 ? 0 : (width) == 4 ? 1 : 2)
+#define MASK_ALL		3
+
+__attribute__((target("ssse3")))
+static void rev_ssse3(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	const __m128i m = _mm_load_si128((const __m128i *)tee_bswap_masks[MASK_ALL]);
+	size_t i = 0;
+
+	for (; len - i >= 16; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(src + len - i - 16));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(x, m));
+	}
+	rev_scalar(dst + i, src, len - i);
+}
+
+__attribute__((target("ssse3")))
+static void rev_inplace_ssse3(uint8_t *buf, size_t len)
+{
+	const __m128i m = _mm_load_si128((const __m128i *)tee_bswap_masks[MASK_ALL]);
+	uint8_t *lo = buf;
+	uint8_t *hi = buf + len;
+
+	while (hi - lo >= 32) {
+		__m128i a = _mm_loadu_si128((const __m128i *)lo);
+		__m128i b = _mm_loadu_si128((const __m128i *)(hi - 16));
+		_mm_storeu_si128((__m128i *)lo, _mm_shuffle_epi8(b, m));
+		_mm_storeu_si128((__m128i *)(hi - 16), _mm_shuffle_epi8(a, m));
+		lo += 16;
+		hi -= 16;
+	}
+	rev_inplace_scalar(lo, hi - lo);
+}
+
+__attribute__((target("ssse3")))
+static void words_ssse3(uint8_t *dst, const uint8_t *src, size_t len,
+			unsigned int width)
+{
+	const __m128i m = _mm_load_si128((const __m128i *)
+					 tee_bswap_masks[MASK_WORDS(width)]);
+	size_t i = 0;
+
+	for (; len - i >= 16; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(x, m));
+	}
+	words_scalar(dst + i, src + i, len - i, width);
+}
+
+static const struct tee_bswap_ops tee_bswap_ssse3 = {
+	"ssse3", rev_ssse3, rev_inplace_ssse3, words_ssse3
+};
+
+/* The same control in both lanes, vpshufb does not cross them */
+__attribute__((target("avx2")))
+static __m256i mask_avx2(unsigned int index)
+{
+	__m128i m = _mm_load_si128((const __m128i *)tee_bswap_masks[index]);
+
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(m), m, 1);
+}
+
+__attribute__((target("avx2")))
+static void rev_avx2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	const __m256i m = mask_avx2(MASK_ALL);
+	size_t i = 0;
+
+	for (; len - i >= 32; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(src + len - i - 32));
+		x = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(x, m), 0x4e);
+		_mm256_storeu_si256((__m256i *)(dst + i), x);
+	}
+	_mm256_zeroupper();
+	rev_ssse3(dst + i, src, len - i);
+}
+
+__attribute__((target("avx2")))
+static void rev_inplace_avx2(uint8_t *buf, size_t len)
+{
+	const __m256i m = mask_avx2(MASK_ALL);
+	uint8_t *lo = buf;
+	uint8_t *hi = buf + len;
+
+	while (hi - lo >= 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)lo);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(hi - 32));
+		a = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(a, m), 0x4e);
+		b = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(b, m), 0x4e);
+		_mm256_storeu_si256((__m256i *)lo, b);
+		_mm256_storeu_si256((__m256i *)(hi - 32), a);
+		lo += 32;
+		hi -= 32;
+	}
+	_mm256_zeroupper();
+	rev_inplace_ssse3(lo, hi - lo);
+}
+
+__attribute__((target("avx2")))
+static void words_avx2(uint8_t *dst, const uint8_t *src, size_t len,
+		       unsigned int width)
+{
+	const __m256i m = mask_avx2(MASK_WORDS(width));
+	size_t i = 0;
+
+	for (; len - i >= 32; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(x, m));
+	}
+	_mm256_zeroupper();
+	words_ssse3(dst + i, src + i, len - i, width);
+}
+
+static const struct tee_bswap_ops tee_bswap_avx2 = {
+	"avx2", rev_avx2, rev_inplace_avx2, words_avx2
+};
+
+static int tee_bswap_has_ssse3;
+static int tee_bswap_has_avx2;
+#endif /* TEE_BSWAP_TARGETS */
+
+static pthread_once_t tee_bswap_once = PTHREAD_ONCE_INIT;
+static const struct tee_bswap_ops *tee_bswap_ops = &tee_bswap_scalar;
+
+static void tee_bswap_probe(void)
+{
+#if defined(TEE_BSWAP_TARGETS)
+	unsigned int eax, ebx, ecx, edx;
+	unsigned int lo, hi;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return;
+	tee_bswap_has_ssse3 = (ecx & bit_SSSE3) != 0;
+	if (tee_bswap_has_ssse3)
+		tee_bswap_ops = &tee_bswap_ssse3;
+
+	/* AVX2 needs the OS to save the ymm state as well as the CPU flag */
+	if (!(ecx & bit_OSXSAVE) || __get_cpuid_max(0, NULL) < 7)
+		return;
+	__asm__ volatile ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+	if ((lo & 6) != 6)
+		return;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	tee_bswap_has_avx2 = (ebx & bit_AVX2) != 0;
+	if (tee_bswap_has_avx2)
+		tee_bswap_ops = &tee_bswap_avx2;
+#endif /* TEE_BSWAP_TARGETS */
+}
+
+static const struct tee_bswap_ops *tee_bswap_get(void)
+{
+	pthread_once(&tee_bswap_once, tee_bswap_probe);
+	return tee_bswap_ops;
+}
+
+void tee_bswap_buf(void *dst, const void *src, size_t len)
+{
+	if (dst == src)
+		tee_bswap_get()->rev_inplace(dst, len);
+	else
+		tee_bswap_get()->rev(dst, src, len);
+}
+
+void tee_bswap_buf_inplace(void *buf, size_t len)
+{
+	tee_bswap_get()->rev_inplace(buf, len);
+}
+
+void tee_bswap16_array(void *dst, const void *src, size_t count)
+{
+	tee_bswap_get()->words(dst, src, count * 2, 2);
+}
+
+void tee_bswap32_array(void *dst, const void *src, size_t count)
+{
+	tee_bswap_get()->words(dst, src, count * 4, 4);
+}
+
+void tee_bswap64_array(void *dst, const void *src, size_t count)
+{
+	tee_bswap_get()->words(dst, src, count * 8, 8);
+}
+
+const char *tee_bswap_kernel(void)
+{
+	return tee_bswap_get()->name;
+}
+
+int tee_bswap_select(const char *kernel)
+{
+	tee_bswap_get();
+
+	if (!strcmp(kernel, "scalar")) {
+		tee_bswap_ops = &tee_bswap_scalar;
+		return 0;
+	}
+#if defined(TEE_BSWAP_TARGETS)
+	if (!strcmp(kernel, "ssse3") && tee_bswap_has_ssse3) {
+		tee_bswap_ops = &tee_bswap_ssse3;
+		return 0;
+	}
+	if (!strcmp(kernel, "avx2") && tee_bswap_has_avx2) {
+		tee_bswap_ops = &tee_bswap_avx2;
+		return 0;
+	}
+#endif /* TEE_BSWAP_TARGETS */
+	return -1;
+}
@@ -30,11 +30,14 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
-#ifdef MSVS
 #include <string.h>
-#endif /* MSVS */
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
 #include "tee_types.h"
 #include "tee_if.h"
+#include "tee_byteorder.h"
 #include "tee_error.h"
 #include "sepdrm-log.h"
 
@@ -47,20 +50,117 @@
 	} while(0)
 
 
+/*
+ * Single-flight state for process_cmd_idempotent. While a request is in
+ * flight its slot records the request bytes; an identical request from
+ * another thread waits on the slot and copies the leader's response.
+ */
+#define TEE_FLIGHT_SLOTS	8
+
+struct tee_flight {
+	int in_use;
+	int done;
+	uint32_t waiters;
+	GUID guid;
+	uint32_t cmd_id;
+	const void *req;
+	uint32_t req_size;
+	const void *resp;
+	uint32_t resp_size;
+	uint32_t status;
+};
+
+static pthread_mutex_t tee_flight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tee_flight_cond = PTHREAD_COND_INITIALIZER;
+static struct tee_flight tee_flights[TEE_FLIGHT_SLOTS];
+
+/*
+ * Sessions of tee_init/tee_deinit. Every connection takes a slot while
+ * one is free. A connection opened with an idle timeout, its own from
+ * tee_init_shared or tee_session_idle_ms once that is set, is shared
+ * by every later tee_init of that GUID and counted, and after the last
+ * tee_deinit it stays open for the timeout so the next call does not
+ * reconnect. Idle
+ * sessions past the timeout are closed by the next tee_init or
+ * tee_deinit. The first tee_init of a GUID connects with the lock
+ * dropped, marking its slot connecting so that others for the same
+ * GUID wait for the result instead of opening their own. A shared connection carries one command
+ * at a time, since a response is read from the same descriptor the
+ * request went to: the session is busy from the request until its
+ * response has been read, which for process_cmd_async can happen in
+ * another thread.
+ */
+#define TEE_SESSION_SLOTS	8
+#define TEE_SESSION_IDLE_MS	0
+
+struct tee_session {
+	MEI_HANDLE *handle;
+	GUID guid;
+	uint32_t refs;
+	int shared;
+	uint32_t idle_ms;
+	int connecting;
+	int broken;
+	int busy;
+	uint64_t idle_since;
+};
+
+static pthread_mutex_t tee_session_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tee_session_cond = PTHREAD_COND_INITIALIZER;
+static struct tee_session tee_sessions[TEE_SESSION_SLOTS];
+static uint32_t tee_session_idle_ms = TEE_SESSION_IDLE_MS;
+
 static uint32_t validate_data_buffer_params(
 	struct data_buffer buf_ptr_in[],
 	struct data_buffer buf_ptr_out[],
 	uint32_t num_params)
 {
-	uint32_t cnt_in;
-	uint32_t cnt_out;
-
 	if (!buf_ptr_in || !buf_ptr_out)
 		return TEE_FAIL_INVALID_PARAM;
 	return TEE_SUCCESSFUL;
 
 }
 
+static int is_inline(const struct data_buffer *buf)
+{
+	return buf->buffer && buf->size;
+}
+
+/*
+ * Inline parameters are gathered into the message and the response is
+ * scattered over the inline outputs, both in parameter order
+ */
+static uint32_t count_inline(
+	const struct data_buffer bufs[],
+	uint32_t num_params,
+	uint32_t *total)
+{
+	uint32_t cnt;
+	uint32_t inlines = 0;
+
+	*total = 0;
+	for (cnt = 0; cnt < num_params; cnt++) {
+		if (is_inline(&bufs[cnt])) {
+			inlines++;
+			*total += bufs[cnt].size;
+		}
+	}
+	return inlines;
+}
+
+/*
+ * Logs a failed transfer and returns TEE_FAILURE, keeping the errno of
+ * the driver call for the retry policy
+ */
+static uint32_t io_failed(const char *msg)
+{
+	int err = errno;
+
+	LOGERR("%s\n", msg);
+	errno = err;
+	return TEE_FAILURE;
+}
+
 static uint32_t send_cmd(
 	MEI_HANDLE *ptrHandle,
 	uint32_t cmd_id,
@@ -69,57 +169,500 @@ static uint32_t send_cmd(
 {
 
 	uint32_t cnt;
-	uint32_t ret_origin = 0;
 	int ret;
 	uint32_t totalsize = 0;
+	uint8_t *msg;
+	uint8_t *pos;
 
 	if( ( NULL == buf_ptr ) || ( NULL == buf_ptr[0].buffer ) )
 		return TEE_FAIL_INVALID_PARAM;
 
+	if (count_inline(buf_ptr, num_params, &totalsize) == 1) {
 //        mei_print_buffer( "buf_ptr sent", buf_ptr[0].buffer, buf_ptr[0].size );
-        ret = mei_sndmsg( ptrHandle, buf_ptr[0].buffer, buf_ptr[0].size);
-	if (ret <= 0)
-	{
-		LOGERR("failed to send message to HECI");
-		return ret;
+		ret = mei_sndmsg_nowait( ptrHandle, buf_ptr[0].buffer, buf_ptr[0].size);
+		if (ret <= 0)
+			return io_failed("failed to send message to HECI");
+		return TEE_SUCCESSFUL;
 	}
-	return TEE_SUCCESSFUL;
+
+	/*
+	 * The driver takes a message in one write, so inline parameters are
+	 * gathered into a cached buffer
+	 */
+	pos = msg = mei_buf_get(totalsize);
+	if (!msg)
+		return TEE_FAILURE;
+
+	for (cnt = 0; cnt < num_params; cnt++) {
+		if (is_inline(&buf_ptr[cnt])) {
+			memcpy(pos, buf_ptr[cnt].buffer, buf_ptr[cnt].size);
+			pos += buf_ptr[cnt].size;
+		}
+	}
+
+	ret = mei_sndmsg_nowait(ptrHandle, msg, totalsize);
+	if (ret <= 0)
+		ret = io_failed("failed to send message to HECI");
+	else
+		ret = TEE_SUCCESSFUL;
+	mei_buf_put(msg);
+	return ret;
 }
 
+/* *received is set to the length of the response as read */
 static uint32_t recv_cmd(
 	MEI_HANDLE *ptrHandle,
 	uint32_t cmd_id,
 	struct data_buffer buf_ptr[],
-	uint32_t num_params)
+	uint32_t num_params,
+	uint32_t *received)
 {
 	uint32_t cnt;
 	int ret;
 	uint32_t totalsize = 0;
+	uint32_t len;
+	uint8_t *msg;
+	uint8_t *pos;
 
+	*received = 0;
 	if( ( NULL == buf_ptr ) || ( NULL == buf_ptr[0].buffer ) )
 		return TEE_FAIL_INVALID_PARAM;
 
-        ret = mei_rcvmsg( ptrHandle, buf_ptr[0].buffer, buf_ptr[0].size);
+	if (count_inline(buf_ptr, num_params, &totalsize) <= 1) {
+		ret = mei_rcvmsg( ptrHandle, buf_ptr[0].buffer, buf_ptr[0].size);
+		if (ret <= 0)
+			return io_failed("failed to receive message from HECI");
+		*received = (uint32_t)ret;
+
+//		mei_print_buffer("buf_ptr_recvd", buf_ptr[0].buffer, buf_ptr[0].size);
+
+		return TEE_SUCCESSFUL;
+	}
+
+	/*
+	 * Fill the outputs in order; a short response leaves the tail of
+	 * the last one it reaches and every later one untouched
+	 */
+	msg = mei_buf_get(totalsize);
+	if (!msg)
+		return TEE_FAILURE;
+
+	ret = mei_rcvmsg(ptrHandle, msg, totalsize);
 	if (ret <= 0)
 	{
-		LOGERR("failed to send message to HECI");
+		ret = io_failed("failed to receive message from HECI");
+		mei_buf_put(msg);
 		return ret;
 	}
 
-//        mei_print_buffer("buf_ptr_recvd", buf_ptr[0].buffer, buf_ptr[0].size);
+	totalsize = *received = (uint32_t)ret;
+	pos = msg;
+	for (cnt = 0; cnt < num_params && totalsize; cnt++) {
+		if (!is_inline(&buf_ptr[cnt]))
+			continue;
+		len = buf_ptr[cnt].size < totalsize ? buf_ptr[cnt].size : totalsize;
+		memcpy(buf_ptr[cnt].buffer, pos, len);
+		pos += len;
+		totalsize -= len;
+	}
+	mei_buf_put(msg);
 
 	return TEE_SUCCESSFUL;
 }
 
 
+/* Same limit mei_sndmsg puts on a response */
+#define TEE_RESPONSE_TIMEOUT_MS	10000
+
+/* Waits up to timeout_ms for a response to a request sent without waiting */
+static uint32_t wait_response(const MEI_HANDLE *ptrHandle, int timeout_ms)
+{
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = ptrHandle->fd;
+	pfd.events = POLLIN;
+	do {
+		ret = poll(&pfd, 1, timeout_ms);
+	} while (ret < 0 && errno == EINTR);
+	if (ret <= 0) {
+		LOGERR("No response within %d ms\n", timeout_ms);
+		if (!ret)
+			errno = ETIMEDOUT;
+		return TEE_FAILURE;
+	}
+	return TEE_SUCCESSFUL;
+}
+
+
+static uint64_t tee_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t tee_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Command metrics. Every thread counts the commands it completes in its
+ * own block, keyed by cmd_id and the request header word, so counting
+ * takes no lock: only the owning thread writes a block and snapshots
+ * read it with relaxed atomics. Blocks are never freed; the block of a
+ * thread that exits is taken over, counts and all, by the next new
+ * thread, so totals only grow. Keys past TEE_METRICS_KEYS in a thread
+ * are counted under TEE_METRICS_OTHER.
+ */
+#define TEE_METRICS_KEYS	32
+
+struct tee_metrics_block {
+	struct tee_metrics_block *next;
+	int live;
+	uint32_t num;
+	struct tee_cmd_stats stats[TEE_METRICS_KEYS + 1];
+};
+
+static pthread_once_t tee_metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tee_metrics_key;
+static pthread_mutex_t tee_metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tee_metrics_block *tee_metrics_blocks;
+
+static void tee_metrics_exit(void *ptr)
+{
+	struct tee_metrics_block *block = ptr;
+
+	pthread_mutex_lock(&tee_metrics_lock);
+	block->live = 0;
+	pthread_mutex_unlock(&tee_metrics_lock);
+}
+
+static void tee_metrics_key_create(void)
+{
+	pthread_key_create(&tee_metrics_key, tee_metrics_exit);
+}
+
+static struct tee_metrics_block *tee_metrics_get_block(void)
+{
+	struct tee_metrics_block *block;
+
+	pthread_once(&tee_metrics_once, tee_metrics_key_create);
+	block = pthread_getspecific(tee_metrics_key);
+	if (block)
+		return block;
+
+	pthread_mutex_lock(&tee_metrics_lock);
+	for (block = tee_metrics_blocks; block; block = block->next) {
+		if (!block->live)
+			break;
+	}
+	if (!block) {
+		block = calloc(1, sizeof(*block));
+		if (block) {
+			block->stats[TEE_METRICS_KEYS].cmd_id = TEE_METRICS_OTHER;
+			block->stats[TEE_METRICS_KEYS].sub_opcode = TEE_METRICS_OTHER;
+			block->next = tee_metrics_blocks;
+			tee_metrics_blocks = block;
+		}
+	}
+	if (block)
+		block->live = 1;
+	pthread_mutex_unlock(&tee_metrics_lock);
+
+	if (block && pthread_setspecific(tee_metrics_key, block)) {
+		pthread_mutex_lock(&tee_metrics_lock);
+		block->live = 0;
+		pthread_mutex_unlock(&tee_metrics_lock);
+		block = NULL;
+	}
+	return block;
+}
+
+/* The first word of the first inline input: the request header */
+static uint32_t cmd_sub_opcode(const struct data_buffer buf_ptr_in[], uint32_t num_params)
+{
+	uint32_t sub_opcode = 0;
+	uint32_t cnt;
+
+	for (cnt = 0; cnt < num_params; cnt++) {
+		if (is_inline(&buf_ptr_in[cnt])) {
+			if (buf_ptr_in[cnt].size >= sizeof(sub_opcode))
+				memcpy(&sub_opcode, buf_ptr_in[cnt].buffer, sizeof(sub_opcode));
+			break;
+		}
+	}
+	return sub_opcode;
+}
+
+static uint64_t cmd_bytes(const struct data_buffer bufs[], uint32_t num_params)
+{
+	uint64_t bytes = 0;
+	uint32_t cnt;
+
+	for (cnt = 0; cnt < num_params; cnt++)
+		bytes += bufs[cnt].size;
+	return bytes;
+}
+
+#define METRIC_ADD(field, val) \
+	__atomic_store_n(&(field), (field) + (val), __ATOMIC_RELAXED)
+
+/* Counts one command that took from start_ns until now */
+static void record_cmd(
+	uint32_t cmd_id,
+	const struct data_buffer buf_ptr_in[],
+	uint32_t num_params,
+	uint32_t received,
+	uint32_t status,
+	uint64_t start_ns)
+{
+	struct tee_metrics_block *block = tee_metrics_get_block();
+	struct tee_cmd_stats *stats;
+	uint64_t elapsed = tee_now_ns() - start_ns;
+	uint32_t sub_opcode = cmd_sub_opcode(buf_ptr_in, num_params);
+	uint32_t cnt;
+
+	if (!block)
+		return;
+
+	for (cnt = 0; cnt < block->num; cnt++) {
+		if (block->stats[cnt].cmd_id == cmd_id &&
+		    block->stats[cnt].sub_opcode == sub_opcode)
+			break;
+	}
+	if (cnt == block->num && cnt < TEE_METRICS_KEYS) {
+		block->stats[cnt].cmd_id = cmd_id;
+		block->stats[cnt].sub_opcode = sub_opcode;
+		/* Publish the key before snapshots can see the entry */
+		__atomic_store_n(&block->num, cnt + 1, __ATOMIC_RELEASE);
+	}
+	stats = &block->stats[cnt];
+
+	METRIC_ADD(stats->calls, 1);
+	if (status)
+		METRIC_ADD(stats->errors, 1);
+	METRIC_ADD(stats->bytes_in, cmd_bytes(buf_ptr_in, num_params));
+	METRIC_ADD(stats->bytes_out, received);
+	METRIC_ADD(stats->total_ns, elapsed);
+	if (elapsed > stats->max_ns)
+		__atomic_store_n(&stats->max_ns, elapsed, __ATOMIC_RELAXED);
+}
+
+uint32_t tee_metrics_snapshot(struct tee_cmd_stats *stats, uint32_t max)
+{
+	struct tee_metrics_block *block;
+	uint32_t num = 0;
+	uint32_t cnt, idx;
+
+	pthread_mutex_lock(&tee_metrics_lock);
+	for (block = tee_metrics_blocks; block; block = block->next) {
+		uint32_t keys = __atomic_load_n(&block->num, __ATOMIC_ACQUIRE);
+
+		for (cnt = 0; cnt <= TEE_METRICS_KEYS; cnt++) {
+			const struct tee_cmd_stats *src = &block->stats[cnt];
+			uint64_t calls, max_ns;
+
+			/* The overflow entry always follows the regular keys */
+			if (cnt >= keys && cnt != TEE_METRICS_KEYS)
+				continue;
+			calls = __atomic_load_n(&src->calls, __ATOMIC_RELAXED);
+			if (!calls)
+				continue;
+
+			for (idx = 0; idx < num; idx++) {
+				if (stats[idx].cmd_id == src->cmd_id &&
+				    stats[idx].sub_opcode == src->sub_opcode)
+					break;
+			}
+			if (idx == num) {
+				if (num == max)
+					continue;
+				memset(&stats[idx], 0, sizeof(stats[idx]));
+				stats[idx].cmd_id = src->cmd_id;
+				stats[idx].sub_opcode = src->sub_opcode;
+				num++;
+			}
+
+			stats[idx].calls += calls;
+			stats[idx].errors += __atomic_load_n(&src->errors, __ATOMIC_RELAXED);
+			stats[idx].bytes_in += __atomic_load_n(&src->bytes_in, __ATOMIC_RELAXED);
+			stats[idx].bytes_out += __atomic_load_n(&src->bytes_out, __ATOMIC_RELAXED);
+			stats[idx].total_ns += __atomic_load_n(&src->total_ns, __ATOMIC_RELAXED);
+			max_ns = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+			if (max_ns > stats[idx].max_ns)
+				stats[idx].max_ns = max_ns;
+		}
+	}
+	pthread_mutex_unlock(&tee_metrics_lock);
+
+	return num;
+}
+
+/* Called with tee_session_lock held */
+static struct tee_session *find_session(const MEI_HANDLE *handle)
+{
+	uint32_t cnt;
+
+	for (cnt = 0; cnt < TEE_SESSION_SLOTS; cnt++) {
+		if (tee_sessions[cnt].handle && tee_sessions[cnt].handle == handle)
+			return &tee_sessions[cnt];
+	}
+	return NULL;
+}
+
+/*
+ * Called with tee_session_lock held. Unused sessions that are broken,
+ * idle for longer than their timeout or, with flush set, idle at all
+ * are taken out of the cache and their handles returned in closed, to
+ * be disconnected after unlocking
+ */
+static uint32_t reap_sessions(uint64_t now, int flush, MEI_HANDLE *closed[])
+{
+	uint32_t cnt;
+	uint32_t num = 0;
+
+	for (cnt = 0; cnt < TEE_SESSION_SLOTS; cnt++) {
+		struct tee_session *session = &tee_sessions[cnt];
+
+		if (!session->handle || session->refs)
+			continue;
+		if (!flush && !session->broken && session->shared &&
+		    now - session->idle_since <
+		    (session->idle_ms ? session->idle_ms : tee_session_idle_ms))
+			continue;
+		closed[num++] = session->handle;
+		session->handle = NULL;
+	}
+	return num;
+}
+
+static void close_sessions(MEI_HANDLE *closed[], uint32_t num)
+{
+	while (num)
+		mei_disconnect(closed[--num]);
+}
+
+/*
+ * Marks the cached session of handle busy, waiting for it if wait is
+ * set. *sessionp is NULL for handles that are not cached. Returns -1
+ * if the session is busy and wait is not set. The caller's reference
+ * keeps the session in its slot
+ */
+static int acquire_session(
+	const MEI_HANDLE *handle,
+	int wait,
+	struct tee_session **sessionp)
+{
+	struct tee_session *session;
+
+	pthread_mutex_lock(&tee_session_lock);
+	session = find_session(handle);
+	while (session && session->busy) {
+		if (!wait) {
+			pthread_mutex_unlock(&tee_session_lock);
+			return -1;
+		}
+		pthread_cond_wait(&tee_session_cond, &tee_session_lock);
+	}
+	if (session)
+		session->busy = 1;
+	pthread_mutex_unlock(&tee_session_lock);
+
+	*sessionp = session;
+	return 0;
+}
+
+static void release_session(struct tee_session *session, int failed)
+{
+	if (!session)
+		return;
+
+	pthread_mutex_lock(&tee_session_lock);
+	/* A connection that failed is not handed out again */
+	if (failed)
+		session->broken = 1;
+	session->busy = 0;
+	pthread_cond_broadcast(&tee_session_cond);
+	pthread_mutex_unlock(&tee_session_lock);
+}
+
 /*!
  * Functions
  */
 
 uint32_t tee_init(const GUID *guid, void **ptrHandle)
 {
-	*ptrHandle = (void *)mei_connect(guid);
-	if (*ptrHandle == NULL)
+	return tee_init_shared(guid, ptrHandle, 0);
+}
+
+uint32_t tee_init_shared(const GUID *guid, void **ptrHandle, uint32_t idle_ms)
+{
+	MEI_HANDLE *closed[TEE_SESSION_SLOTS];
+	struct tee_session *session = NULL;
+	MEI_HANDLE *handle;
+	uint32_t num;
+	uint32_t cnt;
+
+	pthread_mutex_lock(&tee_session_lock);
+	num = reap_sessions(tee_now_ms(), 0, closed);
+	for (cnt = 0; cnt < TEE_SESSION_SLOTS; cnt++) {
+		if ((tee_sessions[cnt].handle || tee_sessions[cnt].connecting) &&
+		    tee_sessions[cnt].shared && !tee_sessions[cnt].broken &&
+		    !memcmp(&tee_sessions[cnt].guid, guid, sizeof(GUID))) {
+			session = &tee_sessions[cnt];
+			break;
+		}
+	}
+
+	if (session) {
+		/* The reference keeps the slot while waiting for the connect */
+		session->refs++;
+		if (idle_ms > session->idle_ms)
+			session->idle_ms = idle_ms;
+		while (session->connecting)
+			pthread_cond_wait(&tee_session_cond, &tee_session_lock);
+		handle = session->handle;
+		if (handle == NULL)
+			session->refs--;
+	} else {
+		for (cnt = 0; cnt < TEE_SESSION_SLOTS && !session; cnt++) {
+			if (!tee_sessions[cnt].handle && !tee_sessions[cnt].connecting &&
+			    !tee_sessions[cnt].refs)
+				session = &tee_sessions[cnt];
+		}
+		/* Without a free slot the handle is not tracked at all */
+		if (session) {
+			memset(session, 0, sizeof(*session));
+			memcpy(&session->guid, guid, sizeof(GUID));
+			session->refs = 1;
+			session->shared = idle_ms || tee_session_idle_ms;
+			session->idle_ms = idle_ms;
+			session->connecting = 1;
+		}
+		pthread_mutex_unlock(&tee_session_lock);
+
+		handle = mei_connect(guid);
+
+		pthread_mutex_lock(&tee_session_lock);
+		if (session) {
+			session->handle = handle;
+			session->connecting = 0;
+			if (handle == NULL)
+				session->refs--;
+			pthread_cond_broadcast(&tee_session_cond);
+		}
+	}
+	pthread_mutex_unlock(&tee_session_lock);
+	close_sessions(closed, num);
+
+	*ptrHandle = (void *)handle;
+	if (handle == NULL)
 	{
 		printf("ptrHandle error");
 		return TEE_FAILURE;
@@ -129,10 +672,455 @@ uint32_t tee_init(const GUID *guid, void **ptrHandle)
 
 uint32_t tee_deinit(void *ptrHandle)
 {
-	mei_disconnect(ptrHandle);
+	MEI_HANDLE *closed[TEE_SESSION_SLOTS];
+	struct tee_session *session;
+	uint64_t now = tee_now_ms();
+	uint32_t num;
+
+	pthread_mutex_lock(&tee_session_lock);
+	session = find_session(ptrHandle);
+	if (session && session->refs && --session->refs == 0)
+		session->idle_since = now;
+	num = reap_sessions(now, 0, closed);
+	pthread_mutex_unlock(&tee_session_lock);
+	close_sessions(closed, num);
+
+	if (!session)
+		mei_disconnect(ptrHandle);
 	return TEE_SUCCESSFUL;
 }
 
+void tee_session_set_idle_timeout(uint32_t msec)
+{
+	pthread_mutex_lock(&tee_session_lock);
+	tee_session_idle_ms = msec;
+	pthread_mutex_unlock(&tee_session_lock);
+
+	if (!msec)
+		tee_session_flush();
+}
+
+void tee_session_flush(void)
+{
+	MEI_HANDLE *closed[TEE_SESSION_SLOTS];
+	uint32_t num;
+
+	pthread_mutex_lock(&tee_session_lock);
+	num = reap_sessions(tee_now_ms(), 1, closed);
+	pthread_mutex_unlock(&tee_session_lock);
+	close_sessions(closed, num);
+}
+
+/*
+ * Retry policy. Commands are classified by tables of tee_retry_policy
+ * that client libraries register; the first entry matching cmd_id and
+ * the request header word decides how process_cmd retries, otherwise
+ * tee_retry_default does. A command that is not idempotent is only
+ * resent when the driver refused the request before writing it, an
+ * idempotent one also after a lost response or a firmware status
+ * listed as transient. A request that was written is resent on a new
+ * connection, so its late response cannot be taken for the answer to
+ * the next attempt. Waits between attempts grow exponentially with
+ * jitter and are skipped when they would run past the deadline.
+ */
+#define TEE_RETRY_TABLES	8
+
+static const struct tee_retry_policy tee_retry_default = {
+	.max_attempts = 1,
+	.status_offset = TEE_RETRY_NO_STATUS,
+};
+
+/* Failures with these errnos happen before the request is written */
+static const int tee_retry_unsent_errno[] = { EAGAIN, EBUSY, 0 };
+
+/* Transient HECI failures retried for idempotent commands by default */
+static const int tee_retry_default_errno[] = {
+	EINTR, EAGAIN, EBUSY, ETIMEDOUT, EIO, 0
+};
+
+struct tee_retry_table {
+	const struct tee_retry_policy *policies;
+	uint32_t num;
+};
+
+static pthread_mutex_t tee_retry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tee_retry_table tee_retry_tables[TEE_RETRY_TABLES];
+
+uint32_t tee_retry_register(const struct tee_retry_policy *policies, uint32_t num)
+{
+	uint32_t ret = TEE_FAILURE;
+	uint32_t cnt;
+
+	if (!policies || !num)
+		return TEE_FAIL_INVALID_PARAM;
+
+	pthread_mutex_lock(&tee_retry_lock);
+	for (cnt = 0; cnt < TEE_RETRY_TABLES; cnt++) {
+		if (tee_retry_tables[cnt].policies == policies) {
+			ret = TEE_SUCCESSFUL;
+			break;
+		}
+		if (!tee_retry_tables[cnt].policies) {
+			tee_retry_tables[cnt].policies = policies;
+			tee_retry_tables[cnt].num = num;
+			ret = TEE_SUCCESSFUL;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&tee_retry_lock);
+
+	if (ret)
+		LOGERR("No room for another retry policy table\n");
+	return ret;
+}
+
+static const struct tee_retry_policy *find_retry_policy(uint32_t cmd_id, uint32_t sub_opcode)
+{
+	const struct tee_retry_policy *policy = &tee_retry_default;
+	uint32_t cnt, idx;
+
+	pthread_mutex_lock(&tee_retry_lock);
+	for (cnt = 0; cnt < TEE_RETRY_TABLES && tee_retry_tables[cnt].policies; cnt++) {
+		const struct tee_retry_table *table = &tee_retry_tables[cnt];
+
+		for (idx = 0; idx < table->num; idx++) {
+			if (table->policies[idx].cmd_id == cmd_id &&
+			    !((table->policies[idx].sub_opcode ^ sub_opcode) &
+			      table->policies[idx].sub_mask)) {
+				policy = &table->policies[idx];
+				goto found;
+			}
+		}
+	}
+found:
+	pthread_mutex_unlock(&tee_retry_lock);
+	return policy;
+}
+
+static int errno_listed(const int *list, int err)
+{
+	for (; *list; list++) {
+		if (*list == err)
+			return 1;
+	}
+	return 0;
+}
+
+/* Firmware status of the response if it is listed as transient */
+static int transient_status(
+	const struct tee_retry_policy *policy,
+	const struct data_buffer buf_ptr_out[],
+	uint32_t num_params)
+{
+	uint32_t status;
+	uint32_t cnt, idx;
+
+	if (policy->status_offset == TEE_RETRY_NO_STATUS)
+		return 0;
+
+	for (cnt = 0; cnt < num_params; cnt++) {
+		if (!is_inline(&buf_ptr_out[cnt]))
+			continue;
+		if (policy->status_offset + sizeof(status) > buf_ptr_out[cnt].size)
+			return 0;
+		memcpy(&status, (const uint8_t *)buf_ptr_out[cnt].buffer + policy->status_offset,
+		       sizeof(status));
+		for (idx = 0; idx < TEE_RETRY_MAX_STATUS && policy->retry_status[idx]; idx++) {
+			if (policy->retry_status[idx] == status)
+				return 1;
+		}
+		return 0;
+	}
+	return 0;
+}
+
+/* Wait before attempt number attempt + 1, with up to jitter_pct either way */
+static uint32_t retry_backoff_ms(const struct tee_retry_policy *policy, uint32_t attempt)
+{
+	uint64_t delay = policy->backoff_ms;
+	uint64_t span, rnd;
+
+	while (--attempt && delay < policy->max_backoff_ms)
+		delay <<= 1;
+	if (policy->max_backoff_ms && delay > policy->max_backoff_ms)
+		delay = policy->max_backoff_ms;
+
+	span = delay * policy->jitter_pct / 100;
+	if (span) {
+		/* xorshift of the clock is random enough to spread callers */
+		rnd = tee_now_ns();
+		rnd ^= rnd << 13;
+		rnd ^= rnd >> 7;
+		rnd ^= rnd << 17;
+		delay = delay - span + rnd % (2 * span + 1);
+	}
+	return (uint32_t)delay;
+}
+
+/*
+ * Replaces the connection behind ptrHandle with a new one to the same
+ * client. The handle stays valid; the old connection, and any response
+ * still on its way to it, is closed
+ */
+static uint32_t reconnect_handle(MEI_HANDLE *ptrHandle)
+{
+	MEI_HANDLE *fresh;
+	MEI_HANDLE old;
+
+	fresh = mei_connect(&ptrHandle->guid);
+	if (!fresh)
+		return io_failed("failed to reconnect to HECI");
+
+	old = *ptrHandle;
+	*ptrHandle = *fresh;
+	*fresh = old;
+	mei_disconnect(fresh);
+	return TEE_SUCCESSFUL;
+}
+
+/*
+ * One attempt of a command, on a new connection if reconnect is set.
+ * *sent tells whether the request was written and *received the length
+ * of the response, errno is the one of the failed driver call
+ */
+static uint32_t run_cmd(
+	MEI_HANDLE *ptrHandle,
+	uint32_t cmd_id,
+	struct data_buffer buf_ptr_in[],
+	struct data_buffer buf_ptr_out[],
+	uint32_t num_params,
+	int reconnect,
+	int *sent,
+	uint32_t *received)
+{
+	struct tee_session *session;
+	uint32_t ret = TEE_SUCCESSFUL;
+	int err;
+
+	acquire_session(ptrHandle, 1, &session);
+
+	*sent = 0;
+	*received = 0;
+	if (reconnect) {
+		ret = reconnect_handle(ptrHandle);
+		if (!ret && session) {
+			pthread_mutex_lock(&tee_session_lock);
+			session->broken = 0;
+			pthread_mutex_unlock(&tee_session_lock);
+		}
+	}
+	if (!ret) {
+		ret = send_cmd(ptrHandle, cmd_id, buf_ptr_in, num_params);
+		if (ret) {
+			LOGERR("Send Command, error=0x%08x, cmd-id=0x%08x\n", ret, cmd_id);
+		} else {
+			*sent = 1;
+			ret = wait_response(ptrHandle, TEE_RESPONSE_TIMEOUT_MS);
+			if (!ret)
+				ret = recv_cmd(ptrHandle, cmd_id, buf_ptr_out, num_params, received);
+			if (ret)
+				LOGERR("Receive Command, error=0x%08x, cmd-id=0x%08x\n", ret, cmd_id);
+		}
+	}
+	err = errno;
+
+	release_session(session, ret != 0);
+
+	errno = err;
+	return ret;
+}
+
+/*
+ * Coalescing. With a window set by mei_set_coalesce_window, the first
+ * process_cmd on a connection waits out the window and then runs every
+ * command queued on that connection meanwhile, holding the session
+ * once and sending up to the pipeline depth of the GUID ahead of the
+ * oldest response. The other callers sleep until theirs is read. Only
+ * first attempts are coalesced, retries run on their own.
+ */
+#define TEE_COALESCE_SLOTS	8
+
+struct tee_coalesce_req {
+	struct tee_coalesce_req *next;
+	struct tee_cmd cmd;
+	uint32_t received;
+	int sent;
+	int unsent;
+	int err;
+	int done;
+};
+
+struct tee_coalesce_slot {
+	MEI_HANDLE *handle;
+	struct tee_coalesce_req *head;
+	struct tee_coalesce_req *tail;
+};
+
+static pthread_mutex_t tee_coalesce_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tee_coalesce_cond = PTHREAD_COND_INITIALIZER;
+static struct tee_coalesce_slot tee_coalesce_slots[TEE_COALESCE_SLOTS];
+
+/*
+ * Runs a batch on one connection. After a failed send the responses
+ * on their way are still read; after a failed receive the requests
+ * waiting for one fail and the connection is replaced. Either way the
+ * requests not yet written are marked unsent, for their callers to run
+ * on their own
+ */
+static void run_coalesced(MEI_HANDLE *ptrHandle, struct tee_coalesce_req *batch)
+{
+	struct tee_session *session;
+	struct tee_coalesce_req *to_send = batch;
+	struct tee_coalesce_req *to_recv = batch;
+	struct tee_coalesce_req *req;
+	uint32_t depth = tee_pipeline_get_depth(&ptrHandle->guid);
+	uint32_t inflight = 0;
+	int send_failed = 0;
+	int failed = 0;
+
+	acquire_session(ptrHandle, 1, &session);
+
+	while (!failed && to_recv) {
+		while (!send_failed && to_send && inflight < depth) {
+			req = to_send;
+			req->cmd.status = send_cmd(ptrHandle, req->cmd.cmd_id,
+						   req->cmd.buf_ptr_in, req->cmd.num_params);
+			req->err = errno;
+			if (req->cmd.status) {
+				LOGERR("Send Command, error=0x%08x, cmd-id=0x%08x\n",
+				       req->cmd.status, req->cmd.cmd_id);
+				send_failed = 1;
+				break;
+			}
+			req->sent = 1;
+			inflight++;
+			to_send = req->next;
+		}
+		if (to_recv == to_send)
+			break;
+
+		req = to_recv;
+		req->cmd.status = wait_response(ptrHandle, TEE_RESPONSE_TIMEOUT_MS);
+		if (!req->cmd.status)
+			req->cmd.status = recv_cmd(ptrHandle, req->cmd.cmd_id, req->cmd.buf_ptr_out,
+						   req->cmd.num_params, &req->received);
+		req->err = errno;
+		if (req->cmd.status) {
+			LOGERR("Receive Command, error=0x%08x, cmd-id=0x%08x\n",
+			       req->cmd.status, req->cmd.cmd_id);
+			failed = 1;
+		}
+		inflight--;
+		to_recv = req->next;
+	}
+
+	for (req = to_recv; req && req != to_send; req = req->next) {
+		req->cmd.status = TEE_FAILURE;
+		req->err = EIO;
+	}
+	/* A send that failed itself keeps its status, the rest never went */
+	if (to_send && to_send->cmd.status)
+		to_send = to_send->next;
+	for (req = to_send; req; req = req->next)
+		req->unsent = 1;
+
+	/* Responses still owed must not be read as answers to the rest */
+	if (failed && to_send && !reconnect_handle(ptrHandle))
+		failed = 0;
+
+	release_session(session, failed || send_failed);
+}
+
+/*
+ * Runs the first attempt of a command as part of a batch. Returns 0
+ * if the caller is to run it itself: coalescing is off, every slot is
+ * taken or the batch stopped before the command was sent
+ */
+static int coalesce_cmd(
+	MEI_HANDLE *ptrHandle,
+	uint32_t cmd_id,
+	struct data_buffer buf_ptr_in[],
+	struct data_buffer buf_ptr_out[],
+	uint32_t num_params,
+	int *sent,
+	uint32_t *received,
+	uint32_t *status)
+{
+	struct tee_coalesce_slot *slot = NULL;
+	struct tee_coalesce_req req;
+	struct tee_coalesce_req *batch;
+	struct tee_coalesce_req *next;
+	struct timespec window;
+	unsigned int usec = mei_get_coalesce_window();
+	uint32_t cnt;
+
+	if (!usec)
+		return 0;
+
+	memset(&req, 0, sizeof(req));
+	req.cmd.cmd_id = cmd_id;
+	req.cmd.buf_ptr_in = buf_ptr_in;
+	req.cmd.buf_ptr_out = buf_ptr_out;
+	req.cmd.num_params = num_params;
+
+	pthread_mutex_lock(&tee_coalesce_lock);
+	for (cnt = 0; cnt < TEE_COALESCE_SLOTS; cnt++) {
+		if (tee_coalesce_slots[cnt].handle == ptrHandle) {
+			slot = &tee_coalesce_slots[cnt];
+			break;
+		}
+		if (!slot && !tee_coalesce_slots[cnt].handle)
+			slot = &tee_coalesce_slots[cnt];
+	}
+	if (!slot) {
+		pthread_mutex_unlock(&tee_coalesce_lock);
+		return 0;
+	}
+
+	if (slot->handle) {
+		/* A leader is waiting out the window for this connection */
+		slot->tail->next = &req;
+		slot->tail = &req;
+		while (!req.done)
+			pthread_cond_wait(&tee_coalesce_cond, &tee_coalesce_lock);
+		pthread_mutex_unlock(&tee_coalesce_lock);
+	} else {
+		slot->handle = ptrHandle;
+		slot->head = slot->tail = &req;
+		pthread_mutex_unlock(&tee_coalesce_lock);
+
+		window.tv_sec = usec / 1000000;
+		window.tv_nsec = (long)(usec % 1000000) * 1000;
+		nanosleep(&window, NULL);
+
+		/* Close the batch; later arrivals start a new one */
+		pthread_mutex_lock(&tee_coalesce_lock);
+		batch = slot->head;
+		slot->handle = NULL;
+		slot->head = slot->tail = NULL;
+		pthread_mutex_unlock(&tee_coalesce_lock);
+
+		run_coalesced(ptrHandle, batch);
+
+		pthread_mutex_lock(&tee_coalesce_lock);
+		while (batch) {
+			next = batch->next;
+			batch->done = 1;
+			batch = next;
+		}
+		pthread_cond_broadcast(&tee_coalesce_cond);
+		pthread_mutex_unlock(&tee_coalesce_lock);
+	}
+
+	if (req.unsent)
+		return 0;
+	*sent = req.sent;
+	*received = req.received;
+	*status = req.cmd.status;
+	errno = req.err;
+	return 1;
+}
+
 uint32_t process_cmd(
 	MEI_HANDLE *ptrHandle,
 	uint32_t cmd_id,
@@ -140,8 +1128,18 @@ uint32_t process_cmd(
 	struct data_buffer buf_ptr_out[],
 	uint32_t num_params)
 {
-	uint32_t status = TEE_SUCCESSFUL;
-	int ret = 0;
+	const struct tee_retry_policy *policy;
+	const int *retry_errno;
+	uint64_t deadline = 0;
+	uint32_t attempt;
+	uint32_t delay;
+	uint64_t start_ns;
+	uint32_t received;
+	uint32_t ret;
+	int sent = 0;
+	int retry;
+	int err;
+
 	if (!buf_ptr_in || !buf_ptr_out || !num_params)
 		return TEE_FAIL_INVALID_PARAM;
 
@@ -151,33 +1149,706 @@ uint32_t process_cmd(
 		return TEE_FAIL_INVALID_PARAM;
 	}
 
-	ret = send_cmd(ptrHandle, cmd_id, buf_ptr_in, num_params);
-	if (ret) {
-		LOGERR("Send Command, error=0x%08x, cmd-id=0x%08x\n", ret, cmd_id);
+	policy = find_retry_policy(cmd_id, cmd_sub_opcode(buf_ptr_in, num_params));
+	retry_errno = policy->retry_errno[0] ? policy->retry_errno : tee_retry_default_errno;
+	if (policy->deadline_ms)
+		deadline = tee_now_ms() + policy->deadline_ms;
+	start_ns = tee_now_ns();
+
+	for (attempt = 1; ; attempt++) {
+		/* A written request may still be answered on the old connection */
+		if (attempt > 1 || !coalesce_cmd(ptrHandle, cmd_id, buf_ptr_in, buf_ptr_out,
+						 num_params, &sent, &received, &ret))
+			ret = run_cmd(ptrHandle, cmd_id, buf_ptr_in, buf_ptr_out, num_params,
+				      attempt > 1 && sent && ret, &sent, &received);
+
+		if (!ret)
+			retry = policy->idempotent &&
+				transient_status(policy, buf_ptr_out, num_params);
+		else if (!policy->idempotent)
+			retry = !sent && errno_listed(tee_retry_unsent_errno, errno);
+		else
+			retry = errno_listed(retry_errno, errno);
+
+		if (!retry || attempt >= policy->max_attempts)
+			break;
+
+		delay = retry_backoff_ms(policy, attempt);
+		if (deadline && tee_now_ms() + delay >= deadline)
+			break;
+		LOGERR("Retrying cmd-id=0x%08x in %u ms, attempt %u of %u\n",
+		       cmd_id, delay, attempt + 1, policy->max_attempts);
+		if (delay)
+			usleep(delay * 1000);
+	}
+
+	/* One call however many attempts it took */
+	err = errno;
+	record_cmd(cmd_id, buf_ptr_in, num_params, received, ret, start_ns);
+	errno = err;
+	return ret;
+}
+
+/*
+ * Pipelining. A client that queues requests can have several on the
+ * wire at once; its responses still come back in request order. The
+ * depth, the number of requests sent ahead of the oldest response, is
+ * kept per GUID and is 1, no pipelining, until set or probed.
+ */
+#define TEE_PIPELINE_SLOTS	8
+#define TEE_PIPELINE_PROBE_MS	1000
+
+struct tee_pipeline {
+	GUID guid;
+	uint32_t depth;
+};
+
+static pthread_mutex_t tee_pipeline_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tee_pipeline tee_pipelines[TEE_PIPELINE_SLOTS];
+
+uint32_t tee_pipeline_get_depth(const GUID *guid)
+{
+	uint32_t depth = 1;
+	uint32_t cnt;
+
+	if (!guid)
+		return depth;
+
+	pthread_mutex_lock(&tee_pipeline_lock);
+	for (cnt = 0; cnt < TEE_PIPELINE_SLOTS; cnt++) {
+		if (tee_pipelines[cnt].depth &&
+		    !memcmp(&tee_pipelines[cnt].guid, guid, sizeof(GUID))) {
+			depth = tee_pipelines[cnt].depth;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&tee_pipeline_lock);
+	return depth;
+}
+
+uint32_t tee_pipeline_set_depth(const GUID *guid, uint32_t depth)
+{
+	struct tee_pipeline *slot = NULL;
+	uint32_t cnt;
+
+	if (!guid || !depth || depth > TEE_PIPELINE_MAX_DEPTH)
+		return TEE_FAIL_INVALID_PARAM;
+
+	pthread_mutex_lock(&tee_pipeline_lock);
+	for (cnt = 0; cnt < TEE_PIPELINE_SLOTS; cnt++) {
+		if (tee_pipelines[cnt].depth &&
+		    !memcmp(&tee_pipelines[cnt].guid, guid, sizeof(GUID))) {
+			slot = &tee_pipelines[cnt];
+			break;
+		}
+		if (!slot && !tee_pipelines[cnt].depth)
+			slot = &tee_pipelines[cnt];
+	}
+	/* Depth 1 is the default and needs no slot */
+	if (slot && depth == 1) {
+		slot->depth = 0;
+	} else if (slot) {
+		memcpy(&slot->guid, guid, sizeof(GUID));
+		slot->depth = depth;
+	}
+	pthread_mutex_unlock(&tee_pipeline_lock);
+
+	return (slot || depth == 1) ? TEE_SUCCESSFUL : TEE_FAILURE;
+}
+
+/*
+ * Runs cmds keeping up to depth requests on the wire. A failed send or
+ * receive stops the run: the responses still outstanding can no longer
+ * be matched to their requests, so the connection is marked broken.
+ * Commands never sent keep status TEE_FAILURE
+ */
+static uint32_t run_pipeline(
+	MEI_HANDLE *ptrHandle,
+	struct tee_cmd cmds[],
+	uint32_t num_cmds,
+	uint32_t depth,
+	int timeout_ms)
+{
+	struct tee_session *session;
+	uint64_t sent_ns[TEE_PIPELINE_MAX_DEPTH];
+	uint32_t sent = 0;
+	uint32_t done = 0;
+	uint32_t received = 0;
+	uint32_t status;
+	uint32_t cnt;
+	int failed = 0;
+
+	for (cnt = 0; cnt < num_cmds; cnt++)
+		cmds[cnt].status = TEE_FAILURE;
+
+	acquire_session(ptrHandle, 1, &session);
+
+	while (!failed && done < num_cmds) {
+		while (sent < num_cmds && sent - done < depth) {
+			sent_ns[sent % TEE_PIPELINE_MAX_DEPTH] = tee_now_ns();
+			status = send_cmd(ptrHandle, cmds[sent].cmd_id, cmds[sent].buf_ptr_in,
+					  cmds[sent].num_params);
+			if (status) {
+				LOGERR("Send Command, error=0x%08x, cmd-id=0x%08x\n",
+				       status, cmds[sent].cmd_id);
+				cmds[sent].status = status;
+				record_cmd(cmds[sent].cmd_id, cmds[sent].buf_ptr_in,
+					   cmds[sent].num_params, 0,
+					   status, sent_ns[sent % TEE_PIPELINE_MAX_DEPTH]);
+				failed = 1;
+				break;
+			}
+			sent++;
+		}
+		if (done == sent)
+			break;
+
+		status = wait_response(ptrHandle, timeout_ms);
+		if (!status)
+			status = recv_cmd(ptrHandle, cmds[done].cmd_id,
+					  cmds[done].buf_ptr_out, cmds[done].num_params, &received);
+		if (status) {
+			LOGERR("Receive Command, error=0x%08x, cmd-id=0x%08x\n",
+			       status, cmds[done].cmd_id);
+			failed = 1;
+		}
+		record_cmd(cmds[done].cmd_id, cmds[done].buf_ptr_in, cmds[done].num_params,
+			   status ? 0 : received, status, sent_ns[done % TEE_PIPELINE_MAX_DEPTH]);
+		cmds[done++].status = status;
 	}
 
-	ret = recv_cmd(ptrHandle, cmd_id, buf_ptr_out, num_params);
+	release_session(session, failed);
+
+	for (cnt = 0; cnt < num_cmds; cnt++) {
+		if (cmds[cnt].status)
+			return cmds[cnt].status;
+	}
+	return TEE_SUCCESSFUL;
+}
+
+uint32_t process_cmd_pipelined(
+	MEI_HANDLE *ptrHandle,
+	struct tee_cmd cmds[],
+	uint32_t num_cmds)
+{
+	uint32_t cnt;
+
+	if (!ptrHandle || !cmds || !num_cmds)
+		return TEE_FAIL_INVALID_PARAM;
+
+	for (cnt = 0; cnt < num_cmds; cnt++) {
+		if (!cmds[cnt].buf_ptr_in || !cmds[cnt].buf_ptr_out || !cmds[cnt].num_params ||
+		    validate_data_buffer_params(cmds[cnt].buf_ptr_in, cmds[cnt].buf_ptr_out,
+						cmds[cnt].num_params)) {
+			LOGERR("Data buffer params of command %u invalid\n", cnt);
+			return TEE_FAIL_INVALID_PARAM;
+		}
+	}
+
+	return run_pipeline(ptrHandle, cmds, num_cmds,
+			    tee_pipeline_get_depth(&ptrHandle->guid), TEE_RESPONSE_TIMEOUT_MS);
+}
+
+uint32_t tee_pipeline_probe(
+	MEI_HANDLE *ptrHandle,
+	const struct tee_cmd *probe,
+	uint32_t max_depth,
+	uint32_t *depth)
+{
+	struct tee_cmd cmds[TEE_PIPELINE_MAX_DEPTH];
+	uint32_t found = 1;
+	uint32_t cnt;
+
+	if (!ptrHandle || !probe || !depth || !max_depth ||
+	    max_depth > TEE_PIPELINE_MAX_DEPTH)
+		return TEE_FAIL_INVALID_PARAM;
+	if (!probe->buf_ptr_in || !probe->buf_ptr_out || !probe->num_params ||
+	    validate_data_buffer_params(probe->buf_ptr_in, probe->buf_ptr_out,
+					probe->num_params))
+		return TEE_FAIL_INVALID_PARAM;
+
+	for (cnt = 0; cnt < max_depth; cnt++)
+		cmds[cnt] = *probe;
+
+	/*
+	 * Send k copies back to back and expect k responses in time. A
+	 * client that does not queue drops or rejects the extra requests
+	 */
+	for (cnt = 2; cnt <= max_depth; cnt++) {
+		if (run_pipeline(ptrHandle, cmds, cnt, cnt, TEE_PIPELINE_PROBE_MS))
+			break;
+		found = cnt;
+	}
+
+	*depth = found;
+	return tee_pipeline_set_depth(&ptrHandle->guid, found);
+}
+
+/*
+ * Asynchronous commands. Each connection has a FIFO of commands, of
+ * which up to the pipeline depth of its GUID are on the wire. They are
+ * sent as soon as the session is free, and tee_async_poll() reads the
+ * responses in order once the descriptor is readable and then sends
+ * the commands behind them. The queue holds the session from its first
+ * request on the wire until the last response is read. tee_async_lock
+ * only guards the queues; it is dropped around every read and write,
+ * and one thread at a time sends for a queue so requests keep their
+ * order. Callbacks run from tee_async_poll() with no lock held.
+ */
+#define TEE_ASYNC_QUEUES	16
+#define TEE_ASYNC_IDLE_MS	10
+
+struct tee_async_op {
+	struct tee_async_op *next;
+	MEI_HANDLE *handle;
+	uint32_t cmd_id;
+	uint32_t num_params;
+	tee_cmd_callback callback;
+	void *ctx;
+	uint32_t status;
+	uint64_t start_ns;
+	struct data_buffer *in;
+	struct data_buffer *out;
+};
+
+struct tee_async_queue {
+	MEI_HANDLE *handle;
+	struct tee_async_op *head;
+	struct tee_async_op *tail;
+	struct tee_async_op *last_sent;
+	struct tee_session *session;
+	uint32_t depth;
+	uint32_t inflight;
+	int held;
+	int sending;
+	int failed;
+};
+
+static pthread_mutex_t tee_async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t tee_async_poll_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tee_async_queue tee_async_queues[TEE_ASYNC_QUEUES];
+static struct tee_async_op *tee_async_failed;
+static uint32_t tee_async_count;
+
+/* First command of queue not yet on the wire */
+static struct tee_async_op *next_unsent(const struct tee_async_queue *queue)
+{
+	return queue->last_sent ? queue->last_sent->next : queue->head;
+}
+
+/* Called with tee_async_lock held. Frees the slot of a queue nobody uses */
+static void put_queue(struct tee_async_queue *queue)
+{
+	if (!queue->head && !queue->inflight && !queue->sending && !queue->held)
+		queue->handle = NULL;
+}
+
+/* Called with tee_async_lock held. Gives up the session of queue */
+static void put_session(struct tee_async_queue *queue)
+{
+	release_session(queue->session, queue->failed);
+	queue->session = NULL;
+	queue->held = 0;
+	queue->failed = 0;
+	put_queue(queue);
+}
+
+/* Called with tee_async_lock held. Takes the op after prev, or the head */
+static struct tee_async_op *unlink_async(
+	struct tee_async_queue *queue,
+	struct tee_async_op *prev)
+{
+	struct tee_async_op *op = prev ? prev->next : queue->head;
+
+	if (prev)
+		prev->next = op->next;
+	else
+		queue->head = op->next;
+	if (queue->tail == op)
+		queue->tail = prev;
+	if (queue->last_sent == op)
+		queue->last_sent = NULL;
+	op->next = NULL;
+	return op;
+}
+
+/*
+ * Called with tee_async_lock held, which is dropped around each write.
+ * Sends commands of queue while the pipeline has room and the session
+ * is free. Returns a command, already taken off the queue, whose send
+ * failed and NULL otherwise
+ */
+static struct tee_async_op *start_async(struct tee_async_queue *queue)
+{
+	struct tee_async_op *op;
+	uint32_t ret;
+
+	/* The thread already sending picks up the commands queued behind */
+	if (queue->sending)
+		return NULL;
+	queue->sending = 1;
+
+	while ((op = next_unsent(queue)) && !queue->failed &&
+	       queue->inflight < queue->depth) {
+		if (!queue->held) {
+			if (acquire_session(op->handle, 0, &queue->session))
+				break;
+			queue->held = 1;
+		}
+
+		/*
+		 * The poller only takes the inflight commands off the head,
+		 * so op stays the first unsent one while the lock is dropped
+		 */
+		op->start_ns = tee_now_ns();
+		pthread_mutex_unlock(&tee_async_lock);
+		ret = send_cmd(op->handle, op->cmd_id, op->in, op->num_params);
+		pthread_mutex_lock(&tee_async_lock);
+		if (ret) {
+			LOGERR("Send Command, error=0x%08x, cmd-id=0x%08x\n", ret, op->cmd_id);
+			record_cmd(op->cmd_id, op->in, op->num_params, 0, ret, op->start_ns);
+			op->status = ret;
+			op = unlink_async(queue, queue->last_sent);
+			queue->sending = 0;
+			/* Otherwise released once the responses ahead of it are read */
+			queue->failed = 1;
+			if (!queue->inflight)
+				put_session(queue);
+			return op;
+		}
+		queue->inflight++;
+		queue->last_sent = op;
+	}
+
+	queue->sending = 0;
+	if (queue->held && !queue->inflight)
+		put_session(queue);
+	else
+		put_queue(queue);
+	return NULL;
+}
+
+/*
+ * Called with tee_async_lock held, which is dropped around the read.
+ * Reads the response to the head of queue
+ */
+static struct tee_async_op *finish_async(struct tee_async_queue *queue)
+{
+	struct tee_async_op *op;
+	uint32_t received;
+	uint32_t ret;
+
+	op = unlink_async(queue, NULL);
+	pthread_mutex_unlock(&tee_async_lock);
+	ret = recv_cmd(op->handle, op->cmd_id, op->out, op->num_params, &received);
+	pthread_mutex_lock(&tee_async_lock);
 	if (ret) {
-		LOGERR("Receive Command, error=0x%08x, cmd-id=0x%08x\n", ret, cmd_id);
+		LOGERR("Receive Command, error=0x%08x, cmd-id=0x%08x\n", ret, op->cmd_id);
+		queue->failed = 1;
 	}
+	record_cmd(op->cmd_id, op->in, op->num_params, received, ret, op->start_ns);
+	op->status = ret;
 
-final_exit:
+	/* A thread still sending gives the session up itself */
+	if (--queue->inflight == 0 && !queue->sending)
+		put_session(queue);
+	return op;
+}
 
-	return ret;
+uint32_t process_cmd_async(
+	MEI_HANDLE *ptrHandle,
+	uint32_t cmd_id,
+	struct data_buffer buf_ptr_in[],
+	struct data_buffer buf_ptr_out[],
+	uint32_t num_params,
+	tee_cmd_callback callback,
+	void *ctx)
+{
+	struct tee_async_queue *queue = NULL;
+	struct tee_async_op *failed;
+	struct tee_async_op *op;
+	uint32_t status;
+	uint32_t cnt;
 
+	if (!ptrHandle || !buf_ptr_in || !buf_ptr_out || !num_params || !callback)
+		return TEE_FAIL_INVALID_PARAM;
+
+	if (validate_data_buffer_params(buf_ptr_in, buf_ptr_out, num_params)) {
+		LOGERR("Data buffer params invalid\n");
+		return TEE_FAIL_INVALID_PARAM;
+	}
+
+	op = calloc(1, sizeof(*op) + 2 * num_params * sizeof(struct data_buffer));
+	if (!op)
+		return TEE_FAILURE;
+	op->handle = ptrHandle;
+	op->cmd_id = cmd_id;
+	op->num_params = num_params;
+	op->callback = callback;
+	op->ctx = ctx;
+	op->in = (struct data_buffer *)(op + 1);
+	op->out = op->in + num_params;
+	memcpy(op->in, buf_ptr_in, num_params * sizeof(struct data_buffer));
+	memcpy(op->out, buf_ptr_out, num_params * sizeof(struct data_buffer));
+
+	pthread_mutex_lock(&tee_async_lock);
+	for (cnt = 0; cnt < TEE_ASYNC_QUEUES; cnt++) {
+		if (tee_async_queues[cnt].handle == ptrHandle) {
+			queue = &tee_async_queues[cnt];
+			break;
+		}
+		if (!queue && !tee_async_queues[cnt].handle)
+			queue = &tee_async_queues[cnt];
+	}
+	if (!queue) {
+		pthread_mutex_unlock(&tee_async_lock);
+		LOGERR("Too many connections with commands in flight\n");
+		free(op);
+		return TEE_FAILURE;
+	}
+
+	if (!queue->handle) {
+		queue->handle = ptrHandle;
+		queue->depth = tee_pipeline_get_depth(&ptrHandle->guid);
+	}
+	if (queue->tail)
+		queue->tail->next = op;
+	else
+		queue->head = op;
+	queue->tail = op;
+	tee_async_count++;
+
+	if (next_unsent(queue) != op) {
+		pthread_mutex_unlock(&tee_async_lock);
+		return TEE_SUCCESSFUL;
+	}
+
+	/*
+	 * A send of this command that fails right away is reported here,
+	 * not by callback. Commands queued behind it meanwhile go out on
+	 * this thread too, their failures are left to tee_async_poll()
+	 */
+	failed = start_async(queue);
+	if (failed == op) {
+		tee_async_count--;
+		pthread_mutex_unlock(&tee_async_lock);
+		status = op->status;
+		free(op);
+		return status;
+	}
+	if (failed) {
+		failed->next = tee_async_failed;
+		tee_async_failed = failed;
+	}
+	pthread_mutex_unlock(&tee_async_lock);
+	return TEE_SUCCESSFUL;
 }
 
+int tee_async_poll(int timeout_ms)
+{
+	struct pollfd fds[TEE_ASYNC_QUEUES];
+	struct tee_async_queue *polled[TEE_ASYNC_QUEUES];
+	struct tee_async_op *done;
+	struct tee_async_op *op;
+	uint32_t nfds = 0;
+	uint32_t pending;
+	uint32_t cnt;
+	int completed = 0;
 
+	pthread_mutex_lock(&tee_async_poll_lock);
 
-void copySwap( void *vDst, const void *vSrc, const uint32_t length, const tee_swap_flag flag )
+	pthread_mutex_lock(&tee_async_lock);
+	done = tee_async_failed;
+	tee_async_failed = NULL;
+	for (cnt = 0; cnt < TEE_ASYNC_QUEUES; cnt++) {
+		struct tee_async_queue *queue = &tee_async_queues[cnt];
+
+		op = start_async(queue);
+		if (op) {
+			op->next = done;
+			done = op;
+		}
+		if (queue->inflight) {
+			fds[nfds].fd = queue->handle->fd;
+			fds[nfds].events = POLLIN;
+			fds[nfds].revents = 0;
+			polled[nfds++] = queue;
+		}
+	}
+	pending = tee_async_count;
+	pthread_mutex_unlock(&tee_async_lock);
+
+	if (done)
+		timeout_ms = 0;
+	/* Queued commands wait for a synchronous caller, look again soon */
+	else if (!nfds && pending &&
+		 (timeout_ms < 0 || timeout_ms > TEE_ASYNC_IDLE_MS))
+		timeout_ms = TEE_ASYNC_IDLE_MS;
+
+	if ((nfds || pending) &&
+	    poll(nfds ? fds : NULL, nfds, timeout_ms) < 0 && errno != EINTR) {
+		pthread_mutex_unlock(&tee_async_poll_lock);
+		return -1;
+	}
+
+	pthread_mutex_lock(&tee_async_lock);
+	for (cnt = 0; cnt < nfds; cnt++) {
+		struct tee_async_queue *queue = polled[cnt];
+		struct pollfd pfd = fds[cnt];
+
+		/* Only the polling thread takes sent commands off a queue */
+		while (pfd.revents && queue->inflight) {
+			op = finish_async(queue);
+			op->next = done;
+			done = op;
+
+			op = start_async(queue);
+			if (op) {
+				op->next = done;
+				done = op;
+			}
+
+			/* Drain responses that are already waiting */
+			pfd.revents = 0;
+			if (queue->inflight && poll(&pfd, 1, 0) <= 0)
+				break;
+		}
+	}
+	for (op = done; op; op = op->next)
+		tee_async_count--;
+	pthread_mutex_unlock(&tee_async_lock);
+	pthread_mutex_unlock(&tee_async_poll_lock);
+
+	/* The list is newest first, callbacks run in completion order */
+	op = NULL;
+	while (done) {
+		struct tee_async_op *next = done->next;
+
+		done->next = op;
+		op = done;
+		done = next;
+	}
+	while (op) {
+		done = op->next;
+		op->callback(op->ctx, op->status);
+		free(op);
+		op = done;
+		completed++;
+	}
+	return completed;
+}
+
+uint32_t tee_async_pending(void)
+{
+	uint32_t pending;
+
+	pthread_mutex_lock(&tee_async_lock);
+	pending = tee_async_count;
+	pthread_mutex_unlock(&tee_async_lock);
+	return pending;
+}
+
+/* Called with tee_flight_lock held */
+static struct tee_flight *find_flight(
+	const MEI_HANDLE *ptrHandle,
+	uint32_t cmd_id,
+	const struct data_buffer *in,
+	const struct data_buffer *out)
+{
+	uint32_t cnt;
+
+	for (cnt = 0; cnt < TEE_FLIGHT_SLOTS; cnt++) {
+		struct tee_flight *flight = &tee_flights[cnt];
+
+		if (!flight->in_use || flight->done)
+			continue;
+		if (flight->cmd_id != cmd_id ||
+		    flight->req_size != in->size ||
+		    flight->resp_size != out->size)
+			continue;
+		if (memcmp(&flight->guid, &ptrHandle->guid, sizeof(GUID)) ||
+		    memcmp(flight->req, in->buffer, in->size))
+			continue;
+		return flight;
+	}
+	return NULL;
+}
+
+uint32_t process_cmd_idempotent(
+	MEI_HANDLE *ptrHandle,
+	uint32_t cmd_id,
+	struct data_buffer buf_ptr_in[],
+	struct data_buffer buf_ptr_out[],
+	uint32_t num_params)
 {
+	struct tee_flight *flight;
+	uint32_t status;
+	uint32_t cnt;
+	uint32_t total;
 
-#define QUICK_SWAP_SIZE         8       //  This must always be a power of 2, greater than 0
+	if (!ptrHandle || !buf_ptr_in || !buf_ptr_out || !num_params ||
+	    !buf_ptr_in[0].buffer || !buf_ptr_out[0].buffer)
+		return TEE_FAIL_INVALID_PARAM;
+
+	/* Only the first parameters are compared and shared */
+	if (count_inline(buf_ptr_in, num_params, &total) > 1 ||
+	    count_inline(buf_ptr_out, num_params, &total) > 1)
+		return process_cmd(ptrHandle, cmd_id, buf_ptr_in, buf_ptr_out, num_params);
 
-        uint8_t         *pDst = (uint8_t *)vDst;
-        uint8_t         *pSrc = (uint8_t *)vSrc + length;
-        uint32_t         quickSwap = length & ( QUICK_SWAP_SIZE - 1 );
+	pthread_mutex_lock(&tee_flight_lock);
+	flight = find_flight(ptrHandle, cmd_id, &buf_ptr_in[0], &buf_ptr_out[0]);
+	if (flight) {
+		/* Identical request already in flight, share its response */
+		flight->waiters++;
+		while (!flight->done)
+			pthread_cond_wait(&tee_flight_cond, &tee_flight_lock);
+		memcpy(buf_ptr_out[0].buffer, flight->resp, flight->resp_size);
+		status = flight->status;
+		if (--flight->waiters == 0)
+			pthread_cond_broadcast(&tee_flight_cond);
+		pthread_mutex_unlock(&tee_flight_lock);
+		return status;
+	}
 
+	for (cnt = 0; cnt < TEE_FLIGHT_SLOTS; cnt++) {
+		if (!tee_flights[cnt].in_use) {
+			flight = &tee_flights[cnt];
+			break;
+		}
+	}
+	if (!flight) {
+		/* Too many distinct requests in flight, just go to firmware */
+		pthread_mutex_unlock(&tee_flight_lock);
+		return process_cmd(ptrHandle, cmd_id, buf_ptr_in, buf_ptr_out, num_params);
+	}
+
+	memset(flight, 0, sizeof(*flight));
+	flight->in_use = 1;
+	memcpy(&flight->guid, &ptrHandle->guid, sizeof(GUID));
+	flight->cmd_id = cmd_id;
+	flight->req = buf_ptr_in[0].buffer;
+	flight->req_size = buf_ptr_in[0].size;
+	flight->resp = buf_ptr_out[0].buffer;
+	flight->resp_size = buf_ptr_out[0].size;
+	pthread_mutex_unlock(&tee_flight_lock);
+
+	status = process_cmd(ptrHandle, cmd_id, buf_ptr_in, buf_ptr_out, num_params);
+
+	pthread_mutex_lock(&tee_flight_lock);
+	flight->status = status;
+	flight->done = 1;
+	pthread_cond_broadcast(&tee_flight_cond);
+	/* Our buffers must outlive every waiter's copy */
+	while (flight->waiters)
+		pthread_cond_wait(&tee_flight_cond, &tee_flight_lock);
+	flight->in_use = 0;
+	pthread_mutex_unlock(&tee_flight_lock);
+
+	return status;
+}
+
+void copySwap( void *vDst, const void *vSrc, const uint32_t length, const tee_swap_flag flag )
+{
         if( ( NULL == vDst ) || ( NULL == vSrc ) )
         {
                 return;
@@ -187,33 +1858,5 @@ void copySwap( void *vDst, const void *vSrc, const uint32_t length, const tee_sw
                 memcpy( vDst, vSrc, length );
                 return;
         }
-        while( pSrc != (uint8_t *)vSrc )
-        {
-                switch( quickSwap )
-                {
-                        /*
-                         *      Because pSrc starts out pointing at one byte
-                         *      past the end of the source data, it must be
-                         *      decremented BEFORE a byte is copied from it.
-                         */
-                        case 0:
-                                *pDst++ = *( --pSrc );
-                        case 7:
-                                *pDst++ = *( --pSrc );
-                        case 6:
-                                *pDst++ = *( --pSrc );
-                        case 5:
-                                *pDst++ = *( --pSrc );
-                        case 4:
-                                *pDst++ = *( --pSrc );
-                        case 3:
-                                *pDst++ = *( --pSrc );
-                        case 2:
-                                *pDst++ = *( --pSrc );
-                        default:
-                                *pDst++ = *( --pSrc );
-                }
-                quickSwap = 0;
-        }
-
+        tee_bswap_buf( vDst, vSrc, length );
 }
@@ -1,6 +1,9 @@
 #ifndef _TXEI_H_
 #define _TXEI_H_
 
+#include <stdint.h>
+#include <linux/types.h>
+
 #define MEI_DEVICE_FILE "/dev/mei"
 #define MEI_VERSION_SYSFS_FILE "/sys/module/mei/version"
 
@@ -51,6 +54,8 @@ typedef struct mei_mm_dma {
 	MEI_MM_DATA data;
 	void *dmabuffer;
 	int fd;
+	int acct;
+	__u64 map_size;
 } MEI_MM_DMA;
 
 typedef struct _MEI_VERSION {
@@ -264,6 +269,14 @@ void mei_disconnect(MEI_HANDLE *my_handle_p);
 
 int mei_sndmsg(MEI_HANDLE *my_handle_p, uint8_t *buf, ssize_t my_size);
 
+/**
+ * Same as mei_sndmsg, but returns once the message is
+ * written instead of waiting for the response to become
+ * readable. A failure means nothing was sent; the caller
+ * polls the handle fd before calling mei_rcvmsg
+ */
+int mei_sndmsg_nowait(MEI_HANDLE *my_handle_p, uint8_t *buf, ssize_t my_size);
+
 /**
  * Allocat a DMA buffer
  * The returns a pointer to a MEI_MM_DMA structure.
@@ -273,8 +286,116 @@ int mei_sndmsg(MEI_HANDLE *my_handle_p, uint8_t *buf, ssize_t my_size);
  */
 MEI_MM_DMA *mei_alloc_dma(ssize_t my_size);
 
+/**
+ * Same as mei_alloc_dma, but charges the buffer to owner
+ * in the DMA usage accounting instead of to "default".
+ * Only the first MEI_DMA_OWNER_LEN - 1 characters count
+ */
+MEI_MM_DMA *mei_alloc_dma_owner(ssize_t my_size, const char *owner);
+
+/**
+ * Releases a DMA buffer. Buffers up to 1MB stay mapped
+ * in a process wide cache and are handed out again by
+ * mei_alloc_dma for a request of the same size class
+ */
 void mei_clear_dma(MEI_MM_DMA *my_dma);
 
+/**
+ * Sets the most bytes of freed DMA buffers the cache keeps
+ * mapped (1MB by default, 0 disables caching). Buffers over
+ * the new limit are released at once
+ */
+void mei_dma_cache_set_limit(size_t bytes);
+
+/**
+ * Returns every cached DMA buffer to the driver, for
+ * callers that know they are done with DMA for a while
+ */
+void mei_dma_cache_trim(void);
+
+#define MEI_DMA_OWNER_LEN	16
+
+/**
+ * DMA memory charged to one owner, or to the whole
+ * process for the "total" entry
+ */
+struct mei_dma_usage {
+	char owner[MEI_DMA_OWNER_LEN];
+	uint64_t bytes;			/* allocated now */
+	uint32_t buffers;
+	uint64_t peak_bytes;		/* since start or mei_dma_reset_peaks */
+	uint32_t peak_buffers;
+	uint32_t allocs;
+	uint32_t failures;
+	uint64_t largest_failed;	/* biggest request that failed */
+	uint64_t cached_bytes;		/* idle in the cache, totals only */
+};
+
+/**
+ * Fills usage for owner, or with the process totals if
+ * owner is NULL. Returns 0, or -1 if owner never allocated
+ */
+int mei_dma_get_usage(const char *owner, struct mei_dma_usage *usage);
+
+/**
+ * Copies up to max owner entries to usage and returns
+ * how many were copied. At most 15 owners are tracked,
+ * later ones are charged together to "other"
+ */
+unsigned int mei_dma_get_usage_all(struct mei_dma_usage *usage,
+				   unsigned int max);
+
+/**
+ * Restarts the high-water marks from the current usage
+ */
+void mei_dma_reset_peaks(void);
+
 int mei_rcvmsg(MEI_HANDLE *my_handle_p, uint8_t *buf, ssize_t my_size);
 
+/**
+ * Sends snd_buf and reads the response into rcv_buf on an
+ * open handle. Returns 0 when both transfers were complete,
+ * a short read count, or -1 on failure
+ */
+int mei_snd_rcv(MEI_HANDLE *my_handle_p, void *snd_buf, ssize_t snd_size,
+	void *rcv_buf, ssize_t rcv_size);
+
+/**
+ * Gets a message buffer of at least size bytes from a per
+ * thread cache of size classes, so that repeated firmware
+ * calls do not go to the heap. Contents are not cleared.
+ * Returns NULL if memory is exhausted
+ */
+void *mei_buf_get(size_t size);
+
+/**
+ * Wipes a buffer obtained with mei_buf_get and releases it
+ * into the calling thread's cache
+ */
+void mei_buf_put(void *buf);
+
+/**
+ * Sets the request coalescing window in microseconds.
+ * Requests sent with mei_request for the same guid that
+ * arrive within the window are grouped onto one connection
+ * and dispatched back to back, trading a small bounded
+ * delay for fewer connects and firmware wakeups. The
+ * process_cmd calls of libtee on one connection, which
+ * ACD and IPT calls share, are grouped the same way.
+ * A window of 0 (the default) disables coalescing.
+ */
+void mei_set_coalesce_window(unsigned int usec);
+
+/* Returns the window set by mei_set_coalesce_window */
+unsigned int mei_get_coalesce_window(void);
+
+/**
+ * Connects to the firmware client with guid, sends
+ * snd_buf, reads the response into rcv_buf and then
+ * disconnects (subject to the coalescing window above).
+ * Return is the number of bytes read, or -1 on failure
+ */
+int mei_request(const GUID *guid, uint8_t *snd_buf, ssize_t snd_size,
+	uint8_t *rcv_buf, ssize_t rcv_size);
+
 #endif /* _TXEI_H_ */
@@ -0,0 +1,60 @@
+#ifndef _TXEI_FAULT_H_
+#define _TXEI_FAULT_H_
+
+/*
+ * Latency and fault injection for the libtxei transport, compiled in
+ * when TXEI_FAULT_INJECTION is defined.
+ *
+ * The configuration is read once, from the TXEI_FAULT environment
+ * variable (rules separated by ';') or from the file named by
+ * TXEI_FAULT_CONFIG (one rule per line, '#' starts a comment):
+ *
+ *	seed=<n>		random seed; a given seed always produces
+ *				the same fault sequence for each client on
+ *				each thread, threads being numbered in the
+ *				order they first reach the shim
+ *	standin=1		do not open /dev/mei, serve every client from
+ *				an in-process loopback that echoes requests
+ *	guid=<data1>|*		the rules below apply to this client only,
+ *				matched on the first GUID field in hex
+ *	latency=fixed:<us>
+ *	latency=uniform:<min_us>:<max_us>
+ *	latency=bimodal:<us>:<p>:<slow_us>
+ *				extra round trip latency
+ *	drop=<p>		response is lost and the send times out
+ *	short_read=<p>		receive returns half of the response, the
+ *				rest of the buffer is cleared
+ *	ebusy=<p>		send or receive fails with EBUSY
+ *	enodev=<p>		send or receive fails with ENODEV
+ *	connect_fail=<p>	mei_connect fails
+ *
+ * Probabilities are given as a fraction between 0 and 1.
+ */
+
+/* Returns an errno value to fail the connect with, or 0 */
+int txei_fault_connect(const GUID *guid);
+
+/* Returns non zero when the loopback stand-in replaces /dev/mei */
+int txei_fault_standin(void);
+
+/* Opens a stand-in connection; returns its fd or -1 */
+int txei_fault_standin_open(MEI_CLIENT *client_properties);
+
+void txei_fault_standin_close(int fd);
+
+/* Returns an errno value to fail a send or receive with, or 0 */
+int txei_fault_io_error(const MEI_HANDLE *my_handle_p);
+
+/*
+ * Called once a request has been written: serves the stand-in,
+ * applies latency and returns non zero if the response was dropped
+ */
+int txei_fault_after_send(const MEI_HANDLE *my_handle_p);
+
+/*
+ * Returns the possibly shortened length of the message of len bytes
+ * received into buf, clearing the bytes cut off
+ */
+int txei_fault_short_read(const MEI_HANDLE *my_handle_p, uint8_t *buf, int len);
+
+#endif /* _TXEI_FAULT_H_ */
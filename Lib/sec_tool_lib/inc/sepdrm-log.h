@@ -113,13 +113,11 @@
 		     "%s():%d: DEBUG - " fmt, __func__, __LINE__, __VA_ARGS__ )
 #else   //  MSVS
 	#define LOGE(fmt, arg...)						\
-		fprintf( stderr, ANDROID_LOG_ERROR, LOG_TAG, fmt, ##arg )
+		fprintf( stderr, fmt, ##arg )
 	#define LOGERR(fmt, arg...)						\
-		fprintf( stderr, ANDROID_LOG_ERROR, LOG_TAG,		\
-		     "%s():%d: ERROR - " fmt, __func__, __LINE__, ##arg )
+		fprintf( stderr, "%s():%d: ERROR - " fmt, __func__, __LINE__, ##arg )
 	#define LOGDBG(fmt, arg...)						\
-		fprintf( stderr, ANDROID_LOG_ERROR, LOG_TAG,		\
-		     "%s():%d: DEBUG - " fmt, __func__, __LINE__, ##arg )
+		fprintf( stderr, "%s():%d: DEBUG - " fmt, __func__, __LINE__, ##arg )
 #endif  //  MSVS
 #endif /* ANDROID */
 
@@ -188,6 +188,43 @@ int wipe_customer_data();
  */
 int get_customer_data(const uint8_t uiFieldIndex, void ** const pvAdcFieldData);
 
+/*
+ * Completion of get_customer_data_async: ret and pvAdcFieldData are
+ * what get_customer_data would have returned and stored. The caller
+ * frees pvAdcFieldData, which is NULL on error.
+ */
+typedef void (*acd_read_callback)(void *ctx, int ret, void *pvAdcFieldData);
+
+/**
+ * get_customer_data_async
+ * @uiFieldIndex: Field index data to read
+ * @callback: Called with the field data once the read completes
+ * @ctx: Passed to callback
+ * @return 0 The read was sent, callback will run from tee_async_poll()
+ * @return <0 Error occurred (negative value), callback will not run
+ *
+ * Same as get_customer_data but returns as soon as the request is sent,
+ * so a caller can keep reads of several fields in flight.
+ */
+int get_customer_data_async(const uint8_t uiFieldIndex, acd_read_callback callback,
+			    void *ctx);
+
+/**
+ * get_customer_data_fields
+ * @uiFieldIndex: Field indexes to read
+ * @uiNumFields: Number of entries in uiFieldIndex
+ * @pvAdcFieldData: Set to the data of each field, as by get_customer_data
+ * @iResult: Set to what get_customer_data would have returned for each field
+ * @return 0 Every field was read
+ * @return <0 Error occurred, the first failed entry of iResult
+ *
+ * Reads several fields on one connection, sending the reads back to back
+ * as far as the firmware queues them. The caller frees every non-NULL
+ * entry of pvAdcFieldData, also when an error is returned.
+ */
+int get_customer_data_fields(const uint8_t uiFieldIndex[], const uint32_t uiNumFields,
+			     void *pvAdcFieldData[], int iResult[]);
+
 /**
  * set_customer_data
  * @uiFieldIndex: which field you are referring to
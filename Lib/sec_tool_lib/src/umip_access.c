@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "ExtApp_qa_op_code.h"
 
 #include "chaabi_error_codes.h"
@@ -52,10 +53,55 @@
 #define PMDB_READ_SUB_OPCODE  1
 #define PMDB_WRITE_SUB_OPCODE 2
 
+//
+// Request header word of an ACD command, the key of its retry policy
+//
+#define ACD_HDR_WORD(sub_opcode) \
+	((uint32_t)ACD_MAIN_OPCODE | ((uint32_t)(sub_opcode) << 16))
+
+//
+// Reads have no side effects and are retried on any transient failure.
+// Writes, locks, provisioning and wipes change the store and are only
+// retried when the request never left the host.
+//
+static const struct tee_retry_policy acd_retry_policies[] = {
+	{
+		.cmd_id = DX_SEP_HOST_SEP_PROTOCOL_IA_ACCESS_OP_CODE,
+		.sub_opcode = ACD_HDR_WORD(OPCODE_IA2CHAABI_ACD_READ),
+		.sub_mask = 0xFFFFFFFF,
+		.idempotent = 1,
+		.max_attempts = 4,
+		.backoff_ms = 2,
+		.max_backoff_ms = 50,
+		.jitter_pct = 25,
+		.deadline_ms = 500,
+		.status_offset = TEE_RETRY_NO_STATUS,
+	},
+	{
+		.cmd_id = DX_SEP_HOST_SEP_PROTOCOL_IA_ACCESS_OP_CODE,
+		.max_attempts = 3,
+		.backoff_ms = 2,
+		.max_backoff_ms = 20,
+		.jitter_pct = 25,
+		.deadline_ms = 500,
+		.status_offset = TEE_RETRY_NO_STATUS,
+	},
+};
+
+//
+// Every ACD call connects and disconnects, so the connection is kept
+// open between calls, e.g. across the field reads made at boot.
+//
+#define ACD_SESSION_IDLE_MS	30000
+
 const GUID guid = {0xafa19346, 0x7459, 0x4f09, {0x9d, 0xad, 0x36, 0x61, 0x1f, 0xe4, 0x28, 0x60}};
 int acd_init(const GUID *guid, void **ptrHandle)
 {
-	int result = tee_init(guid, ptrHandle);
+	int result;
+
+	tee_retry_register(acd_retry_policies,
+			   sizeof(acd_retry_policies) / sizeof(acd_retry_policies[0]));
+	result = tee_init_shared(guid, ptrHandle, ACD_SESSION_IDLE_MS);
 	if (result != 0)
 		printf("error in acd_init");
 	return result;
@@ -100,7 +146,7 @@ int lock_customer_data()
         if( ACD_LOCK_SUCCESS != ret )
         {
                 LOGERR( "process_cmd failed: error 0x%x\n", ret );
-		ptrHandle = NULL;
+		acd_deinit(ptrHandle);
                 return( ret );
         }
 #ifdef ENABLE_LATER
@@ -166,7 +212,7 @@ int wipe_customer_data()
         if( ACD_LOCK_SUCCESS != ret )
         {
                 LOGERR( "process_cmd failed: error 0x%x\n", ret );
-		ptrHandle = NULL;
+		acd_deinit(ptrHandle);
                 return( ret );
         }
 #ifdef ENABLE_LATER
@@ -276,7 +322,7 @@ int set_customer_data( const uint8_t uiFieldIndex,
         if( ACD_WRITE_SUCCESS != ret )
         {
                 LOGERR( "process_cmd failed: error 0x%x\n", ret );
-		ptrHandle = NULL;
+		acd_deinit(ptrHandle);
                 return( ACD_WRITE_SUCCESS - ret );
         }
 #ifdef ENABLE_LATER
@@ -285,7 +331,7 @@ int set_customer_data( const uint8_t uiFieldIndex,
         {
                 LOGERR( "Received failed response: 0x%08x\n", ret );
 		mei_print_buffer("set_customer_data response", (uint8_t *)&resp, sizeof(resp));
-		ptrHandle = NULL;
+		acd_deinit(ptrHandle);
                 return( ACD_WRITE_SUCCESS - ret );
         }
 #endif
@@ -294,7 +340,7 @@ int set_customer_data( const uint8_t uiFieldIndex,
         {
                 LOGERR( "ACD Command failed in FW: 0x%08x\n", ret );
 		mei_print_buffer("set_customer_data response", (uint8_t *)&resp, sizeof(resp)); 
-		ptrHandle = NULL;
+		acd_deinit(ptrHandle);
                 return( ACD_WRITE_SUCCESS - ret );
         }
 	if (ptrHandle != NULL)
@@ -310,15 +356,84 @@ int set_customer_data( const uint8_t uiFieldIndex,
 
 }       //  set_customer_data
 
-int get_customer_data(const uint8_t uiFieldIndex, void **const pvAdcFieldData )
+/*
+ * Fills in the read request for uiFieldIndex and links params and resp
+ * into the command buffers
+ */
+static void init_read_request(const uint8_t uiFieldIndex,
+			      struct acd_read_cmd_from_host *params,
+			      struct acd_read_cmd_to_host *resp,
+			      struct data_buffer *cmd_data_in,
+			      struct data_buffer *cmd_data_out)
+{
+        /*
+         *      Initialize the parameters to zero
+         */
+        memset( params, 0, sizeof( *params ) );
+        memset( resp, 0, sizeof( *resp ) );
+        memset( cmd_data_in, 0, MAX_DATA_BUF_PARAMS * sizeof( *cmd_data_in ) );
+        memset( cmd_data_out, 0, MAX_DATA_BUF_PARAMS * sizeof( *cmd_data_out ) );
+        /*
+         *      Populate the parameter data structures
+         */
+        params->hdr_req.main_opcode = ACD_MAIN_OPCODE;
+        params->hdr_req.sub_opcode = OPCODE_IA2CHAABI_ACD_READ;
+        params->index = uiFieldIndex;
+
+        /*
+         *      Link-up the parameter data structures
+         */
+        INIT_FROM_HOST_PARAM_BUF( cmd_data_in[FROM_HOST_PARAM_INDEX], params, sizeof( *params ) );
+        INIT_TO_HOST_PARAM_BUF( cmd_data_out[TO_HOST_PARAM_INDEX], resp, sizeof( *resp ) );
+
+}       //  init_read_request
+
+/*
+ * Checks the outcome of a read: ret is what process_cmd returned.
+ * Returns ACD_READ_SUCCESS or ACD_READ_SECURE_DATA_PROVISIONED_AND_WRITE_ONLY
+ * when resp holds the field, an error code otherwise.
+ */
+static int check_read_response(uint32_t ret, const struct acd_read_cmd_to_host *resp)
+{
+
+        if( ACD_READ_SUCCESS != ret )
+        {
+                LOGERR( "process_cmd failed: error 0x%x\n", ret );
+                return ACD_READ_SUCCESS - ret;
+        }
+
+        ret = resp->acd_status;
+
+        if( ACD_READ_SUCCESS != ret && ACD_READ_SECURE_DATA_PROVISIONED_AND_WRITE_ONLY != ret)
+        {
+                LOGERR( "ACD Command failed in FW: 0x%08x\n", ret );
+				mei_print_buffer("get_customer_data response", (uint8_t *)resp, sizeof(*resp));
+                return ACD_READ_SUCCESS - ret;
+        }
+
+	if (ACD_READ_SECURE_DATA_PROVISIONED_AND_WRITE_ONLY == ret)
+	{
+		LOGDBG( "Read not allowed on this index\n");
+	}
+
+        LOGDBG("read = %d\n", resp->bytes_read);
+
+        return ret;
+
+}       //  check_read_response
+
+/*
+ * Reads one ACD field into resp. Returns ACD_READ_SUCCESS or
+ * ACD_READ_SECURE_DATA_PROVISIONED_AND_WRITE_ONLY when resp holds the
+ * field, an error code otherwise.
+ */
+static int read_customer_data(const uint8_t uiFieldIndex, struct acd_read_cmd_to_host *resp)
 {
 
         uint32_t                                        ret = 0xffffffff;
-        uint32_t                                        returned_size = 0;
         struct data_buffer                              cmd_data_in[MAX_DATA_BUF_PARAMS];
         struct data_buffer                              cmd_data_out[MAX_DATA_BUF_PARAMS];
         struct acd_read_cmd_from_host		        params;
-        struct acd_read_cmd_to_host		        resp;
 	void *ptrHandle = NULL;
 
 	//Initialize ACD by connecting using the GUID
@@ -338,72 +453,275 @@ int get_customer_data(const uint8_t uiFieldIndex, void **const pvAdcFieldData )
                 ret = ACD_READ_ERROR_ILLEGAL_INPUT_PARAMETER;
 				goto exit;
         }
+
+        init_read_request( uiFieldIndex, &params, resp, cmd_data_in, cmd_data_out );
+        /*
+         *      Send the message off to FW; reads are side-effect free so
+         *      concurrent reads of the same field share one round trip
+         */
+        ret = process_cmd_idempotent( ptrHandle, DX_SEP_HOST_SEP_PROTOCOL_IA_ACCESS_OP_CODE, cmd_data_in, cmd_data_out, 2 );
+        ret = check_read_response( ret, resp );
+
+exit:
+
+	if (ptrHandle != NULL)
+	{
+		if (acd_deinit(ptrHandle) != 0)
+		{
+			LOGERR( "Failed to uninitialize ACD");
+		}
+		ptrHandle = NULL;
+	}
+
+        return ret;
+
+}       //  read_customer_data
+
+/*
+ * Copies the field data in resp to a buffer allocated for the caller.
+ * Returns the number of bytes copied or an error code.
+ */
+static int copy_customer_data(const struct acd_read_cmd_to_host *resp, void **const pvAdcFieldData)
+{
+
+        *pvAdcFieldData = calloc((size_t)resp->bytes_read, sizeof(uint8_t));
+        if( NULL == *pvAdcFieldData )
+        {
+                LOGERR( "unable to allocate the read buffer\n" );
+                return ACD_READ_ERROR_UMIP_READ_FAILURE;
+        }
+
+        memcpy(*pvAdcFieldData, resp->buf, resp->bytes_read);
+        return resp->bytes_read;
+
+}       //  copy_customer_data
+
+int get_customer_data(const uint8_t uiFieldIndex, void **const pvAdcFieldData )
+{
+
+        int                                             ret;
+        struct acd_read_cmd_to_host		        resp;
+
 		if(!(pvAdcFieldData))
         {
                 LOGERR( "pvAdcFieldData is invalid\n" );
-                ret = ACD_READ_ERROR_ILLEGAL_INPUT_PARAMETER;
-				goto exit;
+                return ACD_READ_ERROR_ILLEGAL_INPUT_PARAMETER;
         }
-        /*
-         *      Initialize the parameters to zero
-         */
-        memset( &params, 0, sizeof( params ) );
-        memset( &resp, 0, sizeof( resp ) );
-        memset( cmd_data_in, 0, sizeof( cmd_data_in ) );
-        memset( cmd_data_out, 0, sizeof( cmd_data_out ) );
-        /*
-         *      Populate the parameter data structures
-         */
-        params.hdr_req.main_opcode = ACD_MAIN_OPCODE;
-        params.hdr_req.sub_opcode = OPCODE_IA2CHAABI_ACD_READ;
-        params.index = uiFieldIndex;
 
-        /*
-         *      Link-up the parameter data structures
-         */
-        INIT_FROM_HOST_PARAM_BUF( cmd_data_in[FROM_HOST_PARAM_INDEX], &params, sizeof( params ) );
-        INIT_TO_HOST_PARAM_BUF( cmd_data_out[TO_HOST_PARAM_INDEX], &resp, sizeof( resp ) );
-        /*
-         *      Send the message off to FW
-         */
-        ret = process_cmd( ptrHandle, DX_SEP_HOST_SEP_PROTOCOL_IA_ACCESS_OP_CODE, cmd_data_in, cmd_data_out, 2 );
+        ret = read_customer_data( uiFieldIndex, &resp );
+        if( ACD_READ_SUCCESS != ret && ACD_READ_SECURE_DATA_PROVISIONED_AND_WRITE_ONLY != ret)
+        {
+                return ret;
+        }
 
-        if( ACD_READ_SUCCESS != ret )
+        return copy_customer_data( &resp, pvAdcFieldData );
+
+}       //  get_customer_data
+
+/*
+ * State of one get_customer_data_async call, alive from the submit
+ * until its callback has run
+ */
+struct acd_read_async {
+	void *ptrHandle;
+	struct acd_read_cmd_from_host params;
+	struct acd_read_cmd_to_host resp;
+	acd_read_callback callback;
+	void *ctx;
+};
+
+static void acd_read_done(void *ctx, uint32_t status)
+{
+	struct acd_read_async *op = ctx;
+	void *pvAdcFieldData = NULL;
+	int ret;
+
+	ret = check_read_response( status, &op->resp );
+	if (acd_deinit(op->ptrHandle) != 0)
+	{
+		LOGERR( "Failed to uninitialize ACD");
+	}
+
+	if( ACD_READ_SUCCESS == ret || ACD_READ_SECURE_DATA_PROVISIONED_AND_WRITE_ONLY == ret)
+		ret = copy_customer_data( &op->resp, &pvAdcFieldData );
+
+	op->callback(op->ctx, ret, pvAdcFieldData);
+	free(op);
+}
+
+int get_customer_data_async(const uint8_t uiFieldIndex, acd_read_callback callback, void *ctx)
+{
+
+        uint32_t                                        ret;
+        struct data_buffer                              cmd_data_in[MAX_DATA_BUF_PARAMS];
+        struct data_buffer                              cmd_data_out[MAX_DATA_BUF_PARAMS];
+        struct acd_read_async                           *op;
+
+        if( !callback || !( (ACD_MIN_FIELD_INDEX <= uiFieldIndex) && (ACD_MAX_FIELD_INDEX >= uiFieldIndex )))
         {
-                LOGERR( "process_cmd failed: error 0x%x\n", ret );
-                ret = ACD_READ_SUCCESS - ret;
-				goto exit;
+                LOGERR( "field index %u or callback is illegal.\n", uiFieldIndex );
+                return ACD_READ_ERROR_ILLEGAL_INPUT_PARAMETER;
         }
 
-        ret = resp.acd_status;
+        op = calloc(1, sizeof(*op));
+        if( NULL == op )
+        {
+                LOGERR( "unable to allocate the read request\n" );
+                return ACD_READ_ERROR_UMIP_READ_FAILURE;
+        }
+        op->callback = callback;
+        op->ctx = ctx;
 
-        if( ACD_READ_SUCCESS != ret && ACD_READ_SECURE_DATA_PROVISIONED_AND_WRITE_ONLY != ret)
+	//Initialize ACD by connecting using the GUID
+	ret = acd_init(&guid, &op->ptrHandle);
+	if (!(ret == EXIT_SUCCESS && op->ptrHandle))
+	{
+		LOGERR("Failed to Initialize ACD: 0x%08x\n", ret);
+		free(op);
+		return ret;
+	}
+
+        init_read_request( uiFieldIndex, &op->params, &op->resp, cmd_data_in, cmd_data_out );
+        ret = process_cmd_async( op->ptrHandle, DX_SEP_HOST_SEP_PROTOCOL_IA_ACCESS_OP_CODE,
+                                 cmd_data_in, cmd_data_out, 2, acd_read_done, op );
+        if( ACD_READ_SUCCESS != ret )
         {
-                LOGERR( "ACD Command failed in FW: 0x%08x\n", ret );
-				mei_print_buffer("get_customer_data response", (uint8_t *)&resp, sizeof(resp)); 
-               ret = ACD_READ_SUCCESS - ret;
-			   goto exit;
+                LOGERR( "process_cmd_async failed: error 0x%x\n", ret );
+                acd_deinit(op->ptrHandle);
+                free(op);
+                return ACD_READ_SUCCESS - ret;
         }
 
-	if (ACD_READ_SECURE_DATA_PROVISIONED_AND_WRITE_ONLY == ret)
+        return ACD_READ_SUCCESS;
+
+}       //  get_customer_data_async
+
+//
+// Firmware pipeline depth is probed once per process, on the first
+// read of more than one field, with at most this many reads queued.
+//
+#define ACD_PIPELINE_MAX_DEPTH	4
+
+static pthread_mutex_t acd_probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static int acd_probed;
+
+/*
+ * One field of a get_customer_data_fields call
+ */
+struct acd_read_field {
+	struct acd_read_cmd_from_host params;
+	struct acd_read_cmd_to_host resp;
+	struct data_buffer cmd_data_in[MAX_DATA_BUF_PARAMS];
+	struct data_buffer cmd_data_out[MAX_DATA_BUF_PARAMS];
+};
+
+/*
+ * Probes the ACD client with a copy of probe unless done before. A
+ * depth below the maximum means a probe round failed and broke the
+ * connection, which is then opened again in *ptrHandle.
+ */
+static int acd_probe_depth(void **ptrHandle, const struct tee_cmd *probe)
+{
+	uint32_t depth = 1;
+	int ret = EXIT_SUCCESS;
+
+	pthread_mutex_lock(&acd_probe_lock);
+	if (!acd_probed)
 	{
-		LOGDBG( "Read not allowed on this index\n");
+		acd_probed = 1;
+		if (tee_pipeline_probe(*ptrHandle, probe, ACD_PIPELINE_MAX_DEPTH, &depth) == 0 &&
+		    depth < ACD_PIPELINE_MAX_DEPTH)
+		{
+			acd_deinit(*ptrHandle);
+			*ptrHandle = NULL;
+			ret = acd_init(&guid, ptrHandle);
+		}
+		LOGDBG("ACD pipeline depth %u\n", depth);
 	}
+	pthread_mutex_unlock(&acd_probe_lock);
 
-        returned_size = resp.bytes_read;
+	return ret;
+}
 
-        LOGDBG("read = %d\n", returned_size);
+int get_customer_data_fields(const uint8_t uiFieldIndex[], const uint32_t uiNumFields,
+			     void *pvAdcFieldData[], int iResult[])
+{
 
-        *pvAdcFieldData = calloc((size_t)returned_size, sizeof(uint8_t));
-        if( NULL == *pvAdcFieldData )
+        uint32_t                                        ret;
+        uint32_t                                        cnt;
+        struct acd_read_field                           *fields;
+        struct tee_cmd                                  *cmds;
+        void                                            *ptrHandle = NULL;
+        int                                             first_error = ACD_READ_SUCCESS;
+
+        if( !uiFieldIndex || !uiNumFields || !pvAdcFieldData || !iResult )
         {
-                LOGERR( "unable to allocate the read buffer\n" );
-                ret = ACD_READ_ERROR_UMIP_READ_FAILURE;
-				goto exit;
+                LOGERR( "field list is invalid\n" );
+                return ACD_READ_ERROR_ILLEGAL_INPUT_PARAMETER;
         }
 
-        memcpy(*pvAdcFieldData, resp.buf, returned_size);
-		ret = returned_size;
+        for( cnt = 0; cnt < uiNumFields; cnt++ )
+        {
+                pvAdcFieldData[cnt] = NULL;
+                iResult[cnt] = ACD_READ_ERROR_UMIP_READ_FAILURE;
+        }
+
+        for( cnt = 0; cnt < uiNumFields; cnt++ )
+        {
+                if(!( (ACD_MIN_FIELD_INDEX <= uiFieldIndex[cnt]) && (ACD_MAX_FIELD_INDEX >= uiFieldIndex[cnt] )))
+                {
+                        LOGERR( "field index %u is illegal.\n", uiFieldIndex[cnt] );
+                        return ACD_READ_ERROR_ILLEGAL_INPUT_PARAMETER;
+                }
+        }
+
+        fields = calloc(uiNumFields, sizeof(*fields));
+        cmds = calloc(uiNumFields, sizeof(*cmds));
+        if( NULL == fields || NULL == cmds )
+        {
+                LOGERR( "unable to allocate the read requests\n" );
+                free(fields);
+                free(cmds);
+                return ACD_READ_ERROR_UMIP_READ_FAILURE;
+        }
+
+        for( cnt = 0; cnt < uiNumFields; cnt++ )
+        {
+                init_read_request( uiFieldIndex[cnt], &fields[cnt].params, &fields[cnt].resp,
+                                   fields[cnt].cmd_data_in, fields[cnt].cmd_data_out );
+                cmds[cnt].cmd_id = DX_SEP_HOST_SEP_PROTOCOL_IA_ACCESS_OP_CODE;
+                cmds[cnt].buf_ptr_in = fields[cnt].cmd_data_in;
+                cmds[cnt].buf_ptr_out = fields[cnt].cmd_data_out;
+                cmds[cnt].num_params = 2;
+        }
+
+	//Initialize ACD by connecting using the GUID
+	ret = acd_init(&guid, &ptrHandle);
+	if (ret == EXIT_SUCCESS && ptrHandle && uiNumFields > 1)
+		ret = acd_probe_depth(&ptrHandle, &cmds[0]);
+	if (!(ret == EXIT_SUCCESS && ptrHandle))
+	{
+		LOGERR("Failed to Initialize ACD: 0x%08x\n", ret);
+		for (cnt = 0; cnt < uiNumFields; cnt++)
+			iResult[cnt] = ret;
+		first_error = ret;
+		goto exit;
+	}
+
+        /*
+         *      Reads are independent, so send them back to back and
+         *      collect the responses in order
+         */
+        process_cmd_pipelined( ptrHandle, cmds, uiNumFields );
+
+        for( cnt = 0; cnt < uiNumFields; cnt++ )
+        {
+                iResult[cnt] = check_read_response( cmds[cnt].status, &fields[cnt].resp );
+                if( ACD_READ_SUCCESS == iResult[cnt] || ACD_READ_SECURE_DATA_PROVISIONED_AND_WRITE_ONLY == iResult[cnt] )
+                        iResult[cnt] = copy_customer_data( &fields[cnt].resp, &pvAdcFieldData[cnt] );
+                if( iResult[cnt] < 0 && ACD_READ_SUCCESS == first_error )
+                        first_error = iResult[cnt];
+        }
 
 exit:
 
@@ -413,12 +731,13 @@ exit:
 		{
 			LOGERR( "Failed to uninitialize ACD");
 		}
-		ptrHandle = NULL;
 	}
+        free(fields);
+        free(cmds);
 
-        return ret;
+        return first_error;
 
-}       //  get_customer_data
+}       //  get_customer_data_fields
 
 
 /**
@@ -514,7 +833,7 @@ int provision_customer_data( const uint32_t provisionSchema,
         if( ACD_PROV_SUCCESS != ret )
         {
                 LOGERR( "process_cmd failed: error 0x%x\n", ret );
-		ptrHandle = NULL;
+		acd_deinit(ptrHandle);
                 return( ACD_PROV_SUCCESS - ret );
         }
 #ifdef ENABLE_LATER
@@ -523,7 +842,7 @@ int provision_customer_data( const uint32_t provisionSchema,
         {
                 LOGERR( "Received failed response: 0x%08x\n", ret );
 		//mei_print_buffer("provision_customer_data response", (uint8_t *)&resp, sizeof(resp)); 
-		ptrHandle = NULL;
+		acd_deinit(ptrHandle);
                 return( ACD_PROV_SUCCESS - ret );
         }
 #endif
@@ -532,7 +851,7 @@ int provision_customer_data( const uint32_t provisionSchema,
         {
                 LOGERR( "ACD Command failed in FW: 0x%08x\n", ret );
 		//mei_print_buffer("provision_customer_data response", (uint8_t *)&resp, sizeof(resp)); 
-		ptrHandle = NULL;
+		acd_deinit(ptrHandle);
 		return ( ACD_PROV_SUCCESS - ret );
         }
         returnDataSizeInBytes = resp.bytes_read;
@@ -555,7 +874,7 @@ int provision_customer_data( const uint32_t provisionSchema,
 		if (NULL == pOutData)
 		{
 			LOGERR( "ACD provisioning output data buffer pointer is NULL.\n" );
-			ptrHandle = NULL;
+			acd_deinit(ptrHandle);
 			return( ACD_PROV_ERROR_ILLEGAL_PARAMETER );
 		}
                 *pOutData = calloc( (size_t)returnDataSizeInBytes, sizeof( uint8_t ) );
@@ -563,7 +882,7 @@ int provision_customer_data( const uint32_t provisionSchema,
                 {
                         LOGERR( "Could not allocate 0x%08x bytes of memory for output data buffer.\n", returnDataSizeInBytes );
                         *pOutDataSize = ACD_MIN_DATA_SIZE_IN_BYTES;
-			ptrHandle = NULL;
+			acd_deinit(ptrHandle);
                         return( ACD_PROV_ERROR_RETURN_DATA_MEM_ALLOC_FAIL );
                 }
                 /*
@@ -0,0 +1,429 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include "txei.h"
+#include "txei_fault.h"
+
+#define TXEI_FAULT_MAX_RULES	8
+#define TXEI_FAULT_MAX_STANDIN	32
+#define TXEI_FAULT_STANDIN_MTU	4096
+#define TXEI_FAULT_DRAIN_MS	10000
+
+enum {
+	TXEI_FAULT_LATENCY_NONE = 0,
+	TXEI_FAULT_LATENCY_FIXED,
+	TXEI_FAULT_LATENCY_UNIFORM,
+	TXEI_FAULT_LATENCY_BIMODAL
+};
+
+struct txei_fault_rule {
+	int any_guid;
+	unsigned int data1;
+	int latency_type;
+	unsigned int latency_us;
+	unsigned int latency_slow_us;
+	double latency_p;
+	double drop;
+	double short_read;
+	double ebusy;
+	double enodev;
+	double connect_fail;
+};
+
+/* Random state of one thread, a stream per rule */
+struct txei_fault_thread {
+	uint64_t rng[TXEI_FAULT_MAX_RULES];
+};
+
+struct txei_fault_standin_conn {
+	int host_fd;
+	int fw_fd;
+};
+
+static pthread_once_t txei_fault_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t txei_fault_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t txei_fault_key;
+static unsigned int txei_fault_threads = 0;
+static struct txei_fault_rule txei_fault_rules[TXEI_FAULT_MAX_RULES];
+static int txei_fault_num_rules = 0;
+static int txei_fault_use_standin = 0;
+static uint64_t txei_fault_seed = 1;
+static struct txei_fault_standin_conn txei_fault_conns[TXEI_FAULT_MAX_STANDIN];
+
+static char *txei_fault_trim(char *str)
+{
+	char *end;
+
+	while (*str == ' ' || *str == '\t')
+		str++;
+	end = str + strlen(str);
+	while (end > str && (end[-1] == ' ' || end[-1] == '\t' ||
+		end[-1] == '\r' || end[-1] == '\n'))
+		*--end = '\0';
+	return str;
+}
+
+static void txei_fault_parse_latency(struct txei_fault_rule *rule, const char *val)
+{
+	if (sscanf(val, "fixed:%u", &rule->latency_us) == 1) {
+		rule->latency_type = TXEI_FAULT_LATENCY_FIXED;
+	} else if (sscanf(val, "uniform:%u:%u", &rule->latency_us,
+		&rule->latency_slow_us) == 2) {
+		rule->latency_type = TXEI_FAULT_LATENCY_UNIFORM;
+	} else if (sscanf(val, "bimodal:%u:%lf:%u", &rule->latency_us,
+		&rule->latency_p, &rule->latency_slow_us) == 3) {
+		rule->latency_type = TXEI_FAULT_LATENCY_BIMODAL;
+	} else {
+		printf("fault: bad latency spec %s\n", val);
+	}
+}
+
+static void txei_fault_parse_rule(char *line)
+{
+	struct txei_fault_rule *rule;
+	char *key;
+	char *val;
+
+	key = txei_fault_trim(line);
+	if (*key == '\0' || *key == '#')
+		return;
+
+	val = strchr(key, '=');
+	if (val == NULL) {
+		printf("fault: ignoring %s\n", key);
+		return;
+	}
+	*val++ = '\0';
+	key = txei_fault_trim(key);
+	val = txei_fault_trim(val);
+
+	rule = &txei_fault_rules[txei_fault_num_rules - 1];
+
+	if (strcmp(key, "seed") == 0) {
+		txei_fault_seed = strtoull(val, NULL, 0);
+	} else if (strcmp(key, "standin") == 0) {
+		txei_fault_use_standin = atoi(val);
+	} else if (strcmp(key, "guid") == 0) {
+		if (txei_fault_num_rules == TXEI_FAULT_MAX_RULES) {
+			printf("fault: too many guid rules, ignoring %s\n", val);
+			return;
+		}
+		rule = &txei_fault_rules[txei_fault_num_rules++];
+		memset(rule, 0, sizeof(*rule));
+		if (strcmp(val, "*") == 0)
+			rule->any_guid = 1;
+		else
+			rule->data1 = (unsigned int)strtoul(val, NULL, 16);
+	} else if (strcmp(key, "latency") == 0) {
+		txei_fault_parse_latency(rule, val);
+	} else if (strcmp(key, "drop") == 0) {
+		rule->drop = atof(val);
+	} else if (strcmp(key, "short_read") == 0) {
+		rule->short_read = atof(val);
+	} else if (strcmp(key, "ebusy") == 0) {
+		rule->ebusy = atof(val);
+	} else if (strcmp(key, "enodev") == 0) {
+		rule->enodev = atof(val);
+	} else if (strcmp(key, "connect_fail") == 0) {
+		rule->connect_fail = atof(val);
+	} else {
+		printf("fault: unknown key %s\n", key);
+	}
+}
+
+/* splitmix64 finalizer, spreads nearby seeds over the whole state */
+static uint64_t txei_fault_mix(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	x ^= x >> 31;
+	return x ? x : 1;
+}
+
+static void txei_fault_load(void)
+{
+	const char *path = getenv("TXEI_FAULT_CONFIG");
+	const char *env = getenv("TXEI_FAULT");
+	char line[256];
+	char *copy;
+	char *tok;
+	char *save = NULL;
+	FILE *fp;
+
+	/* Rule 0 covers every client until a guid= line says otherwise */
+	memset(txei_fault_rules, 0, sizeof(txei_fault_rules));
+	txei_fault_rules[0].any_guid = 1;
+	txei_fault_num_rules = 1;
+
+	if (path != NULL) {
+		fp = fopen(path, "r");
+		if (fp == NULL) {
+			printf("fault: cannot open %s, errno: %x\n", path, errno);
+		} else {
+			while (fgets(line, sizeof(line), fp) != NULL)
+				txei_fault_parse_rule(line);
+			fclose(fp);
+		}
+	}
+
+	if (env != NULL) {
+		copy = strdup(env);
+		if (copy != NULL) {
+			for (tok = strtok_r(copy, ";", &save); tok != NULL;
+				tok = strtok_r(NULL, ";", &save))
+				txei_fault_parse_rule(tok);
+			free(copy);
+		}
+	}
+
+	if (pthread_key_create(&txei_fault_key, free) != 0)
+		printf("fault: cannot create thread key, no faults injected\n");
+}
+
+/*
+ * Returns the random state of the calling thread, or NULL if it cannot
+ * be allocated. Threads are numbered in the order they first roll, and
+ * each gets its own stream per rule, so clients and threads do not
+ * perturb each other and a seed replays as long as that order holds
+ */
+static struct txei_fault_thread *txei_fault_thread_state(void)
+{
+	struct txei_fault_thread *state;
+	unsigned int thread;
+	uint64_t x;
+	int a;
+
+	state = pthread_getspecific(txei_fault_key);
+	if (state != NULL)
+		return state;
+
+	state = malloc(sizeof(*state));
+	if (state == NULL || pthread_setspecific(txei_fault_key, state) != 0) {
+		free(state);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&txei_fault_lock);
+	thread = txei_fault_threads++;
+	pthread_mutex_unlock(&txei_fault_lock);
+
+	for (a = 0; a < TXEI_FAULT_MAX_RULES; a++) {
+		x = txei_fault_seed + (uint64_t)(a + 1) * 0x9E3779B97F4A7C15ULL;
+		state->rng[a] = txei_fault_mix(txei_fault_mix(x) + thread);
+	}
+	return state;
+}
+
+static struct txei_fault_rule *txei_fault_find_rule(const GUID *guid)
+{
+	int a;
+
+	pthread_once(&txei_fault_once, txei_fault_load);
+
+	/* Later, more specific rules win over the catch-all */
+	for (a = txei_fault_num_rules - 1; a > 0; a--) {
+		if (txei_fault_rules[a].any_guid ||
+		    txei_fault_rules[a].data1 == guid->data1)
+			return &txei_fault_rules[a];
+	}
+	return &txei_fault_rules[0];
+}
+
+/* xorshift64* on the calling thread's stream for rule */
+static double txei_fault_random(struct txei_fault_rule *rule)
+{
+	struct txei_fault_thread *state = txei_fault_thread_state();
+	uint64_t x;
+
+	/* Without state nothing is injected rather than sharing a stream */
+	if (state == NULL)
+		return 1.0;
+
+	x = state->rng[rule - txei_fault_rules];
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	state->rng[rule - txei_fault_rules] = x;
+	return (double)((x * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+static int txei_fault_roll(struct txei_fault_rule *rule, double p)
+{
+	return (p > 0) && (txei_fault_random(rule) < p);
+}
+
+static unsigned int txei_fault_latency(struct txei_fault_rule *rule)
+{
+	switch (rule->latency_type) {
+	case TXEI_FAULT_LATENCY_FIXED:
+		return rule->latency_us;
+	case TXEI_FAULT_LATENCY_UNIFORM:
+		if (rule->latency_slow_us <= rule->latency_us)
+			return rule->latency_us;
+		return rule->latency_us + (unsigned int)(txei_fault_random(rule) *
+			(rule->latency_slow_us - rule->latency_us));
+	case TXEI_FAULT_LATENCY_BIMODAL:
+		return txei_fault_roll(rule, rule->latency_p) ?
+			rule->latency_slow_us : rule->latency_us;
+	default:
+		return 0;
+	}
+}
+
+int txei_fault_connect(const GUID *guid)
+{
+	struct txei_fault_rule *rule = txei_fault_find_rule(guid);
+
+	/* Same errno the driver gives for a client it cannot find */
+	return txei_fault_roll(rule, rule->connect_fail) ? ENOTTY : 0;
+}
+
+int txei_fault_standin(void)
+{
+	pthread_once(&txei_fault_once, txei_fault_load);
+	return txei_fault_use_standin;
+}
+
+int txei_fault_standin_open(MEI_CLIENT *client_properties)
+{
+	int sv[2];
+	int a;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) != 0) {
+		printf("fault: cannot create stand-in socket, errno: %x\n", errno);
+		return -1;
+	}
+
+	pthread_mutex_lock(&txei_fault_lock);
+	for (a = 0; a < TXEI_FAULT_MAX_STANDIN; a++) {
+		if (txei_fault_conns[a].fw_fd <= 0) {
+			txei_fault_conns[a].host_fd = sv[0];
+			txei_fault_conns[a].fw_fd = sv[1];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&txei_fault_lock);
+
+	if (a == TXEI_FAULT_MAX_STANDIN) {
+		printf("fault: too many stand-in connections\n");
+		close(sv[0]);
+		close(sv[1]);
+		errno = EBUSY;
+		return -1;
+	}
+
+	memset(client_properties, 0, sizeof(MEI_CLIENT));
+	client_properties->MaxMessageLength = TXEI_FAULT_STANDIN_MTU;
+	client_properties->ProtocolVersion = 1;
+
+	return sv[0];
+}
+
+static int txei_fault_standin_fw_fd(int host_fd)
+{
+	int fw_fd = -1;
+	int a;
+
+	pthread_mutex_lock(&txei_fault_lock);
+	for (a = 0; a < TXEI_FAULT_MAX_STANDIN; a++) {
+		if (txei_fault_conns[a].fw_fd > 0 &&
+		    txei_fault_conns[a].host_fd == host_fd) {
+			fw_fd = txei_fault_conns[a].fw_fd;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&txei_fault_lock);
+	return fw_fd;
+}
+
+void txei_fault_standin_close(int fd)
+{
+	int a;
+
+	pthread_mutex_lock(&txei_fault_lock);
+	for (a = 0; a < TXEI_FAULT_MAX_STANDIN; a++) {
+		if (txei_fault_conns[a].fw_fd > 0 &&
+		    txei_fault_conns[a].host_fd == fd) {
+			close(txei_fault_conns[a].fw_fd);
+			txei_fault_conns[a].fw_fd = 0;
+			txei_fault_conns[a].host_fd = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&txei_fault_lock);
+}
+
+int txei_fault_io_error(const MEI_HANDLE *my_handle_p)
+{
+	struct txei_fault_rule *rule = txei_fault_find_rule(&my_handle_p->guid);
+
+	if (txei_fault_roll(rule, rule->ebusy))
+		return EBUSY;
+	if (txei_fault_roll(rule, rule->enodev))
+		return ENODEV;
+	return 0;
+}
+
+int txei_fault_after_send(const MEI_HANDLE *my_handle_p)
+{
+	struct txei_fault_rule *rule = txei_fault_find_rule(&my_handle_p->guid);
+	uint8_t msg[TXEI_FAULT_STANDIN_MTU];
+	struct timespec delay;
+	struct timeval tv;
+	unsigned int usec;
+	fd_set set;
+	int drop;
+	int fw_fd;
+	int rv;
+
+	drop = txei_fault_roll(rule, rule->drop);
+	usec = txei_fault_latency(rule);
+
+	if (usec) {
+		delay.tv_sec = usec / 1000000;
+		delay.tv_nsec = (long)(usec % 1000000) * 1000;
+		nanosleep(&delay, NULL);
+	}
+
+	if (txei_fault_use_standin) {
+		/* The stand-in client answers every request with an echo */
+		fw_fd = txei_fault_standin_fw_fd(my_handle_p->fd);
+		if (fw_fd < 0)
+			return drop;
+		rv = read(fw_fd, msg, sizeof(msg));
+		if (rv > 0 && !drop)
+			write(fw_fd, msg, rv);
+		return drop;
+	}
+
+	if (drop) {
+		/* Swallow the real response so it cannot be read later */
+		tv.tv_sec = TXEI_FAULT_DRAIN_MS / 1000;
+		tv.tv_usec = (TXEI_FAULT_DRAIN_MS % 1000) * 1000;
+		FD_ZERO(&set);
+		FD_SET(my_handle_p->fd, &set);
+		if (select(my_handle_p->fd + 1, &set, NULL, NULL, &tv) > 0)
+			read(my_handle_p->fd, msg, sizeof(msg));
+	}
+	return drop;
+}
+
+int txei_fault_short_read(const MEI_HANDLE *my_handle_p, uint8_t *buf, int len)
+{
+	struct txei_fault_rule *rule = txei_fault_find_rule(&my_handle_p->guid);
+
+	if (len <= 1 || !txei_fault_roll(rule, rule->short_read))
+		return len;
+
+	/* The whole response was read, lose the tail as a short read would */
+	memset(buf + len / 2, 0, len - len / 2);
+	return len / 2;
+}
@@ -5,11 +5,16 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include "txei.h"
+#ifdef TXEI_FAULT_INJECTION
+#include "txei_fault.h"
+#endif
 
 #undef MEI_IOCTL
 #undef IOCTL_MEI_CONNECT_CLIENT
@@ -33,6 +38,80 @@ const GUID my_old_guid = {0xafa19346, 0x7459, 0x4f09, {0x9d, 0xad, 0x36, 0x61, 0
 
 MEI_VERSION my_mei_version;
 
+/*
+ * Request coalescing
+ *
+ * The first mei_request() for a GUID becomes the leader of a batch: it
+ * sleeps for the coalescing window, takes every request queued for the
+ * same GUID in the meantime and runs them back to back over a single
+ * connection. The other callers sleep until the leader has filled in
+ * their result.
+ */
+#define MEI_COALESCE_MAX_GUIDS 8
+
+struct mei_coalesce_req {
+	uint8_t *snd_buf;
+	ssize_t snd_size;
+	uint8_t *rcv_buf;
+	ssize_t rcv_size;
+	int result;
+	int done;
+	struct mei_coalesce_req *next;
+};
+
+struct mei_coalesce_slot {
+	GUID guid;
+	int in_use;
+	int collecting;
+	struct mei_coalesce_req *head;
+	struct mei_coalesce_req *tail;
+};
+
+static pthread_mutex_t mei_coalesce_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mei_coalesce_cond = PTHREAD_COND_INITIALIZER;
+static struct mei_coalesce_slot mei_coalesce_slots[MEI_COALESCE_MAX_GUIDS];
+static unsigned int mei_coalesce_usec = 0;
+
+/*
+ * DMA buffer cache
+ *
+ * mei_clear_dma() keeps freed buffers mapped on per size class lists
+ * and mei_alloc_dma() hands them out again, so a stream of same sized
+ * allocations stays out of the kernel. Classes are powers of two from
+ * one page to 1MB. While the cache limit leaves room for a buffer it is
+ * mapped at its class size, data.size still being the size asked for;
+ * larger buffers are never cached. The cache holds at most mei_dma_cache_limit
+ * bytes, and is emptied and the allocation retried once when the driver
+ * runs out of memory.
+ */
+#define MEI_DMA_MIN_SHIFT	12	/* 4KB */
+#define MEI_DMA_NUM_CLASSES	9	/* up to 1MB */
+#define MEI_DMA_PER_CLASS	8
+#define MEI_DMA_DEFAULT_LIMIT	(1024 * 1024)
+
+static pthread_mutex_t mei_dma_lock = PTHREAD_MUTEX_INITIALIZER;
+static MEI_MM_DMA *mei_dma_cached[MEI_DMA_NUM_CLASSES][MEI_DMA_PER_CLASS];
+static unsigned int mei_dma_count[MEI_DMA_NUM_CLASSES];
+static size_t mei_dma_cache_bytes = 0;
+static size_t mei_dma_cache_limit = MEI_DMA_DEFAULT_LIMIT;
+
+/*
+ * DMA usage accounting
+ *
+ * Buffers are charged to the owner tag given to mei_alloc_dma_owner(),
+ * "default" for mei_alloc_dma(), and to the process totals from
+ * allocation until mei_clear_dma(). Buffers sitting in the cache are
+ * charged to nobody and reported as cached_bytes in the totals.
+ */
+#define MEI_DMA_MAX_OWNERS	16
+#define MEI_DMA_OWNER_DEFAULT	"default"
+#define MEI_DMA_OWNER_OTHER	"other"
+
+static pthread_mutex_t mei_dma_acct_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mei_dma_usage mei_dma_acct[MEI_DMA_MAX_OWNERS];
+static struct mei_dma_usage mei_dma_acct_total = { "total" };
+static unsigned int mei_dma_acct_num = 0;
+
 void mei_print_buffer(char *label, uint8_t *buf, ssize_t len)
 {
 	int a;
@@ -123,6 +202,26 @@ MEI_HANDLE *mei_connect(const GUID *guid)
 	/*	return NULL; */
 	/*} */
 
+#ifdef TXEI_FAULT_INJECTION
+	result = txei_fault_connect(guid);
+	if (result) {
+		printf("fault: failing connect with errno %x\n", result);
+		free(my_handle_p);
+		errno = result;
+		return NULL;
+	}
+
+	if (txei_fault_standin()) {
+		my_handle_p->fd = txei_fault_standin_open(
+			&my_handle_p->client_properties);
+		if (my_handle_p->fd == -1) {
+			free(my_handle_p);
+			return NULL;
+		}
+		return my_handle_p;
+	}
+#endif
+
 	/* Open the device file */
 	my_handle_p->fd = open(MEI_DEVICE_FILE, O_RDWR);
 	if (my_handle_p->fd == -1) {
@@ -167,21 +266,25 @@ void mei_disconnect(MEI_HANDLE *my_handle_p)
 		return;
 	}
 
+#ifdef TXEI_FAULT_INJECTION
+	txei_fault_standin_close(my_handle_p->fd);
+#endif
+
 	close(my_handle_p->fd);
 	free(my_handle_p);
 }
 
-int mei_sndmsg(MEI_HANDLE *my_handle_p, uint8_t *buf, ssize_t my_size)
+/*
+ * Writes one message. *dropped is set when fault injection has lost the
+ * response; nothing reaches the client when this fails
+ */
+static int mei_write_msg(MEI_HANDLE *my_handle_p, uint8_t *buf, ssize_t my_size,
+	int *dropped)
 {
-	unsigned long timeout = 10000;
 	int rv = 0;
-	int return_length =0;
 	int error = 0;
-	fd_set set;
-	struct timeval tv;
 
-	tv.tv_sec =  timeout / 1000;
-	tv.tv_usec =(timeout % 1000) * 1000000;
+	*dropped = 0;
 
 	if (my_handle_p == NULL) {
 		printf("null handle for sndmsg\n");
@@ -198,6 +301,15 @@ int mei_sndmsg(MEI_HANDLE *my_handle_p, uint8_t *buf, ssize_t my_size)
 		return -1;
 	}
 
+#ifdef TXEI_FAULT_INJECTION
+	error = txei_fault_io_error(my_handle_p);
+	if (error) {
+		fprintf(stderr, "fault: failing write with errno %d\n", error);
+		errno = error;
+		return -1;
+	}
+#endif
+
 
 //	fprintf(stdout, "call write length = %d\n", (int)my_size);
 
@@ -205,11 +317,42 @@ int mei_sndmsg(MEI_HANDLE *my_handle_p, uint8_t *buf, ssize_t my_size)
 	if (rv < 0) {
 		error = errno;
 		fprintf(stderr,"write failed with status %d %d\n", rv, error);
+		errno = error;
 		return -1;
 	}
 
+#ifdef TXEI_FAULT_INJECTION
+	*dropped = txei_fault_after_send(my_handle_p);
+#endif
+
+	return rv;
+}
+
+int mei_sndmsg(MEI_HANDLE *my_handle_p, uint8_t *buf, ssize_t my_size)
+{
+	unsigned long timeout = 10000;
+	int rv = 0;
+	int return_length =0;
+	int error = 0;
+	int dropped;
+	fd_set set;
+	struct timeval tv;
+
+	tv.tv_sec =  timeout / 1000;
+	tv.tv_usec =(timeout % 1000) * 1000000;
+
+	rv = mei_write_msg(my_handle_p, buf, my_size, &dropped);
+	if (rv < 0)
+		return -1;
+
 	return_length = rv;
 
+	if (dropped) {
+		fprintf(stderr, "write failed on timeout with status\n");
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
 	FD_ZERO(&set);
 	FD_SET(my_handle_p->fd, &set);
 	rv = select(my_handle_p->fd+1 ,&set, NULL, NULL, &tv);
@@ -218,10 +361,13 @@ int mei_sndmsg(MEI_HANDLE *my_handle_p, uint8_t *buf, ssize_t my_size)
 	}
 	else if (rv == 0) {
 		fprintf(stderr, "write failed on timeout with status\n");
+		errno = ETIMEDOUT;
 		return -1;
 	}
 	else { //rv<0
+		error = errno;
 		fprintf(stderr, "write failed on select with status %d\n", rv);
+		errno = error;
 		return -1;
 	}
 
@@ -229,14 +375,15 @@ int mei_sndmsg(MEI_HANDLE *my_handle_p, uint8_t *buf, ssize_t my_size)
 	return rv;
 }
 
-/**
- * Allocat a DMA buffer
- * The returns a pointer to a MEI_MM_DMA structure.
- * The caller is responsible for holding onto that
- * structure and then having it de-allocated using
- * the mei_clear_dma api call.
- */
-MEI_MM_DMA *mei_alloc_dma(ssize_t my_size)
+int mei_sndmsg_nowait(MEI_HANDLE *my_handle_p, uint8_t *buf, ssize_t my_size)
+{
+	int dropped;
+
+	/* A dropped response never becomes readable, the waiter times out */
+	return mei_write_msg(my_handle_p, buf, my_size, &dropped);
+}
+
+static MEI_MM_DMA *mei_dma_map(ssize_t my_size)
 {
 
 	int result = 0;
@@ -249,6 +396,8 @@ MEI_MM_DMA *mei_alloc_dma(ssize_t my_size)
 	}
 
 	my_dma->data.size = (__u64)my_size;
+	my_dma->map_size = (__u64)my_size;
+	my_dma->acct = -1;
 
 	my_dma->fd = open("/dev/meimm", O_RDWR);
 	if (my_dma->fd <= 0) {
@@ -262,11 +411,13 @@ MEI_MM_DMA *mei_alloc_dma(ssize_t my_size)
 	/* call ioctl to allocate */
 	result = ioctl(my_dma->fd, IOCTL_MEI_MM_ALLOC, &my_dma->data);
 	if (result != 0) {
+		result = errno;
 		printf("ioctl for memory alloc for snd dma failed\n");
-		printf("errno is %x\n", errno);
+		printf("errno is %x\n", result);
 		close(my_dma->fd);
 		my_dma->fd = 0;
 		free(my_dma);
+		errno = result;
 		return NULL;
 	}
 
@@ -274,36 +425,319 @@ MEI_MM_DMA *mei_alloc_dma(ssize_t my_size)
 	my_dma->dmabuffer = mmap(NULL, my_size, PROT_READ | PROT_WRITE,
 		MAP_SHARED, my_dma->fd, 0);
 
-	if (my_dma->dmabuffer == NULL) {
+	if (my_dma->dmabuffer == MAP_FAILED) {
+		result = errno;
 		printf("mmap for dma buffer failed\n");
-		printf("errno is %x\n", errno);
+		printf("errno is %x\n", result);
+		ioctl(my_dma->fd, IOCTL_MEI_MM_FREE, &my_dma->data);
 		close(my_dma->fd);
+		free(my_dma);
+		errno = result;
 		return NULL;
 	}
 
 	return my_dma;
 }
 
-void mei_clear_dma(MEI_MM_DMA *my_dma)
+static void mei_dma_unmap(MEI_MM_DMA *my_dma)
 {
 	int result = 0;
-	if (my_dma == NULL) {
-		printf("null my_dma for clear; doing nothing\n");
-		return;
-	}
 
+	/* The driver frees what it allocated, not the size handed out */
+	my_dma->data.size = my_dma->map_size;
+	munmap(my_dma->dmabuffer, (size_t)my_dma->data.size);
+
+	/*
+	 * The mapping and descriptor go away regardless, so the handle
+	 * is released even when the driver refuses the free
+	 */
 	result = ioctl(my_dma->fd, IOCTL_MEI_MM_FREE, &my_dma->data);
 	if (result != 0) {
 		printf("ioctl for memory free for snd dma failed\n");
 		printf("errno is %x\n", errno);
-		close(my_dma->fd);
-		my_dma->fd = 0;
-		return;
 	}
 
 	close(my_dma->fd);
 	free(my_dma);
-	return;
+}
+
+/* Size class for my_size, MEI_DMA_NUM_CLASSES if it is not cached */
+static unsigned int mei_dma_class(size_t my_size)
+{
+	unsigned int dma_class = 0;
+
+	while (dma_class < MEI_DMA_NUM_CLASSES &&
+	       ((size_t)1 << (dma_class + MEI_DMA_MIN_SHIFT)) < my_size)
+		dma_class++;
+	return dma_class;
+}
+
+/* Unmaps cached buffers until at most limit bytes are retained */
+static void mei_dma_cache_shrink(size_t limit)
+{
+	MEI_MM_DMA *victims[MEI_DMA_NUM_CLASSES * MEI_DMA_PER_CLASS];
+	unsigned int num = 0;
+	int a;
+
+	/* Largest classes go first, they free the most for one munmap */
+	pthread_mutex_lock(&mei_dma_lock);
+	for (a = MEI_DMA_NUM_CLASSES - 1; a >= 0; a--) {
+		while (mei_dma_cache_bytes > limit && mei_dma_count[a]) {
+			victims[num++] = mei_dma_cached[a][--mei_dma_count[a]];
+			mei_dma_cache_bytes -= (size_t)1 << (a + MEI_DMA_MIN_SHIFT);
+		}
+	}
+	pthread_mutex_unlock(&mei_dma_lock);
+
+	while (num)
+		mei_dma_unmap(victims[--num]);
+}
+
+/*
+ * Called with mei_dma_acct_lock held. The last slot is kept for an "other"
+ * bucket that takes every owner past MEI_DMA_MAX_OWNERS - 1.
+ */
+static struct mei_dma_usage *mei_dma_acct_find(const char *owner)
+{
+	unsigned int a;
+
+	if (owner == NULL)
+		owner = MEI_DMA_OWNER_DEFAULT;
+	for (a = 0; a < mei_dma_acct_num; a++) {
+		if (!strncmp(mei_dma_acct[a].owner, owner, MEI_DMA_OWNER_LEN - 1))
+			return &mei_dma_acct[a];
+	}
+	if (mei_dma_acct_num < MEI_DMA_MAX_OWNERS - 1) {
+		strncpy(mei_dma_acct[a].owner, owner, MEI_DMA_OWNER_LEN - 1);
+		mei_dma_acct_num++;
+		return &mei_dma_acct[a];
+	}
+
+	if (mei_dma_acct_num < MEI_DMA_MAX_OWNERS) {
+		strncpy(mei_dma_acct[a].owner, MEI_DMA_OWNER_OTHER,
+			MEI_DMA_OWNER_LEN - 1);
+		mei_dma_acct_num++;
+		fprintf(stderr, "more than %d DMA owners, charging %s and later "
+			"ones to \"%s\"\n", MEI_DMA_MAX_OWNERS - 1, owner,
+			MEI_DMA_OWNER_OTHER);
+	}
+	return &mei_dma_acct[MEI_DMA_MAX_OWNERS - 1];
+}
+
+static void mei_dma_acct_charge(struct mei_dma_usage *usage, __u64 size)
+{
+	usage->bytes += size;
+	usage->buffers++;
+	usage->allocs++;
+	if (usage->bytes > usage->peak_bytes)
+		usage->peak_bytes = usage->bytes;
+	if (usage->buffers > usage->peak_buffers)
+		usage->peak_buffers = usage->buffers;
+}
+
+static void mei_dma_acct_fail(struct mei_dma_usage *usage, __u64 size)
+{
+	usage->failures++;
+	if (size > usage->largest_failed)
+		usage->largest_failed = size;
+}
+
+static void mei_dma_acct_alloc(MEI_MM_DMA *my_dma, const char *owner,
+			       ssize_t my_size)
+{
+	struct mei_dma_usage *usage;
+
+	pthread_mutex_lock(&mei_dma_acct_lock);
+	usage = mei_dma_acct_find(owner);
+	if (my_dma == NULL) {
+		mei_dma_acct_fail(usage, (__u64)my_size);
+		mei_dma_acct_fail(&mei_dma_acct_total, (__u64)my_size);
+	} else {
+		mei_dma_acct_charge(usage, my_dma->data.size);
+		mei_dma_acct_charge(&mei_dma_acct_total, my_dma->data.size);
+		my_dma->acct = usage - mei_dma_acct;
+	}
+	pthread_mutex_unlock(&mei_dma_acct_lock);
+}
+
+static void mei_dma_acct_free(MEI_MM_DMA *my_dma)
+{
+	if (my_dma->acct < 0)
+		return;
+
+	pthread_mutex_lock(&mei_dma_acct_lock);
+	mei_dma_acct[my_dma->acct].bytes -= my_dma->data.size;
+	mei_dma_acct[my_dma->acct].buffers--;
+	mei_dma_acct_total.bytes -= my_dma->data.size;
+	mei_dma_acct_total.buffers--;
+	pthread_mutex_unlock(&mei_dma_acct_lock);
+	my_dma->acct = -1;
+}
+
+static MEI_MM_DMA *mei_dma_get(ssize_t my_size)
+{
+	MEI_MM_DMA *my_dma = NULL;
+	ssize_t map_size = my_size;
+	size_t class_size;
+	unsigned int dma_class;
+
+	if (my_size <= 0) {
+		printf("bad size %d for dma buffer\n", (int)my_size);
+		return NULL;
+	}
+
+	dma_class = mei_dma_class((size_t)my_size);
+	if (dma_class < MEI_DMA_NUM_CLASSES) {
+		class_size = (size_t)1 << (dma_class + MEI_DMA_MIN_SHIFT);
+		pthread_mutex_lock(&mei_dma_lock);
+		if (mei_dma_count[dma_class]) {
+			my_dma = mei_dma_cached[dma_class][--mei_dma_count[dma_class]];
+			mei_dma_cache_bytes -= (size_t)my_dma->map_size;
+		} else if (class_size <= mei_dma_cache_limit) {
+			/* Only a buffer the cache can take back is rounded up */
+			map_size = (ssize_t)class_size;
+		}
+		pthread_mutex_unlock(&mei_dma_lock);
+	}
+
+	if (my_dma == NULL) {
+		my_dma = mei_dma_map(map_size);
+		if (my_dma == NULL && errno == ENOMEM) {
+			/* Cached buffers hold driver memory, give it back and retry */
+			mei_dma_cache_shrink(0);
+			my_dma = mei_dma_map(map_size);
+		}
+	}
+
+	if (my_dma != NULL)
+		my_dma->data.size = (__u64)my_size;
+	return my_dma;
+}
+
+MEI_MM_DMA *mei_alloc_dma_owner(ssize_t my_size, const char *owner)
+{
+	MEI_MM_DMA *my_dma = mei_dma_get(my_size);
+
+	mei_dma_acct_alloc(my_dma, owner, my_size);
+	return my_dma;
+}
+
+/**
+ * Allocat a DMA buffer
+ * The returns a pointer to a MEI_MM_DMA structure.
+ * The caller is responsible for holding onto that
+ * structure and then having it de-allocated using
+ * the mei_clear_dma api call.
+ */
+MEI_MM_DMA *mei_alloc_dma(ssize_t my_size)
+{
+	return mei_alloc_dma_owner(my_size, NULL);
+}
+
+void mei_clear_dma(MEI_MM_DMA *my_dma)
+{
+	unsigned int dma_class;
+
+	if (my_dma == NULL) {
+		printf("null my_dma for clear; doing nothing\n");
+		return;
+	}
+
+	mei_dma_acct_free(my_dma);
+
+	dma_class = mei_dma_class((size_t)my_dma->map_size);
+	if (dma_class < MEI_DMA_NUM_CLASSES &&
+	    my_dma->map_size == ((__u64)1 << (dma_class + MEI_DMA_MIN_SHIFT))) {
+		pthread_mutex_lock(&mei_dma_lock);
+		if (mei_dma_count[dma_class] < MEI_DMA_PER_CLASS &&
+		    mei_dma_cache_bytes + my_dma->map_size <= mei_dma_cache_limit) {
+			mei_dma_cached[dma_class][mei_dma_count[dma_class]++] = my_dma;
+			mei_dma_cache_bytes += (size_t)my_dma->map_size;
+			my_dma = NULL;
+		}
+		pthread_mutex_unlock(&mei_dma_lock);
+		if (my_dma == NULL)
+			return;
+	}
+
+	mei_dma_unmap(my_dma);
+}
+
+/**
+ * Sets how many bytes of freed DMA buffers may stay mapped
+ * for reuse; anything cached above the new limit is released
+ */
+void mei_dma_cache_set_limit(size_t bytes)
+{
+	pthread_mutex_lock(&mei_dma_lock);
+	mei_dma_cache_limit = bytes;
+	pthread_mutex_unlock(&mei_dma_lock);
+
+	mei_dma_cache_shrink(bytes);
+}
+
+/**
+ * Releases every cached DMA buffer back to the driver
+ */
+void mei_dma_cache_trim(void)
+{
+	mei_dma_cache_shrink(0);
+}
+
+int mei_dma_get_usage(const char *owner, struct mei_dma_usage *usage)
+{
+	unsigned int a;
+	int ret = -1;
+
+	if (usage == NULL)
+		return -1;
+
+	pthread_mutex_lock(&mei_dma_acct_lock);
+	if (owner == NULL) {
+		*usage = mei_dma_acct_total;
+		ret = 0;
+	}
+	for (a = 0; owner != NULL && a < mei_dma_acct_num; a++) {
+		if (!strncmp(mei_dma_acct[a].owner, owner, MEI_DMA_OWNER_LEN - 1)) {
+			*usage = mei_dma_acct[a];
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mei_dma_acct_lock);
+
+	if (ret == 0 && owner == NULL) {
+		pthread_mutex_lock(&mei_dma_lock);
+		usage->cached_bytes = mei_dma_cache_bytes;
+		pthread_mutex_unlock(&mei_dma_lock);
+	}
+	return ret;
+}
+
+unsigned int mei_dma_get_usage_all(struct mei_dma_usage *usage,
+				   unsigned int max)
+{
+	unsigned int a;
+
+	pthread_mutex_lock(&mei_dma_acct_lock);
+	for (a = 0; a < mei_dma_acct_num && a < max; a++)
+		usage[a] = mei_dma_acct[a];
+	pthread_mutex_unlock(&mei_dma_acct_lock);
+	return a;
+}
+
+void mei_dma_reset_peaks(void)
+{
+	unsigned int a;
+
+	pthread_mutex_lock(&mei_dma_acct_lock);
+	for (a = 0; a < mei_dma_acct_num; a++) {
+		mei_dma_acct[a].peak_bytes = mei_dma_acct[a].bytes;
+		mei_dma_acct[a].peak_buffers = mei_dma_acct[a].buffers;
+	}
+	mei_dma_acct_total.peak_bytes = mei_dma_acct_total.bytes;
+	mei_dma_acct_total.peak_buffers = mei_dma_acct_total.buffers;
+	pthread_mutex_unlock(&mei_dma_acct_lock);
 }
 
 int mei_rcvmsg(MEI_HANDLE *my_handle_p, uint8_t *buf, ssize_t my_size)
@@ -326,6 +760,15 @@ int mei_rcvmsg(MEI_HANDLE *my_handle_p, uint8_t *buf, ssize_t my_size)
 		return -1;
 	}
 
+#ifdef TXEI_FAULT_INJECTION
+	error = txei_fault_io_error(my_handle_p);
+	if (error) {
+		fprintf(stderr, "fault: failing read with errno %d\n", error);
+		errno = error;
+		return -1;
+	}
+#endif
+
 
 //	fprintf(stdout, "call read length = %d\n", (int)my_size);
 
@@ -333,12 +776,198 @@ int mei_rcvmsg(MEI_HANDLE *my_handle_p, uint8_t *buf, ssize_t my_size)
 	if (rv < 0) {
 		error = errno;
 		fprintf(stderr,"read failed with status %d %d\n", rv, error);
+		errno = error;
 		return -1;
 	}
 
 	else {
+#ifdef TXEI_FAULT_INJECTION
+		rv = txei_fault_short_read(my_handle_p, buf, rv);
+#endif
 		fprintf(stderr, "read successful and read %d\n", rv);
 	}
 
 	return rv;
 }
+
+/**
+ * Sends a message and reads the response, checking that
+ * both transfers were the full requested size. Same
+ * contract as the keymaster driver copy of this call
+ */
+int mei_snd_rcv(MEI_HANDLE *my_handle_p, void *snd_buf, ssize_t snd_size,
+	void *rcv_buf, ssize_t rcv_size)
+{
+	int rv;
+
+	rv = mei_sndmsg(my_handle_p, snd_buf, snd_size);
+	if (rv <= 0)
+		return rv;
+	if (rv != snd_size) {
+		printf("mei_sndmsg succeeded, but wrong size was written\n");
+		return -1;
+	}
+
+	rv = mei_rcvmsg(my_handle_p, rcv_buf, rcv_size);
+	if (rv <= 0 || rv != rcv_size)
+		return rv;
+
+	return 0;
+}
+
+/**
+ * Sets the coalescing window used by mei_request, in microseconds.
+ * A window of 0 (the default) turns coalescing off
+ */
+void mei_set_coalesce_window(unsigned int usec)
+{
+	pthread_mutex_lock(&mei_coalesce_lock);
+	mei_coalesce_usec = usec;
+	pthread_mutex_unlock(&mei_coalesce_lock);
+}
+
+unsigned int mei_get_coalesce_window(void)
+{
+	unsigned int usec;
+
+	pthread_mutex_lock(&mei_coalesce_lock);
+	usec = mei_coalesce_usec;
+	pthread_mutex_unlock(&mei_coalesce_lock);
+	return usec;
+}
+
+/* Called with mei_coalesce_lock held */
+static struct mei_coalesce_slot *mei_coalesce_find_slot(const GUID *guid)
+{
+	struct mei_coalesce_slot *free_slot = NULL;
+	int a;
+
+	for (a = 0; a < MEI_COALESCE_MAX_GUIDS; a++) {
+		if (!mei_coalesce_slots[a].in_use) {
+			if (free_slot == NULL)
+				free_slot = &mei_coalesce_slots[a];
+			continue;
+		}
+		if (memcmp(&mei_coalesce_slots[a].guid, guid, sizeof(GUID)) == 0)
+			return &mei_coalesce_slots[a];
+	}
+
+	if (free_slot != NULL) {
+		memset(free_slot, 0, sizeof(*free_slot));
+		memcpy(&free_slot->guid, guid, sizeof(GUID));
+		free_slot->in_use = 1;
+	}
+	return free_slot;
+}
+
+/* Runs a chain of requests back to back over one connection */
+static void mei_coalesce_dispatch(const GUID *guid, struct mei_coalesce_req *batch)
+{
+	MEI_HANDLE *my_handle_p;
+	struct mei_coalesce_req *req;
+	int rv;
+
+	my_handle_p = mei_connect(guid);
+	for (req = batch; req != NULL; req = req->next) {
+		if (my_handle_p == NULL) {
+			req->result = -1;
+			continue;
+		}
+
+		rv = mei_sndmsg(my_handle_p, req->snd_buf, req->snd_size);
+		if (rv != req->snd_size) {
+			printf("coalesced send failed, sent %d of %d\n",
+				rv, (int)req->snd_size);
+			req->result = -1;
+			continue;
+		}
+		req->result = mei_rcvmsg(my_handle_p, req->rcv_buf, req->rcv_size);
+	}
+
+	if (my_handle_p != NULL)
+		mei_disconnect(my_handle_p);
+}
+
+/**
+ * Connects to the client with guid, sends a message, reads the
+ * response and disconnects again. When a coalescing window is set,
+ * requests for the same guid that arrive within the window share a
+ * single connection.
+ * Return is the number of bytes read, or -1 on failure
+ */
+int mei_request(const GUID *guid, uint8_t *snd_buf, ssize_t snd_size,
+	uint8_t *rcv_buf, ssize_t rcv_size)
+{
+	struct mei_coalesce_req req;
+	struct mei_coalesce_req *batch;
+	struct mei_coalesce_req *next;
+	struct mei_coalesce_slot *slot = NULL;
+	struct timespec window;
+	unsigned int usec;
+
+	if ((guid == NULL) || (snd_buf == NULL) || (rcv_buf == NULL)) {
+		printf("null parameter for mei_request\n");
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.snd_buf = snd_buf;
+	req.snd_size = snd_size;
+	req.rcv_buf = rcv_buf;
+	req.rcv_size = rcv_size;
+
+	pthread_mutex_lock(&mei_coalesce_lock);
+	usec = mei_coalesce_usec;
+	if (usec != 0)
+		slot = mei_coalesce_find_slot(guid);
+
+	if (slot == NULL) {
+		/* Coalescing is off or every slot is busy */
+		pthread_mutex_unlock(&mei_coalesce_lock);
+		mei_coalesce_dispatch(guid, &req);
+		return req.result;
+	}
+
+	if (slot->tail != NULL)
+		slot->tail->next = &req;
+	else
+		slot->head = &req;
+	slot->tail = &req;
+
+	if (slot->collecting) {
+		/* A leader is already gathering this batch */
+		while (!req.done)
+			pthread_cond_wait(&mei_coalesce_cond, &mei_coalesce_lock);
+		pthread_mutex_unlock(&mei_coalesce_lock);
+		return req.result;
+	}
+
+	slot->collecting = 1;
+	pthread_mutex_unlock(&mei_coalesce_lock);
+
+	window.tv_sec = usec / 1000000;
+	window.tv_nsec = (long)(usec % 1000000) * 1000;
+	nanosleep(&window, NULL);
+
+	/* Close the batch; later arrivals start a new one */
+	pthread_mutex_lock(&mei_coalesce_lock);
+	batch = slot->head;
+	slot->head = NULL;
+	slot->tail = NULL;
+	slot->collecting = 0;
+	slot->in_use = 0;
+	pthread_mutex_unlock(&mei_coalesce_lock);
+
+	mei_coalesce_dispatch(guid, batch);
+
+	pthread_mutex_lock(&mei_coalesce_lock);
+	while (batch != NULL) {
+		next = batch->next;
+		batch->done = 1;
+		batch = next;
+	}
+	pthread_cond_broadcast(&mei_coalesce_cond);
+	pthread_mutex_unlock(&mei_coalesce_lock);
+
+	return req.result;
+}
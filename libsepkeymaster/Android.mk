@@ -14,13 +14,16 @@ KM_APP_DIR := $(LOCAL_PATH)
 LOCAL_SRC_FILES+= \
     sep_keymaster.c \
     txei_drv.c \
-    txei_log.c
+    txei_log.c \
+    ../Lib/common/src/tee_byteorder.c \
+    ../Lib/common/src/mei_buf.c
 
 LOCAL_WHOLE_STATIC_LIBRARIES += liblog
 LOCAL_SHARED_LIBRARIES := libcutils libc
 
 LOCAL_C_INCLUDES := \
-    $(KM_APP_DIR)/inc
+    $(KM_APP_DIR)/inc \
+    $(KM_APP_DIR)/../Lib/common/inc
 
 include $(BUILD_SHARED_LIBRARY)
 
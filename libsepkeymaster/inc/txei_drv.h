@@ -3,6 +3,7 @@
 
 #include <inttypes.h>
 #include <sys/types.h>
+#include <linux/types.h>
 
 #define MEI_DEVICE_FILE "/dev/mei"
 #define MEI_VERSION_SYSFS_FILE "/sys/module/mei/version"
@@ -54,6 +55,8 @@ typedef struct mei_mm_dma {
 	MEI_MM_DATA data;
 	void *dmabuffer;
 	int fd;
+	int acct;
+	__u64 map_size;
 } MEI_MM_DMA;
 
 typedef struct _MEI_VERSION {
@@ -303,10 +306,91 @@ int mei_snd_rcv(MEI_HANDLE * my_handle_p, void *snd_buf, ssize_t snd_size,
 MEI_MM_DMA *mei_alloc_dma(ssize_t my_size);
 
 /**
- * Frees a previously allocated DMA buffer
+ * Allocate a DMA buffer charged to an owner tag in the usage accounting
+ * @param[in] my_size 		Size of buffer to allocate
+ * @param[in] owner			Owner tag, NULL for "default". Only the first
+ * 							MEI_DMA_OWNER_LEN - 1 characters are compared
+ * @return
+ * 		Same as mei_alloc_dma
+ */
+MEI_MM_DMA *mei_alloc_dma_owner(ssize_t my_size, const char *owner);
+
+/**
+ * Frees a previously allocated DMA buffer. Buffers up to 1MB are kept
+ * mapped in a process wide cache for the next mei_alloc_dma of the same
+ * size class
  * @param[in] my_dma		Pointer to MEI_MM_DMA structure to deallocate
  */
 void mei_clear_dma(MEI_MM_DMA * my_dma);
 
+/**
+ * Sets how many bytes of freed DMA buffers the cache may keep mapped
+ * @param[in] bytes			Retained byte limit, 1MB by default, 0 disables
+ * 							the cache. Buffers above it are released at once
+ */
+void mei_dma_cache_set_limit(size_t bytes);
+
+/**
+ * Releases every cached DMA buffer back to the driver
+ */
+void mei_dma_cache_trim(void);
+
+#define MEI_DMA_OWNER_LEN 16
+
+/* DMA memory charged to one owner tag, or "total" for the process */
+struct mei_dma_usage {
+	char owner[MEI_DMA_OWNER_LEN];
+	uint64_t bytes;
+	uint32_t buffers;
+	uint64_t peak_bytes;
+	uint32_t peak_buffers;
+	uint32_t allocs;
+	uint32_t failures;
+	uint64_t largest_failed;
+	uint64_t cached_bytes;	/* totals only */
+};
+
+/**
+ * Reads the DMA usage of one owner
+ * @param[in] owner			Owner tag, NULL for the process totals
+ * @param[out] usage		Current usage, high-water marks and failures
+ * @return
+ * 		0 on success, -1 if the owner never allocated
+ */
+int mei_dma_get_usage(const char *owner, struct mei_dma_usage *usage);
+
+/**
+ * Reads the DMA usage of every owner, at most 15 are tracked and
+ * later ones are charged together to "other"
+ * @param[out] usage		Array of max entries
+ * @param[in] max			Size of the array
+ * @return
+ * 		Number of entries filled in
+ */
+unsigned int mei_dma_get_usage_all(struct mei_dma_usage *usage,
+		unsigned int max);
+
+/**
+ * Restarts the high-water marks from the current usage
+ */
+void mei_dma_reset_peaks(void);
+
+/**
+ * Gets a message buffer from a per thread cache of size classes, so
+ * repeated firmware calls do not go to the heap
+ * @param[in] size			Minimum size of the buffer
+ * @return
+ * 		Pointer to an uncleared buffer, or NULL if memory is exhausted.
+ * 		Release it with mei_buf_put.
+ */
+void *mei_buf_get(size_t size);
+
+/**
+ * Wipes a buffer obtained with mei_buf_get and returns it to the calling
+ * thread's cache
+ * @param[in] buf			Buffer to release; NULL is ignored
+ */
+void mei_buf_put(void *buf);
+
 
 #endif				/* __TXEI_DRV_H__ */
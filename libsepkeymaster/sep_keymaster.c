@@ -19,27 +19,24 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
 
 #define LOG_TAG "SEP_KEYMASTER"
 #include "txei_drv.h"
 #include "txei_log.h"
 #include "sep_keymaster.h"
+#include "tee_byteorder.h"
 
 //Keymaster response id is command id with msb changed to 1
 #define KEYMASTER_RSP_FLAG  0x80000000
 
 static uint32_t caps_obtained = 0;
+static pthread_mutex_t caps_lock = PTHREAD_MUTEX_INITIALIZER;
 static uint32_t key_opaque_size = 0;
 
 //In-place byte swap
 void swap_byte_order(uint8_t * buf, uint32_t buf_len) {
-    uint32_t i = 0;
-
-    for (i = 0; i < (buf_len / 2); i++) {
-        buf[i] ^= buf[(buf_len - 1) - i];
-        buf[(buf_len - 1) - i] ^= buf[i];
-        buf[i] ^= buf[(buf_len - 1) - i];
-    }
+    tee_bswap_buf_inplace(buf, buf_len);
 }
 
 void print_buf(char *prompt, uint8_t buf[], uint32_t size) {
@@ -525,7 +522,7 @@ sep_keymaster_return_t generate_cmd_buf(
 
         //Allocate request buffer
         ANDROID_HECI_KEYMASTER_CMD_RSA_GEN_KEY_REQUEST *request_cmd =
-                (ANDROID_HECI_KEYMASTER_CMD_RSA_GEN_KEY_REQUEST *) malloc(
+                (ANDROID_HECI_KEYMASTER_CMD_RSA_GEN_KEY_REQUEST *) mei_buf_get(
                         *fw_request_len);
         if (!request_cmd) {
             result = SEP_KEYMASTER_OUT_OF_MEMORY;
@@ -551,7 +548,7 @@ sep_keymaster_return_t generate_cmd_buf(
 
         //Allocate request buffer
         ANDROID_HECI_KEYMASTER_CMD_RSA_IMPORT_KEY_REQUEST *request_cmd =
-                (ANDROID_HECI_KEYMASTER_CMD_RSA_IMPORT_KEY_REQUEST *) malloc(
+                (ANDROID_HECI_KEYMASTER_CMD_RSA_IMPORT_KEY_REQUEST *) mei_buf_get(
                         *fw_request_len);
         if (!request_cmd) {
             result = SEP_KEYMASTER_OUT_OF_MEMORY;
@@ -582,7 +579,7 @@ sep_keymaster_return_t generate_cmd_buf(
 
         //Allocate request buffer
         ANDROID_HECI_KEYMASTER_CMD_RSA_GET_PUBLIC_KEY_REQUEST *request_cmd =
-                (ANDROID_HECI_KEYMASTER_CMD_RSA_GET_PUBLIC_KEY_REQUEST *) malloc(
+                (ANDROID_HECI_KEYMASTER_CMD_RSA_GET_PUBLIC_KEY_REQUEST *) mei_buf_get(
                         *fw_request_len);
         if (!request_cmd) {
             result = SEP_KEYMASTER_OUT_OF_MEMORY;
@@ -611,7 +608,7 @@ sep_keymaster_return_t generate_cmd_buf(
                         + key_opaque_size;
 
         ANDROID_HECI_KEYMASTER_CMD_RSA_SIGN_DATA_NOPAD_REQUEST *request_cmd =
-                (ANDROID_HECI_KEYMASTER_CMD_RSA_SIGN_DATA_NOPAD_REQUEST *) malloc(
+                (ANDROID_HECI_KEYMASTER_CMD_RSA_SIGN_DATA_NOPAD_REQUEST *) mei_buf_get(
                         *fw_request_len);
         if (!request_cmd) {
             result = SEP_KEYMASTER_OUT_OF_MEMORY;
@@ -640,7 +637,7 @@ sep_keymaster_return_t generate_cmd_buf(
                         + key_opaque_size;
 
         ANDROID_HECI_KEYMASTER_CMD_RSA_VERIFY_DATA_NOPAD_REQUEST *request_cmd =
-                (ANDROID_HECI_KEYMASTER_CMD_RSA_VERIFY_DATA_NOPAD_REQUEST *) malloc(
+                (ANDROID_HECI_KEYMASTER_CMD_RSA_VERIFY_DATA_NOPAD_REQUEST *) mei_buf_get(
                         *fw_request_len);
         if (!request_cmd) {
             result = SEP_KEYMASTER_OUT_OF_MEMORY;
@@ -680,7 +677,7 @@ sep_keymaster_return_t get_caps() {
     ANDROID_HECI_KEYMASTER_CMD_GET_CAPS_RESPONSE *resp = NULL;
     uint32_t i = 0;
 
-    resp = malloc(ANDROID_HECI_AGENT_MAX_MTU);
+    resp = mei_buf_get(ANDROID_HECI_AGENT_MAX_MTU);
     if (!resp) {
         result = SEP_KEYMASTER_OUT_OF_MEMORY;
         goto exit;
@@ -714,7 +711,7 @@ sep_keymaster_return_t get_caps() {
     }
 
     exit: if (resp) {
-        free(resp);
+        mei_buf_put(resp);
         resp = NULL;
     }
     return result;
@@ -745,7 +742,8 @@ sep_keymaster_return_t send_req_to_fw(const uint8_t * req,
     result = SEP_KEYMASTER_SUCCESS;
 
     exit: if (mei_handle) {
-        mei_disconnect(mei_handle); //TODO: What happens if disconnect fails? Memory leak?
+        //mei_disconnect cannot fail: it always closes the fd and frees the handle
+        mei_disconnect(mei_handle);
         mei_handle = NULL;
     }
     return result;
@@ -789,14 +787,20 @@ sep_keymaster_return_t sep_keymaster_send_cmd(const uint8_t * cmd_buffer,
         result = SEP_KEYMASTER_RSP_BUFFER_TOO_SMALL;
         goto exit;
     }
-    //If capabilities have not been obtained before, do so now
+    //If capabilities have not been obtained before, do so now. Threads racing
+    //on first use wait here and reuse the result of the first caller
+    pthread_mutex_lock(&caps_lock);
     if (!caps_obtained) {
         result = get_caps();
-        if (result != SEP_KEYMASTER_SUCCESS) {
-            LOGERR("Obtaining capabilites failed. Bailing");
-            goto exit;
-        }
-        caps_obtained = 1;
+        if (result == SEP_KEYMASTER_SUCCESS)
+            caps_obtained = 1;
+    } else {
+        result = SEP_KEYMASTER_SUCCESS;
+    }
+    pthread_mutex_unlock(&caps_lock);
+    if (result != SEP_KEYMASTER_SUCCESS) {
+        LOGERR("Obtaining capabilites failed. Bailing");
+        goto exit;
     }
 #define LOGGING
 #ifdef LOGGING
@@ -837,7 +841,7 @@ sep_keymaster_return_t sep_keymaster_send_cmd(const uint8_t * cmd_buffer,
     //So the total data we can pass back is approx. (*rsp_length - sizeof(header)) bytes long
     uint32_t fw_response_length = sizeof(ANDROID_HECI_AGENT_RESP_HEADER)
             + *rsp_length - sizeof(intel_keymaster_firmware_rsp_t); //TODO: Is this check sufficient?
-    response = (uint8_t *) malloc(fw_response_length);
+    response = (uint8_t *) mei_buf_get(fw_response_length);
     if (!response) {
         result = SEP_KEYMASTER_OUT_OF_MEMORY;
         goto exit;
@@ -881,12 +885,12 @@ sep_keymaster_return_t sep_keymaster_send_cmd(const uint8_t * cmd_buffer,
     result = SEP_KEYMASTER_SUCCESS;
 
     exit: if (request) {
-        free(request);
+        mei_buf_put(request);
         request = NULL;
     }
 
     if (response) {
-        free(response);
+        mei_buf_put(response);
         response = NULL;
     }
 
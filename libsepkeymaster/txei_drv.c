@@ -5,6 +5,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
@@ -31,6 +32,37 @@ typedef struct mei_connect_client_data_t {
     } d;
 } mei_connect_client_data;
 
+/*
+ * DMA buffer cache, see mei_clear_dma(). Same scheme as libtxei: freed
+ * buffers of power of two classes from 4KB to 1MB stay mapped, up to
+ * mei_dma_cache_limit bytes in total. Buffers are only rounded up to
+ * their class while the limit leaves room for them.
+ */
+#define MEI_DMA_MIN_SHIFT       12
+#define MEI_DMA_NUM_CLASSES     9
+#define MEI_DMA_PER_CLASS       8
+#define MEI_DMA_DEFAULT_LIMIT   (1024 * 1024)
+
+static pthread_mutex_t mei_dma_lock = PTHREAD_MUTEX_INITIALIZER;
+static MEI_MM_DMA *mei_dma_cached[MEI_DMA_NUM_CLASSES][MEI_DMA_PER_CLASS];
+static unsigned int mei_dma_count[MEI_DMA_NUM_CLASSES];
+static size_t mei_dma_cache_bytes = 0;
+static size_t mei_dma_cache_limit = MEI_DMA_DEFAULT_LIMIT;
+
+/*
+ * DMA usage accounting: buffers are charged to their owner tag and to
+ * the process totals from allocation until mei_clear_dma(). Cached
+ * buffers are charged to nobody and show up as cached_bytes in the totals.
+ */
+#define MEI_DMA_MAX_OWNERS      16
+#define MEI_DMA_OWNER_DEFAULT   "default"
+#define MEI_DMA_OWNER_OTHER     "other"
+
+static pthread_mutex_t mei_dma_acct_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mei_dma_usage mei_dma_acct[MEI_DMA_MAX_OWNERS];
+static struct mei_dma_usage mei_dma_acct_total = { "total" };
+static unsigned int mei_dma_acct_num = 0;
+
 /* Note that this may not be possible with txei */
 int mei_get_version_from_sysfs(MEI_HANDLE *my_handle_p) {
     FILE *verfile = NULL;
@@ -254,7 +286,7 @@ int mei_snd_rcv(MEI_HANDLE *my_handle_p, void *snd_buf, ssize_t snd_size, void *
 }
 
 
-MEI_MM_DMA *mei_alloc_dma(ssize_t my_size) {
+static MEI_MM_DMA *mei_dma_map(ssize_t my_size) {
 
     int result = 0;
     MEI_MM_DMA *my_dma = NULL;
@@ -266,6 +298,8 @@ MEI_MM_DMA *mei_alloc_dma(ssize_t my_size) {
     }
 
     my_dma->data.size = (__u64)my_size;
+    my_dma->map_size = (__u64)my_size;
+    my_dma->acct = -1;
 
     my_dma->fd = open("/dev/meimm", O_RDWR);
     if(my_dma->fd <= 0) {
@@ -279,11 +313,13 @@ MEI_MM_DMA *mei_alloc_dma(ssize_t my_size) {
     /* call ioctl to allocate */
     result = ioctl(my_dma->fd, IOCTL_MEI_MM_ALLOC, &my_dma->data);
     if(result != 0) {
+        result = errno;
         LOGERR("ioctl for memory alloc for snd dma failed\n");
-        LOGERR("errno is %x\n", errno);
+        LOGERR("errno is %x\n", result);
         close(my_dma->fd);
         my_dma->fd = 0;
         free(my_dma);
+        errno = result;
         return NULL;
     }
 
@@ -291,10 +327,14 @@ MEI_MM_DMA *mei_alloc_dma(ssize_t my_size) {
     my_dma->dmabuffer = mmap(NULL, my_size, PROT_READ | PROT_WRITE,
                              MAP_SHARED, my_dma->fd, 0);
 
-    if(my_dma->dmabuffer == NULL) {
+    if(my_dma->dmabuffer == MAP_FAILED) {
+        result = errno;
         LOGERR("mmap for dma buffer failed\n");
-        LOGERR("errno is %x\n", errno);
+        LOGERR("errno is %x\n", result);
+        ioctl(my_dma->fd, IOCTL_MEI_MM_FREE, &my_dma->data);
         close(my_dma->fd);
+        free(my_dma);
+        errno = result;
         return NULL;
     }
 
@@ -302,23 +342,279 @@ MEI_MM_DMA *mei_alloc_dma(ssize_t my_size) {
 }
 
 
-void mei_clear_dma(MEI_MM_DMA *my_dma) {
+static void mei_dma_unmap(MEI_MM_DMA *my_dma) {
     int result = 0;
-    if(my_dma == NULL) {
-        LOGINFO("null my_dma for clear; doing nothing\n");
-        return;
-    }
 
+    /* The driver frees what it allocated, not the size handed out */
+    my_dma->data.size = my_dma->map_size;
+    munmap(my_dma->dmabuffer, (size_t)my_dma->data.size);
+
+    /*
+     * The mapping and descriptor go away regardless, so the handle
+     * is released even when the driver refuses the free
+     */
     result = ioctl(my_dma->fd, IOCTL_MEI_MM_FREE, &my_dma->data);
     if(result != 0) {
         LOGERR("ioctl for memory free for snd dma failed\n");
         LOGERR("errno is %x\n", errno);
-        close(my_dma->fd);
-        my_dma->fd = 0;
-        return;
     }
 
     close(my_dma->fd);
     free(my_dma);
-    return;
 }
+
+
+static unsigned int mei_dma_class(size_t my_size) {
+    unsigned int dma_class = 0;
+
+    while(dma_class < MEI_DMA_NUM_CLASSES &&
+          ((size_t)1 << (dma_class + MEI_DMA_MIN_SHIFT)) < my_size)
+        dma_class++;
+    return dma_class;
+}
+
+
+static void mei_dma_cache_shrink(size_t limit) {
+    MEI_MM_DMA *victims[MEI_DMA_NUM_CLASSES * MEI_DMA_PER_CLASS];
+    unsigned int num = 0;
+    int a;
+
+    pthread_mutex_lock(&mei_dma_lock);
+    for(a = MEI_DMA_NUM_CLASSES - 1; a >= 0; a--) {
+        while(mei_dma_cache_bytes > limit && mei_dma_count[a]) {
+            victims[num++] = mei_dma_cached[a][--mei_dma_count[a]];
+            mei_dma_cache_bytes -= (size_t)1 << (a + MEI_DMA_MIN_SHIFT);
+        }
+    }
+    pthread_mutex_unlock(&mei_dma_lock);
+
+    while(num)
+        mei_dma_unmap(victims[--num]);
+}
+
+
+/*
+ * Called with mei_dma_acct_lock held. The last slot is kept for an "other"
+ * bucket that takes every owner past MEI_DMA_MAX_OWNERS - 1.
+ */
+static struct mei_dma_usage *mei_dma_acct_find(const char *owner) {
+    unsigned int a;
+
+    if(owner == NULL)
+        owner = MEI_DMA_OWNER_DEFAULT;
+    for(a = 0; a < mei_dma_acct_num; a++) {
+        if(!strncmp(mei_dma_acct[a].owner, owner, MEI_DMA_OWNER_LEN - 1))
+            return &mei_dma_acct[a];
+    }
+    if(mei_dma_acct_num < MEI_DMA_MAX_OWNERS - 1) {
+        strncpy(mei_dma_acct[a].owner, owner, MEI_DMA_OWNER_LEN - 1);
+        mei_dma_acct_num++;
+        return &mei_dma_acct[a];
+    }
+
+    if(mei_dma_acct_num < MEI_DMA_MAX_OWNERS) {
+        strncpy(mei_dma_acct[a].owner, MEI_DMA_OWNER_OTHER,
+                MEI_DMA_OWNER_LEN - 1);
+        mei_dma_acct_num++;
+        LOGERR("more than %d DMA owners, charging %s and later ones to \"%s\"\n",
+               MEI_DMA_MAX_OWNERS - 1, owner, MEI_DMA_OWNER_OTHER);
+    }
+    return &mei_dma_acct[MEI_DMA_MAX_OWNERS - 1];
+}
+
+static void mei_dma_acct_charge(struct mei_dma_usage *usage, __u64 size) {
+    usage->bytes += size;
+    usage->buffers++;
+    usage->allocs++;
+    if(usage->bytes > usage->peak_bytes)
+        usage->peak_bytes = usage->bytes;
+    if(usage->buffers > usage->peak_buffers)
+        usage->peak_buffers = usage->buffers;
+}
+
+static void mei_dma_acct_fail(struct mei_dma_usage *usage, __u64 size) {
+    usage->failures++;
+    if(size > usage->largest_failed)
+        usage->largest_failed = size;
+}
+
+static void mei_dma_acct_alloc(MEI_MM_DMA *my_dma, const char *owner,
+                               ssize_t my_size) {
+    struct mei_dma_usage *usage;
+
+    pthread_mutex_lock(&mei_dma_acct_lock);
+    usage = mei_dma_acct_find(owner);
+    if(my_dma == NULL) {
+        mei_dma_acct_fail(usage, (__u64)my_size);
+        mei_dma_acct_fail(&mei_dma_acct_total, (__u64)my_size);
+    } else {
+        mei_dma_acct_charge(usage, my_dma->data.size);
+        mei_dma_acct_charge(&mei_dma_acct_total, my_dma->data.size);
+        my_dma->acct = usage - mei_dma_acct;
+    }
+    pthread_mutex_unlock(&mei_dma_acct_lock);
+}
+
+static void mei_dma_acct_free(MEI_MM_DMA *my_dma) {
+    if(my_dma->acct < 0)
+        return;
+
+    pthread_mutex_lock(&mei_dma_acct_lock);
+    mei_dma_acct[my_dma->acct].bytes -= my_dma->data.size;
+    mei_dma_acct[my_dma->acct].buffers--;
+    mei_dma_acct_total.bytes -= my_dma->data.size;
+    mei_dma_acct_total.buffers--;
+    pthread_mutex_unlock(&mei_dma_acct_lock);
+    my_dma->acct = -1;
+}
+
+static MEI_MM_DMA *mei_dma_get(ssize_t my_size) {
+    MEI_MM_DMA *my_dma = NULL;
+    ssize_t map_size = my_size;
+    size_t class_size;
+    unsigned int dma_class;
+
+    if(my_size <= 0) {
+        LOGERR("bad size %d for dma buffer\n", (int)my_size);
+        return NULL;
+    }
+
+    dma_class = mei_dma_class((size_t)my_size);
+    if(dma_class < MEI_DMA_NUM_CLASSES) {
+        class_size = (size_t)1 << (dma_class + MEI_DMA_MIN_SHIFT);
+        pthread_mutex_lock(&mei_dma_lock);
+        if(mei_dma_count[dma_class]) {
+            my_dma = mei_dma_cached[dma_class][--mei_dma_count[dma_class]];
+            mei_dma_cache_bytes -= (size_t)my_dma->map_size;
+        } else if(class_size <= mei_dma_cache_limit) {
+            /* Only a buffer the cache can take back is rounded up */
+            map_size = (ssize_t)class_size;
+        }
+        pthread_mutex_unlock(&mei_dma_lock);
+    }
+
+    if(my_dma == NULL) {
+        my_dma = mei_dma_map(map_size);
+        if(my_dma == NULL && errno == ENOMEM) {
+            /* Cached buffers hold driver memory, give it back and retry */
+            mei_dma_cache_shrink(0);
+            my_dma = mei_dma_map(map_size);
+        }
+    }
+
+    if(my_dma != NULL)
+        my_dma->data.size = (__u64)my_size;
+    return my_dma;
+}
+
+
+MEI_MM_DMA *mei_alloc_dma_owner(ssize_t my_size, const char *owner) {
+    MEI_MM_DMA *my_dma = mei_dma_get(my_size);
+
+    mei_dma_acct_alloc(my_dma, owner, my_size);
+    return my_dma;
+}
+
+MEI_MM_DMA *mei_alloc_dma(ssize_t my_size) {
+    return mei_alloc_dma_owner(my_size, NULL);
+}
+
+
+
+void mei_clear_dma(MEI_MM_DMA *my_dma) {
+    unsigned int dma_class;
+
+    if(my_dma == NULL) {
+        LOGINFO("null my_dma for clear; doing nothing\n");
+        return;
+    }
+
+    mei_dma_acct_free(my_dma);
+
+    dma_class = mei_dma_class((size_t)my_dma->map_size);
+    if(dma_class < MEI_DMA_NUM_CLASSES &&
+       my_dma->map_size == ((__u64)1 << (dma_class + MEI_DMA_MIN_SHIFT))) {
+        pthread_mutex_lock(&mei_dma_lock);
+        if(mei_dma_count[dma_class] < MEI_DMA_PER_CLASS &&
+           mei_dma_cache_bytes + my_dma->map_size <= mei_dma_cache_limit) {
+            mei_dma_cached[dma_class][mei_dma_count[dma_class]++] = my_dma;
+            mei_dma_cache_bytes += (size_t)my_dma->map_size;
+            my_dma = NULL;
+        }
+        pthread_mutex_unlock(&mei_dma_lock);
+        if(my_dma == NULL)
+            return;
+    }
+
+    mei_dma_unmap(my_dma);
+}
+
+
+void mei_dma_cache_set_limit(size_t bytes) {
+    pthread_mutex_lock(&mei_dma_lock);
+    mei_dma_cache_limit = bytes;
+    pthread_mutex_unlock(&mei_dma_lock);
+
+    mei_dma_cache_shrink(bytes);
+}
+
+
+void mei_dma_cache_trim(void) {
+    mei_dma_cache_shrink(0);
+}
+
+
+int mei_dma_get_usage(const char *owner, struct mei_dma_usage *usage) {
+    unsigned int a;
+    int ret = -1;
+
+    if(usage == NULL)
+        return -1;
+
+    pthread_mutex_lock(&mei_dma_acct_lock);
+    if(owner == NULL) {
+        *usage = mei_dma_acct_total;
+        ret = 0;
+    }
+    for(a = 0; owner != NULL && a < mei_dma_acct_num; a++) {
+        if(!strncmp(mei_dma_acct[a].owner, owner, MEI_DMA_OWNER_LEN - 1)) {
+            *usage = mei_dma_acct[a];
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mei_dma_acct_lock);
+
+    if(ret == 0 && owner == NULL) {
+        pthread_mutex_lock(&mei_dma_lock);
+        usage->cached_bytes = mei_dma_cache_bytes;
+        pthread_mutex_unlock(&mei_dma_lock);
+    }
+    return ret;
+}
+
+unsigned int mei_dma_get_usage_all(struct mei_dma_usage *usage,
+                                   unsigned int max) {
+    unsigned int a;
+
+    pthread_mutex_lock(&mei_dma_acct_lock);
+    for(a = 0; a < mei_dma_acct_num && a < max; a++)
+        usage[a] = mei_dma_acct[a];
+    pthread_mutex_unlock(&mei_dma_acct_lock);
+    return a;
+}
+
+void mei_dma_reset_peaks(void) {
+    unsigned int a;
+
+    pthread_mutex_lock(&mei_dma_acct_lock);
+    for(a = 0; a < mei_dma_acct_num; a++) {
+        mei_dma_acct[a].peak_bytes = mei_dma_acct[a].bytes;
+        mei_dma_acct[a].peak_buffers = mei_dma_acct[a].buffers;
+    }
+    mei_dma_acct_total.peak_bytes = mei_dma_acct_total.bytes;
+    mei_dma_acct_total.peak_buffers = mei_dma_acct_total.buffers;
+    pthread_mutex_unlock(&mei_dma_acct_lock);
+}
+
+
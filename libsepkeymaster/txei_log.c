@@ -11,8 +11,9 @@
 
 static int txei_log_level = TXEI_LOG_LEVEL_DBG;		/*!< Current minimum logging level to print */
 static int txei_log_dest = TXEI_LOG_DEST_PRINTF;	/*!< Current logging output location */
-static FILE* txei_log_out_fp = stdout;				/*!< File descriptor to print non-error messages */
-static FILE* txei_log_err_fp = stderr;				/*!< File descriptor to print error messages */
+/* stdout and stderr are not constants everywhere, NULL stands for them */
+static FILE* txei_log_out_fp = NULL;				/*!< File descriptor to print non-error messages */
+static FILE* txei_log_err_fp = NULL;				/*!< File descriptor to print error messages */
 
 void txei_log_set_dest(TXEI_LOG_DEST dest, FILE *out_fp, FILE *err_fp) {
     switch (dest) {
@@ -177,9 +178,9 @@ print_message:
     } else {
         /* Choose appropriate file descriptor to write to */
         if (txei_log_level < TXEI_LOG_LEVEL_ERR) {
-            dest_fp = txei_log_out_fp;
+            dest_fp = txei_log_out_fp ? txei_log_out_fp : stdout;
         } else {
-            dest_fp = txei_log_err_fp;
+            dest_fp = txei_log_err_fp ? txei_log_err_fp : stderr;
         }
 
         fprintf(dest_fp, "%s", buffer);
@@ -295,9 +296,9 @@ print_message:
     } else {
         /* Choose appropriate file descriptor to write to */
         if (txei_log_level < TXEI_LOG_LEVEL_ERR) {
-            dest_fp = txei_log_out_fp;
+            dest_fp = txei_log_out_fp ? txei_log_out_fp : stdout;
         } else {
-            dest_fp = txei_log_err_fp;
+            dest_fp = txei_log_err_fp ? txei_log_err_fp : stderr;
         }
 
         fprintf(dest_fp, "%s", buffer);
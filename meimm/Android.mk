@@ -4,7 +4,7 @@ include $(CLEAR_VARS)
 
 
 LOCAL_MODULE_TAGS:= debug eng tests optional
-LOCAL_SRC_FILES := meimm.c
+LOCAL_SRC_FILES := meimm.c meimm_copy.c
 LOCAL_MODULE    := libmeimm
 
 LOCAL_COPY_HEADERS_TO := libmei
@@ -99,6 +99,8 @@ void mei_mm_deinit(struct mei_mm_device *mdev);
 
 /* structure is used to supply DMA chunk distribution to SEC application*/
 struct mei_mm_data {
+	__u64 vaddr;
+	__u64 paddr;
 	__u64 size;
 };
 
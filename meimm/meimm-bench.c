@@ -0,0 +1,369 @@
+/*
+ * meimm allocation and copy benchmarks
+ *
+ * Runs against /dev/meimm or, with -b memfd, the host memory backend,
+ * and prints one JSON object with the results:
+ *
+ *  alloc      alloc/free pairs per second for several size mixes, with
+ *             and without the process chunk
+ *  copy       meimm_memcpy and meimm_memcpy_from bandwidth from 64 bytes
+ *             up to the chunk size
+ *  fragment   chunk state after a long randomized alloc/free sequence
+ *  contention alloc/free pairs per second from several threads sharing
+ *             the chunk
+ *  usage      process high-water marks and failures over the whole run
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "meimm.h"
+
+#define BENCH_MAX_LIVE    256
+#define BENCH_MAX_THREADS 32
+
+struct bench_mix {
+	const char *name;
+	size_t min;
+	size_t max;
+};
+
+static const struct bench_mix bench_mixes[] = {
+	{ "fixed_64", 64, 64 },
+	{ "fixed_4k", 4096, 4096 },
+	{ "uniform_64_4k", 64, 4096 },
+	{ "uniform_64_64k", 64, 65536 },
+};
+
+struct bench_thread {
+	pthread_t tid;
+	unsigned int iterations;
+	uint64_t rng;
+	unsigned long ops;
+	unsigned long errors;
+};
+
+static uint64_t bench_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64* */
+static uint64_t bench_random(uint64_t *rng)
+{
+	uint64_t x = *rng;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*rng = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static size_t bench_draw(const struct bench_mix *mix, uint64_t *rng)
+{
+	if (mix->min == mix->max)
+		return mix->min;
+	return mix->min + bench_random(rng) % (mix->max - mix->min + 1);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [options]\n", prog);
+	fprintf(stderr, "  -b <backend>  device or memfd (default device)\n");
+	fprintf(stderr, "  -c <bytes>    chunk size for the pool runs (default 4MB)\n");
+	fprintf(stderr, "  -n <n>        operations per run (default 20000)\n");
+	fprintf(stderr, "  -t <n>        threads for the contention run (default 4)\n");
+	fprintf(stderr, "  -s <n>        random seed (default 1)\n");
+}
+
+/*
+ * Frees the buffer and closes its descriptor, which meimm_free_memory()
+ * leaves open until meimm_deinit(), so that mm can be allocated again
+ */
+static void bench_release(struct meimm *mm)
+{
+	meimm_free_memory(mm);
+	meimm_deinit(mm);
+	meimm_init(mm, false);
+}
+
+static void bench_alloc(const struct bench_mix *mix, bool pooled,
+			unsigned int iterations, uint64_t seed, bool *first)
+{
+	struct meimm mm;
+	uint64_t rng = seed;
+	unsigned long errors = 0;
+	uint64_t start, elapsed;
+	unsigned int a;
+
+	meimm_init(&mm, false);
+	start = bench_nsec();
+	for (a = 0; a < iterations; a++) {
+		if (meimm_alloc_map_memory(&mm, bench_draw(mix, &rng))) {
+			errors++;
+			meimm_init(&mm, false);
+			continue;
+		}
+		bench_release(&mm);
+	}
+	elapsed = bench_nsec() - start;
+	meimm_deinit(&mm);
+
+	printf("%s{\"mix\":\"%s\",\"pool\":%s,\"ops\":%u,\"errors\":%lu,"
+	       "\"ns_per_op\":%.1f,\"ops_per_s\":%.0f}",
+	       *first ? "" : ",", mix->name, pooled ? "true" : "false",
+	       iterations, errors, (double)elapsed / iterations,
+	       iterations * 1e9 / (elapsed ? elapsed : 1));
+	*first = false;
+}
+
+static void bench_copy(size_t chunk_size, unsigned int iterations)
+{
+	struct meimm mm;
+	unsigned char *src;
+	uint64_t start, elapsed, elapsed_from;
+	unsigned int reps, a;
+	size_t size;
+	bool first = true;
+
+	meimm_init(&mm, false);
+	if (meimm_alloc_map_memory(&mm, chunk_size)) {
+		printf("\"copy\":[]");
+		return;
+	}
+	src = malloc(chunk_size);
+	if (!src) {
+		meimm_free_memory(&mm);
+		meimm_deinit(&mm);
+		printf("\"copy\":[]");
+		return;
+	}
+	memset(src, 0x5a, chunk_size);
+
+	printf("\"copy\":[");
+	for (size = 64; size <= chunk_size; size *= 2) {
+		/* Move about the same number of bytes at every size */
+		reps = (unsigned int)(((uint64_t)iterations * 4096) / size);
+		if (reps < 4)
+			reps = 4;
+
+		meimm_memcpy(&mm, 0, src, size);
+		start = bench_nsec();
+		for (a = 0; a < reps; a++)
+			meimm_memcpy(&mm, 0, src, size);
+		elapsed = bench_nsec() - start;
+
+		start = bench_nsec();
+		for (a = 0; a < reps; a++)
+			meimm_memcpy_from(&mm, src, 0, size);
+		elapsed_from = bench_nsec() - start;
+
+		printf("%s{\"bytes\":%zu,\"reps\":%u,\"ns_per_copy\":%.1f,"
+		       "\"mbyte_per_s\":%.1f,\"ns_per_copy_from\":%.1f,"
+		       "\"mbyte_per_s_from\":%.1f}",
+		       first ? "" : ",", size, reps, (double)elapsed / reps,
+		       (double)size * reps * 1e3 / (elapsed ? elapsed : 1),
+		       (double)elapsed_from / reps,
+		       (double)size * reps * 1e3 /
+		       (elapsed_from ? elapsed_from : 1));
+		first = false;
+	}
+	printf("]");
+
+	free(src);
+	meimm_free_memory(&mm);
+	meimm_deinit(&mm);
+}
+
+/*
+ * Keeps up to BENCH_MAX_LIVE buffers from the 64 byte to 64KB mix
+ * alive, freeing or allocating a random one at every step, and then
+ * reports how scattered the free space in the chunk has become
+ */
+static void bench_fragment(unsigned int iterations, uint64_t seed)
+{
+	static struct meimm live[BENCH_MAX_LIVE];
+	struct meimm_pool_stats stats;
+	const struct bench_mix *mix = &bench_mixes[3];
+	uint64_t rng = seed;
+	unsigned int a, slot, num = 0;
+	size_t free_bytes;
+
+	for (a = 0; a < BENCH_MAX_LIVE; a++)
+		meimm_init(&live[a], false);
+
+	for (a = 0; a < iterations; a++) {
+		slot = bench_random(&rng) % BENCH_MAX_LIVE;
+		if (meimm_get_addr(&live[slot])) {
+			bench_release(&live[slot]);
+			num--;
+		} else if (meimm_alloc_map_memory(&live[slot],
+						  bench_draw(mix, &rng)) == 0) {
+			num++;
+		} else {
+			meimm_init(&live[slot], false);
+		}
+	}
+
+	if (meimm_pool_get_stats(&stats) == 0) {
+		free_bytes = stats.chunk_size - stats.in_use;
+		printf("\"fragment\":{\"live\":%u,\"chunk_bytes\":%zu,"
+		       "\"in_use_bytes\":%zu,\"requested_bytes\":%zu,"
+		       "\"free_bytes\":%zu,\"largest_free\":%zu,"
+		       "\"free_blocks\":%zu,\"fallbacks\":%lu,"
+		       "\"internal\":%.3f,\"external\":%.3f}",
+		       num, stats.chunk_size, stats.in_use, stats.requested,
+		       free_bytes, stats.largest_free, stats.free_blocks,
+		       stats.fallbacks,
+		       stats.in_use ?
+		       1.0 - (double)stats.requested / stats.in_use : 0.0,
+		       free_bytes ?
+		       1.0 - (double)stats.largest_free / free_bytes : 0.0);
+	} else {
+		printf("\"fragment\":{}");
+	}
+
+	for (a = 0; a < BENCH_MAX_LIVE; a++) {
+		meimm_free_memory(&live[a]);
+		meimm_deinit(&live[a]);
+	}
+}
+
+static void *bench_contention_thread(void *arg)
+{
+	struct bench_thread *thr = arg;
+	const struct bench_mix *mix = &bench_mixes[2];
+	struct meimm mm;
+	unsigned int a;
+
+	meimm_init(&mm, false);
+	for (a = 0; a < thr->iterations; a++) {
+		if (meimm_alloc_map_memory(&mm, bench_draw(mix, &thr->rng))) {
+			thr->errors++;
+			meimm_init(&mm, false);
+			continue;
+		}
+		bench_release(&mm);
+		thr->ops++;
+	}
+	meimm_deinit(&mm);
+	return NULL;
+}
+
+static void bench_contention(unsigned int threads, unsigned int iterations,
+			     uint64_t seed)
+{
+	struct bench_thread thr[BENCH_MAX_THREADS];
+	unsigned long ops = 0, errors = 0;
+	uint64_t start, elapsed;
+	unsigned int a, started;
+
+	memset(thr, 0, sizeof(thr));
+	start = bench_nsec();
+	for (started = 0; started < threads; started++) {
+		thr[started].iterations = iterations;
+		thr[started].rng = seed * 0x9E3779B97F4A7C15ULL + started + 1;
+		if (pthread_create(&thr[started].tid, NULL,
+				   bench_contention_thread, &thr[started]))
+			break;
+	}
+	for (a = 0; a < started; a++) {
+		pthread_join(thr[a].tid, NULL);
+		ops += thr[a].ops;
+		errors += thr[a].errors;
+	}
+	elapsed = bench_nsec() - start;
+
+	printf("\"contention\":{\"threads\":%u,\"ops\":%lu,\"errors\":%lu,"
+	       "\"ops_per_s\":%.0f}",
+	       started, ops, errors, ops * 1e9 / (elapsed ? elapsed : 1));
+}
+
+int main(int argc, char **argv)
+{
+	const char *backend = "device";
+	size_t chunk_size = 4 * 1024 * 1024;
+	unsigned int iterations = 20000;
+	unsigned int threads = 4;
+	uint64_t seed = 1;
+	struct meimm_usage total;
+	bool first = true;
+	unsigned int a;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "b:c:n:t:s:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			backend = optarg;
+			break;
+		case 'c':
+			chunk_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			threads = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (strcmp(backend, "device") && strcmp(backend, "memfd")) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (iterations == 0 || chunk_size < 4096 || threads == 0 ||
+	    threads > BENCH_MAX_THREADS || seed == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	setenv("MEIMM_BACKEND", backend, 1);
+
+	printf("{\"backend\":\"%s\",\"chunk_size\":%zu,\"iterations\":%u,"
+	       "\"seed\":%llu,\"alloc\":[",
+	       backend, chunk_size, iterations, (unsigned long long)seed);
+	for (a = 0; a < sizeof(bench_mixes) / sizeof(bench_mixes[0]); a++)
+		bench_alloc(&bench_mixes[a], false, iterations, seed, &first);
+
+	ret = meimm_pool_init(chunk_size, false);
+	if (ret) {
+		printf("],\"error\":\"pool init failed: %s\"}\n", strerror(ret));
+		return 1;
+	}
+	for (a = 0; a < sizeof(bench_mixes) / sizeof(bench_mixes[0]); a++)
+		bench_alloc(&bench_mixes[a], true, iterations, seed, &first);
+	printf("],");
+	bench_fragment(iterations, seed);
+	printf(",");
+	bench_contention(threads, iterations, seed);
+	meimm_pool_deinit();
+
+	/* Copies go to a dedicated buffer as large as the chunk */
+	printf(",");
+	bench_copy(chunk_size, iterations);
+
+	meimm_get_usage(NULL, &total);
+	printf(",\"usage\":{\"peak_bytes\":%llu,\"peak_buffers\":%u,"
+	       "\"allocs\":%u,\"failures\":%u,\"largest_failed\":%llu}",
+	       (unsigned long long)total.peak_bytes, total.peak_buffers,
+	       total.allocs, total.failures,
+	       (unsigned long long)total.largest_failed);
+	printf("}\n");
+
+	return 0;
+}
@@ -1,15 +1,32 @@
+#include <stdio.h>
+#include <string.h>
 #include "meimm.h"
 
 int main(int argc, char **argv)
 {
 	struct meimm __mm, *mm;
+	char buf[64];
+	int ret;
 	mm = &__mm;
 
+	memset(buf, 0xa5, sizeof(buf));
+
 	meimm_init(mm, true);
-	meimm_alloc_map_memory(mm, 1024);
+	ret = meimm_alloc_map_memory(mm, 1024);
+	if (ret) {
+		fprintf(stderr, "alloc failed %d\n", ret);
+		return 1;
+	}
+	if (!meimm_memcpy(mm, 0, buf, sizeof(buf)) ||
+	    memcmp(meimm_get_addr(mm), buf, sizeof(buf))) {
+		fprintf(stderr, "memcpy failed\n");
+		return 1;
+	}
+	printf("paddr=0x%llX size=%zd%s\n",
+	       (unsigned long long)meimm_get_paddr(mm), meimm_get_size(mm),
+	       mm->simulated ? " (simulated)" : "");
 	meimm_free_memory(mm);
 	meimm_deinit(mm);
 
 	return 0;
 }
-
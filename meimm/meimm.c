@@ -73,13 +73,21 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <linux/mei-mm.h>
 #include <meimm.h>
+#include "meimm_copy.h"
 
 #define MEI_MM_STATUS_INIT      1UL
 #define MEI_MM_STATUS_ALLOCATED 2UL
+#define MEI_MM_STATUS_POOLED    3UL
+
+#define meimm_mapped(_mm) \
+	((_mm)->status == MEI_MM_STATUS_ALLOCATED || \
+	 (_mm)->status == MEI_MM_STATUS_POOLED)
 
 /*****************************************************************************
  * Intel Management Enginin Interface
@@ -104,6 +112,116 @@
 #define MMDEV "/dev/meimm"
 #endif /* MMDEV */
 
+/*
+ * Host memory backend
+ *
+ * With MEIMM_BACKEND=memfd in the environment buffers are anonymous
+ * memfd mappings instead of driver memory. Every buffer gets a
+ * simulated, page aligned device address from a counter so that code
+ * passing physical addresses around behaves the same; nothing may DMA
+ * to them. MEIMM_BACKEND=device forces the driver. Without the variable
+ * the driver is used, except that a non Android build with
+ * MEIMM_MEMFD_FALLBACK defined falls back to memfd, with a message,
+ * when MMDEV does not exist.
+ */
+#define MEIMM_SIM_PADDR_BASE 0x80000000ULL
+
+/*
+ * Large page mappings, see MEIMM_MAP_HUGE
+ *
+ * Host memory is first asked for from hugetlbfs, which only works when
+ * huge pages were reserved, and otherwise mapped normally with
+ * transparent huge page advice. Driver memory is physically contiguous
+ * already; whether its mapping uses large pages is up to the driver, so
+ * it only gets the advice.
+ */
+#define MEIMM_HUGE_SIZE (2 * 1024 * 1024)
+
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif /* MFD_HUGETLB */
+
+static uint64_t meimm_sim_paddr = MEIMM_SIM_PADDR_BASE;
+
+static bool meimm_use_memfd(struct meimm *mm)
+{
+#if defined(MEIMM_MEMFD_FALLBACK) && !defined(ANDROID)
+	static bool meimm_fallback_logged;
+#endif /* MEIMM_MEMFD_FALLBACK && !ANDROID */
+	const char *backend = getenv("MEIMM_BACKEND");
+
+	if (backend)
+		return strcmp(backend, "memfd") == 0;
+#if defined(MEIMM_MEMFD_FALLBACK) && !defined(ANDROID)
+	if (access(MMDEV, F_OK) != 0 && errno == ENOENT) {
+		if (!meimm_fallback_logged) {
+			meimm_fallback_logged = true;
+			meimm_err(mm, "%s missing, using host memory with "
+				  "simulated device addresses\n", MMDEV);
+		}
+		return true;
+	}
+#endif /* MEIMM_MEMFD_FALLBACK && !ANDROID */
+	return false;
+}
+
+static int meimm_memfd_create(struct meimm *mm, unsigned int mfd_flags,
+			      uint64_t span)
+{
+#ifdef __NR_memfd_create
+	mm->fd = syscall(__NR_memfd_create, "meimm", mfd_flags);
+#else
+	mm->fd = -1;
+	errno = ENOSYS;
+#endif /* __NR_memfd_create */
+	if (mm->fd == -1)
+		return errno;
+
+	if (ftruncate(mm->fd, (off_t)span)) {
+		close(mm->fd);
+		mm->fd = -1;
+		return errno;
+	}
+	return 0;
+}
+
+static int meimm_memfd_open(struct meimm *mm, struct mei_mm_data *data,
+			    unsigned int flags)
+{
+	uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+	uint64_t span = (data->size + page - 1) & ~(page - 1);
+	uint64_t huge_span;
+	int ret;
+
+	/* hugetlbfs files have to be sized and mapped in whole huge pages */
+	if (flags & MEIMM_MAP_HUGE) {
+		huge_span = (data->size + MEIMM_HUGE_SIZE - 1) &
+			~((uint64_t)MEIMM_HUGE_SIZE - 1);
+		if (meimm_memfd_create(mm, MFD_HUGETLB, huge_span) == 0) {
+			span = huge_span;
+			mm->huge = true;
+			goto sized;
+		}
+		meimm_msg(mm, "no hugetlb memfd: %s\n", strerror(errno));
+	}
+
+	ret = meimm_memfd_create(mm, 0, span);
+	if (ret) {
+		meimm_err(mm, "cannot create memfd: %s\n", strerror(ret));
+		return ret;
+	}
+
+sized:
+	data->size = span;
+	data->vaddr = 0;
+	data->paddr = __atomic_fetch_add(&meimm_sim_paddr, span,
+					 __ATOMIC_RELAXED);
+	mm->simulated = true;
+	meimm_msg(mm, "memfd fd=%d paddr=0x%llX (simulated) size=%llu\n",
+		  mm->fd, data->paddr, data->size);
+	return 0;
+}
+
 void meimm_verbose(struct meimm *mm, bool verbose)
 {
 	if (!mm)
@@ -130,6 +248,12 @@ int meimm_init(struct meimm *mm, bool verbose)
 
 	mm->verbose = verbose;
 	mm->status = MEI_MM_STATUS_INIT;
+	mm->simulated = false;
+	mm->huge = false;
+	mm->owner = NULL;
+	mm->acct = -1;
+	mm->dirty_runs = 0;
+	mm->batch = 0;
 
 	return 0;
 }
@@ -157,13 +281,28 @@ void meimm_free(struct meimm *mm)
 	free(mm);
 }
 
-int meimm_alloc_map_memory(struct meimm *mm, size_t size)
+static pthread_once_t meimm_pool_env_once = PTHREAD_ONCE_INIT;
+static void meimm_pool_env_init(void);
+static int meimm_pool_get(struct meimm *mm, size_t size, unsigned int flags);
+static void meimm_pool_put(struct meimm *mm);
+
+static int meimm_alloc_map_dma(struct meimm *mm, size_t size,
+			       unsigned int flags)
 {
 	struct mei_mm_data data = {
 		.size = size,
 	};
 	int ret;
 
+	mm->simulated = false;
+	mm->huge = false;
+	if (meimm_use_memfd(mm)) {
+		ret = meimm_memfd_open(mm, &data, flags);
+		if (ret)
+			goto err;
+		goto map;
+	}
+
 	mm->fd = open(MMDEV, O_RDWR);
 	if (mm->fd == -1) {
 		meimm_err(mm, "cannot open %s: %s\n", MMDEV, strerror(errno));
@@ -182,13 +321,35 @@ int meimm_alloc_map_memory(struct meimm *mm, size_t size)
 	meimm_msg(mm, "Allocated: vaddr=0x%0llX paddr=0x%0llX size=%llu\n",
 			data.vaddr, data.paddr, data.size);
 
+map:
 	/* pa_offset = addr & ~(sysconf(_SC_PAGE_SIZE) - 1); */
 	mm->ptr = mmap(NULL, data.size, PROT_READ | PROT_WRITE, MAP_SHARED, mm->fd, 0);
+	if (mm->ptr == MAP_FAILED && mm->huge) {
+		/* hugetlbfs only fails here when no huge pages are reserved */
+		meimm_msg(mm, "no huge pages for mmap: %s\n", strerror(errno));
+		close(mm->fd);
+		mm->fd = -1;
+		mm->huge = false;
+		data.size = size;
+		ret = meimm_memfd_open(mm, &data, flags & ~MEIMM_MAP_HUGE);
+		if (ret)
+			goto err;
+		goto map;
+	}
 	if (mm->ptr == MAP_FAILED)  {
 		meimm_err(mm, "memmap failed err=%d\n", errno);
+		ret = errno;
 		goto err;
 	}
+#ifdef MADV_HUGEPAGE
+	/* Only advice, the mapping works the same when it is refused */
+	if ((flags & MEIMM_MAP_HUGE) && !mm->huge &&
+	    madvise(mm->ptr, data.size, MADV_HUGEPAGE))
+		meimm_msg(mm, "MADV_HUGEPAGE refused: %s\n", strerror(errno));
+#endif /* MADV_HUGEPAGE */
 	mm->size = data.size;
+	mm->handle = data.paddr;
+	mm->dirty_runs = 0;
 	mm->status = MEI_MM_STATUS_ALLOCATED;
 	meimm_msg(mm, "got user space ptr = %p\n", mm->ptr);
 	return 0;
@@ -197,28 +358,224 @@ err:
 	return ret;
 }
 
+/*****************************************************************************
+ * Usage accounting
+ *
+ * Every buffer handed out by meimm_alloc_map_memory() is charged to the
+ * owner tag set with meimm_set_owner(), and to the process totals, until
+ * it is freed. Failed requests are counted against the owner as well.
+ *****************************************************************************/
+#define MEIMM_ACCT_MAX_OWNERS   16
+#define MEIMM_ACCT_DEFAULT      "default"
+#define MEIMM_ACCT_OTHER        "other"
+
+static pthread_mutex_t meimm_acct_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct meimm_usage meimm_acct[MEIMM_ACCT_MAX_OWNERS];
+static struct meimm_usage meimm_acct_total = {
+	.owner = "total",
+};
+static unsigned int meimm_acct_num;
+
+/*
+ * Called with meimm_acct_lock held. The last slot is kept for an "other"
+ * bucket that takes every owner past MEIMM_ACCT_MAX_OWNERS - 1.
+ */
+static struct meimm_usage *meimm_acct_find(struct meimm *mm)
+{
+	const char *owner = mm->owner;
+	unsigned int a;
+
+	if (!owner)
+		owner = MEIMM_ACCT_DEFAULT;
+	for (a = 0; a < meimm_acct_num; a++) {
+		if (!strncmp(meimm_acct[a].owner, owner, MEIMM_OWNER_LEN - 1))
+			return &meimm_acct[a];
+	}
+	if (meimm_acct_num < MEIMM_ACCT_MAX_OWNERS - 1) {
+		strncpy(meimm_acct[a].owner, owner, MEIMM_OWNER_LEN - 1);
+		meimm_acct_num++;
+		return &meimm_acct[a];
+	}
+
+	if (meimm_acct_num < MEIMM_ACCT_MAX_OWNERS) {
+		strncpy(meimm_acct[a].owner, MEIMM_ACCT_OTHER,
+			MEIMM_OWNER_LEN - 1);
+		meimm_acct_num++;
+		meimm_err(mm, "more than %d owners, charging %s and later "
+			  "ones to \"%s\"\n", MEIMM_ACCT_MAX_OWNERS - 1, owner,
+			  MEIMM_ACCT_OTHER);
+	}
+	return &meimm_acct[MEIMM_ACCT_MAX_OWNERS - 1];
+}
+
+static void meimm_acct_charge(struct meimm_usage *u, size_t size)
+{
+	u->bytes += size;
+	u->buffers++;
+	u->allocs++;
+	if (u->bytes > u->peak_bytes)
+		u->peak_bytes = u->bytes;
+	if (u->buffers > u->peak_buffers)
+		u->peak_buffers = u->buffers;
+}
+
+static void meimm_acct_fail(struct meimm_usage *u, size_t size)
+{
+	u->failures++;
+	if (size > u->largest_failed)
+		u->largest_failed = size;
+}
+
+static void meimm_acct_release(struct meimm_usage *u, size_t size)
+{
+	u->bytes -= size;
+	u->buffers--;
+}
+
+static void meimm_acct_alloc(struct meimm *mm, size_t size, int ret)
+{
+	struct meimm_usage *u;
+
+	pthread_mutex_lock(&meimm_acct_lock);
+	u = meimm_acct_find(mm);
+	if (ret) {
+		meimm_acct_fail(u, size);
+		meimm_acct_fail(&meimm_acct_total, size);
+	} else {
+		meimm_acct_charge(u, mm->size);
+		meimm_acct_charge(&meimm_acct_total, mm->size);
+		mm->acct = u - meimm_acct;
+	}
+	pthread_mutex_unlock(&meimm_acct_lock);
+}
+
+static void meimm_acct_free(struct meimm *mm)
+{
+	if (mm->acct < 0)
+		return;
+
+	pthread_mutex_lock(&meimm_acct_lock);
+	meimm_acct_release(&meimm_acct[mm->acct], mm->size);
+	meimm_acct_release(&meimm_acct_total, mm->size);
+	pthread_mutex_unlock(&meimm_acct_lock);
+	mm->acct = -1;
+}
+
+void meimm_set_owner(struct meimm *mm, const char *owner)
+{
+	if (mm)
+		mm->owner = owner;
+}
+
+int meimm_get_usage(const char *owner, struct meimm_usage *usage)
+{
+	unsigned int a;
+	int ret = ENOENT;
+
+	if (!usage)
+		return EINVAL;
+
+	pthread_mutex_lock(&meimm_acct_lock);
+	if (!owner) {
+		*usage = meimm_acct_total;
+		ret = 0;
+	}
+	for (a = 0; owner && a < meimm_acct_num; a++) {
+		if (!strncmp(meimm_acct[a].owner, owner, MEIMM_OWNER_LEN - 1)) {
+			*usage = meimm_acct[a];
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&meimm_acct_lock);
+	return ret;
+}
+
+unsigned int meimm_get_usage_all(struct meimm_usage *usage, unsigned int max)
+{
+	unsigned int a;
+
+	pthread_mutex_lock(&meimm_acct_lock);
+	for (a = 0; a < meimm_acct_num && a < max; a++)
+		usage[a] = meimm_acct[a];
+	pthread_mutex_unlock(&meimm_acct_lock);
+	return a;
+}
+
+void meimm_reset_peaks(void)
+{
+	unsigned int a;
+
+	pthread_mutex_lock(&meimm_acct_lock);
+	for (a = 0; a < meimm_acct_num; a++) {
+		meimm_acct[a].peak_bytes = meimm_acct[a].bytes;
+		meimm_acct[a].peak_buffers = meimm_acct[a].buffers;
+	}
+	meimm_acct_total.peak_bytes = meimm_acct_total.bytes;
+	meimm_acct_total.peak_buffers = meimm_acct_total.buffers;
+	pthread_mutex_unlock(&meimm_acct_lock);
+}
+
+int meimm_alloc_map_memory_flags(struct meimm *mm, size_t size,
+				 unsigned int flags)
+{
+	int ret = ENOENT;
+
+	/*
+	 * Served from the process wide chunk when there is one, unless
+	 * the caller wants large pages of its own
+	 */
+	pthread_once(&meimm_pool_env_once, meimm_pool_env_init);
+	if (!(flags & MEIMM_MAP_HUGE))
+		ret = meimm_pool_get(mm, size, flags);
+	if (ret)
+		ret = meimm_alloc_map_dma(mm, size, flags);
+
+	meimm_acct_alloc(mm, size, ret);
+	return ret;
+}
+
+int meimm_alloc_map_memory(struct meimm *mm, size_t size)
+{
+	return meimm_alloc_map_memory_flags(mm, size, 0);
+}
+
 int meimm_free_memory(struct meimm *mm)
 {
 	struct mei_mm_data data;
 	
 	int ret;
+	if (meimm_mapped(mm))
+		meimm_acct_free(mm);
+
+	if (mm->status == MEI_MM_STATUS_POOLED) {
+		mm->batch = 0;
+		meimm_flush(mm);
+		meimm_pool_put(mm);
+		return 0;
+	}
+
 	if (mm->status != MEI_MM_STATUS_ALLOCATED)
 		return 0;
 
 	if (mm->ptr == NULL)
 		return 0;
 
-	ret = msync(mm->ptr, mm->size, MS_ASYNC);
-	if (ret) {
-		meimm_err(mm, "msync fialed %s\n", strerror(errno));
+	/* Only what was written since the last flush still needs syncing */
+	mm->batch = 0;
+	ret = meimm_flush(mm);
+	if (ret)
 		goto out;
-	}
 	ret = munmap(mm->ptr, mm->size);
 	if (ret) {
 		meimm_err(mm, "munmap fialed %s\n", strerror(errno));
 		goto out;
 	}
 
+	/* Host memory goes away with the mapping and the memfd */
+	if (mm->simulated)
+		goto out;
+
 	memset(&data, 0, sizeof(data));
 	data.size = mm->size;
 
@@ -230,29 +587,607 @@ out:
 
 void *meimm_get_addr(struct meimm *mm)
 {
-	return (mm && mm->status == MEI_MM_STATUS_ALLOCATED) ? mm->ptr :  NULL;
+	return (mm && meimm_mapped(mm)) ? mm->ptr :  NULL;
 }
 
 ssize_t meimm_get_size(struct meimm *mm)
 {
-	return (mm && mm->status == MEI_MM_STATUS_ALLOCATED) ? mm->size : -1;
+	return (mm && meimm_mapped(mm)) ? (ssize_t)mm->size : -1;
+}
+
+uint64_t meimm_get_paddr(struct meimm *mm)
+{
+	return (mm && meimm_mapped(mm)) ? (uint64_t)mm->handle : 0;
+}
+
+/* msync wants a page aligned start, pooled buffers need not be */
+static int meimm_sync(struct meimm *mm, void *addr, size_t len)
+{
+	uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)addr & ~(page - 1);
+
+	return msync((void *)start, (uintptr_t)addr + len - start, MS_ASYNC);
+}
+
+/* Bytes between run and [start, end), 0 when they overlap or touch */
+static size_t meimm_dirty_gap(const struct meimm_dirty_run *run,
+			      size_t start, size_t end)
+{
+	if (run->end < start)
+		return start - run->end;
+	if (end < run->start)
+		return run->start - end;
+	return 0;
+}
+
+void meimm_mark_dirty(struct meimm *mm, off_t offset, size_t len)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t start, end, gap, best_gap;
+	unsigned int a, best;
+
+	if (!mm || !meimm_mapped(mm) || len == 0)
+		return;
+
+	start = (size_t)offset;
+	end = start + len;
+
+	/* Runs that would sync a common page are synced as one */
+	a = 0;
+	while (a < mm->dirty_runs) {
+		if (meimm_dirty_gap(&mm->dirty[a], start, end) >= page) {
+			a++;
+			continue;
+		}
+		if (mm->dirty[a].start < start)
+			start = mm->dirty[a].start;
+		if (mm->dirty[a].end > end)
+			end = mm->dirty[a].end;
+		mm->dirty[a] = mm->dirty[--mm->dirty_runs];
+		/* The grown run may now reach runs already passed */
+		a = 0;
+	}
+
+	/* No free slot, grow the closest run instead */
+	if (mm->dirty_runs == MEIMM_DIRTY_RUNS) {
+		best = 0;
+		best_gap = (size_t)-1;
+		for (a = 0; a < mm->dirty_runs; a++) {
+			gap = meimm_dirty_gap(&mm->dirty[a], start, end);
+			if (gap < best_gap) {
+				best = a;
+				best_gap = gap;
+			}
+		}
+		if (mm->dirty[best].start < start)
+			start = mm->dirty[best].start;
+		if (mm->dirty[best].end > end)
+			end = mm->dirty[best].end;
+		mm->dirty[best] = mm->dirty[--mm->dirty_runs];
+	}
+
+	mm->dirty[mm->dirty_runs].start = start;
+	mm->dirty[mm->dirty_runs].end = end;
+	mm->dirty_runs++;
+}
+
+int meimm_flush(struct meimm *mm)
+{
+	struct meimm_dirty_run *run;
+	int ret;
+
+	if (!mm || !meimm_mapped(mm) || !mm->ptr)
+		return EINVAL;
+
+	/* A run that fails to sync stays dirty, as do those not reached */
+	while (mm->dirty_runs) {
+		run = &mm->dirty[mm->dirty_runs - 1];
+		ret = meimm_sync(mm, (unsigned char *)mm->ptr + run->start,
+				 run->end - run->start);
+		if (ret) {
+			ret = errno;
+			meimm_err(mm, "msync fialed %s\n", strerror(ret));
+			return ret;
+		}
+
+		meimm_msg(mm, "flushed [0x%zX, 0x%zX)\n", run->start, run->end);
+		mm->dirty_runs--;
+	}
+	return 0;
+}
+
+void meimm_batch_begin(struct meimm *mm)
+{
+	if (mm)
+		mm->batch++;
+}
+
+int meimm_batch_end(struct meimm *mm)
+{
+	if (!mm || mm->batch == 0)
+		return EINVAL;
+
+	if (--mm->batch)
+		return 0;
+	return meimm_flush(mm);
 }
 
 void *meimm_memcpy(struct meimm *mm, off_t offset, const void *buf, size_t len)
 {
 	unsigned char *ptr;
-	int ret;
-	if (!mm || mm->status != MEI_MM_STATUS_ALLOCATED || !mm->ptr)
+	if (!mm || !meimm_mapped(mm) || !mm->ptr)
 		return NULL;
 
-	if (offset + len > mm->size)
+	if (offset < 0 || offset + len > mm->size)
 		return NULL;
 
-	ptr = memcpy((unsigned char *)mm->ptr + offset, buf, len);
-	ret = msync(mm->ptr, mm->size, MS_ASYNC);
-	if (ret)
-		meimm_err(mm, "msync fialed %s\n", strerror(errno));
+	ptr = (unsigned char *)mm->ptr + offset;
+	meimm_copy_to_device(ptr, buf, len);
+	meimm_mark_dirty(mm, offset, len);
+	if (mm->batch == 0)
+		meimm_flush(mm);
 
 	return ptr;
 }
 
+void *meimm_memcpy_from(struct meimm *mm, void *buf, off_t offset, size_t len)
+{
+	if (!mm || !meimm_mapped(mm) || !mm->ptr || !buf)
+		return NULL;
+
+	if (offset < 0 || offset + len > mm->size)
+		return NULL;
+
+	meimm_copy_from_device(buf, (unsigned char *)mm->ptr + offset, len);
+	return buf;
+}
+
+/*****************************************************************************
+ * Process wide DMA chunk
+ *
+ * meimm_pool_init() allocates and maps one chunk from the driver; after
+ * that meimm_alloc_map_memory() carves buffers out of it with a buddy
+ * allocator instead of going to the kernel. All allocator state lives
+ * on the heap, indexed by 64 byte block: the block map records which
+ * blocks are heads of free or allocated blocks and their order, the
+ * link table chains the free blocks of each order. Nothing is stored in
+ * the chunk, which the device can write.
+ * A buffer's device address is the chunk's physical address plus its
+ * offset. Requests the chunk cannot satisfy fall back to a dedicated
+ * driver allocation.
+ *
+ * Setting MEIMM_POOL_SIZE to a size in bytes makes the first
+ * meimm_alloc_map_memory() call of the process set up the chunk.
+ *****************************************************************************/
+#define MEIMM_POOL_MIN_ORDER    6       /* 64 byte blocks */
+#define MEIMM_POOL_MAX_ORDER    30
+#define MEIMM_POOL_FREE         0x80
+#define MEIMM_POOL_USED         0x40
+#define MEIMM_POOL_ORDER_MASK   0x3f
+#define MEIMM_POOL_NONE         ((size_t)-1)
+
+struct meimm_pool_link {
+	size_t next;
+	size_t prev;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct meimm chunk;
+	unsigned int order;
+	unsigned char *map;
+	struct meimm_pool_link *links;
+	size_t in_use;
+	size_t requested;
+	unsigned long allocs;
+	unsigned long fallbacks;
+	size_t free[MEIMM_POOL_MAX_ORDER + 1];
+} meimm_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static size_t meimm_pool_index(void *block)
+{
+	return ((unsigned char *)block - (unsigned char *)meimm_pool.chunk.ptr)
+		>> MEIMM_POOL_MIN_ORDER;
+}
+
+static void *meimm_pool_block(size_t index)
+{
+	return (unsigned char *)meimm_pool.chunk.ptr +
+		(index << MEIMM_POOL_MIN_ORDER);
+}
+
+static void meimm_pool_push(size_t index, unsigned int order)
+{
+	struct meimm_pool_link *link = &meimm_pool.links[index];
+
+	link->prev = MEIMM_POOL_NONE;
+	link->next = meimm_pool.free[order];
+	if (link->next != MEIMM_POOL_NONE)
+		meimm_pool.links[link->next].prev = index;
+	meimm_pool.free[order] = index;
+	meimm_pool.map[index] = MEIMM_POOL_FREE | order;
+}
+
+static void meimm_pool_unlink(size_t index, unsigned int order)
+{
+	struct meimm_pool_link *link = &meimm_pool.links[index];
+
+	if (link->prev != MEIMM_POOL_NONE)
+		meimm_pool.links[link->prev].next = link->next;
+	else
+		meimm_pool.free[order] = link->next;
+	if (link->next != MEIMM_POOL_NONE)
+		meimm_pool.links[link->next].prev = link->prev;
+	meimm_pool.map[index] = 0;
+}
+
+int meimm_pool_init(size_t chunk_size, bool verbose)
+{
+	unsigned int order = MEIMM_POOL_MIN_ORDER;
+	unsigned int k;
+	int ret;
+
+	pthread_mutex_lock(&meimm_pool.lock);
+	if (meimm_pool.map) {
+		ret = EALREADY;
+		goto out;
+	}
+
+	meimm_init(&meimm_pool.chunk, verbose);
+	ret = meimm_alloc_map_dma(&meimm_pool.chunk, chunk_size,
+				  chunk_size >= MEIMM_HUGE_SIZE ?
+				  MEIMM_MAP_HUGE : 0);
+	if (ret)
+		goto out;
+
+	/* The buddy region is the largest power of two that was mapped */
+	while (order < MEIMM_POOL_MAX_ORDER &&
+	       ((size_t)1 << (order + 1)) <= meimm_pool.chunk.size)
+		order++;
+	if (((size_t)1 << order) > meimm_pool.chunk.size) {
+		meimm_err(&meimm_pool.chunk, "chunk of %zu bytes is too small\n",
+			meimm_pool.chunk.size);
+		ret = EINVAL;
+		goto err;
+	}
+
+	meimm_pool.map = calloc((size_t)1 << (order - MEIMM_POOL_MIN_ORDER), 1);
+	meimm_pool.links = calloc((size_t)1 << (order - MEIMM_POOL_MIN_ORDER),
+				  sizeof(*meimm_pool.links));
+	if (!meimm_pool.map || !meimm_pool.links) {
+		free(meimm_pool.map);
+		free(meimm_pool.links);
+		meimm_pool.map = NULL;
+		meimm_pool.links = NULL;
+		ret = ENOMEM;
+		goto err;
+	}
+
+	meimm_pool.order = order;
+	meimm_pool.in_use = 0;
+	meimm_pool.requested = 0;
+	meimm_pool.allocs = 0;
+	meimm_pool.fallbacks = 0;
+	for (k = 0; k <= MEIMM_POOL_MAX_ORDER; k++)
+		meimm_pool.free[k] = MEIMM_POOL_NONE;
+	meimm_pool_push(0, order);
+
+	meimm_msg(&meimm_pool.chunk, "pool of %zu bytes at paddr=0x%llX\n",
+		(size_t)1 << order, (unsigned long long)meimm_pool.chunk.handle);
+	ret = 0;
+	goto out;
+err:
+	meimm_free_memory(&meimm_pool.chunk);
+	meimm_deinit(&meimm_pool.chunk);
+out:
+	pthread_mutex_unlock(&meimm_pool.lock);
+	return ret;
+}
+
+/* Sets up the chunk asked for with MEIMM_POOL_SIZE, if any */
+static void meimm_pool_env_init(void)
+{
+	const char *env = getenv("MEIMM_POOL_SIZE");
+	unsigned long long size;
+	char *end;
+
+	if (!env)
+		return;
+
+	size = strtoull(env, &end, 0);
+	if (size == 0 || *end != '\0' || size > SIZE_MAX) {
+		meimm_err(&meimm_pool.chunk, "bad MEIMM_POOL_SIZE \"%s\"\n", env);
+		return;
+	}
+	meimm_pool_init((size_t)size, true);
+}
+
+int meimm_pool_deinit(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&meimm_pool.lock);
+	if (!meimm_pool.map)
+		goto out;
+	if (meimm_pool.in_use) {
+		meimm_err(&meimm_pool.chunk, "pool still has %zu bytes in use\n",
+			meimm_pool.in_use);
+		ret = EBUSY;
+		goto out;
+	}
+
+	free(meimm_pool.map);
+	free(meimm_pool.links);
+	meimm_pool.map = NULL;
+	meimm_pool.links = NULL;
+	meimm_free_memory(&meimm_pool.chunk);
+	meimm_deinit(&meimm_pool.chunk);
+out:
+	pthread_mutex_unlock(&meimm_pool.lock);
+	return ret;
+}
+
+int meimm_pool_get_stats(struct meimm_pool_stats *stats)
+{
+	size_t index;
+	unsigned int k;
+
+	if (!stats)
+		return EINVAL;
+
+	memset(stats, 0, sizeof(*stats));
+	pthread_mutex_lock(&meimm_pool.lock);
+	if (!meimm_pool.map) {
+		pthread_mutex_unlock(&meimm_pool.lock);
+		return ENOENT;
+	}
+
+	stats->chunk_size = (size_t)1 << meimm_pool.order;
+	stats->in_use = meimm_pool.in_use;
+	stats->requested = meimm_pool.requested;
+	stats->allocs = meimm_pool.allocs;
+	stats->fallbacks = meimm_pool.fallbacks;
+	for (k = MEIMM_POOL_MIN_ORDER; k <= meimm_pool.order; k++) {
+		for (index = meimm_pool.free[k]; index != MEIMM_POOL_NONE;
+		     index = meimm_pool.links[index].next) {
+			stats->free_blocks++;
+			stats->largest_free = (size_t)1 << k;
+		}
+	}
+	pthread_mutex_unlock(&meimm_pool.lock);
+	return 0;
+}
+
+static int meimm_pool_get(struct meimm *mm, size_t size, unsigned int flags)
+{
+	size_t index;
+	void *block;
+	unsigned int order = MEIMM_POOL_MIN_ORDER;
+	unsigned int min_order = MEIMM_POOL_MIN_ORDER;
+	unsigned int k;
+	size_t offset;
+
+	if (size == 0)
+		return EINVAL;
+
+	/*
+	 * Blocks are aligned to their own size within the page aligned
+	 * chunk, so the smallest block already covers a cache line and a
+	 * block of at least a page starts on a page
+	 */
+	if (flags & MEIMM_ALIGN_PAGE) {
+		while (((size_t)1 << min_order) < (size_t)sysconf(_SC_PAGESIZE))
+			min_order++;
+	}
+
+	pthread_mutex_lock(&meimm_pool.lock);
+	if (!meimm_pool.map) {
+		pthread_mutex_unlock(&meimm_pool.lock);
+		return ENOENT;
+	}
+
+	while (order < meimm_pool.order &&
+	       (((size_t)1 << order) < size || order < min_order))
+		order++;
+	if (((size_t)1 << order) < size || order < min_order)
+		goto fail;
+
+	for (k = order; k <= meimm_pool.order &&
+	     meimm_pool.free[k] == MEIMM_POOL_NONE; k++)
+		;
+	if (k > meimm_pool.order)
+		goto fail;
+
+	index = meimm_pool.free[k];
+	meimm_pool_unlink(index, k);
+
+	/* Split down to the order asked for, freeing the upper halves */
+	while (k > order) {
+		k--;
+		meimm_pool_push(index + ((size_t)1 << (k - MEIMM_POOL_MIN_ORDER)), k);
+	}
+
+	meimm_pool.map[index] = MEIMM_POOL_USED | order;
+	block = meimm_pool_block(index);
+	meimm_pool.in_use += (size_t)1 << order;
+	meimm_pool.requested += size;
+	meimm_pool.allocs++;
+	pthread_mutex_unlock(&meimm_pool.lock);
+
+	offset = (unsigned char *)block - (unsigned char *)meimm_pool.chunk.ptr;
+	mm->fd = -1;
+	mm->ptr = block;
+	mm->size = size;
+	mm->handle = meimm_pool.chunk.handle + offset;
+	mm->status = MEI_MM_STATUS_POOLED;
+	mm->simulated = meimm_pool.chunk.simulated;
+	mm->huge = meimm_pool.chunk.huge;
+	mm->dirty_runs = 0;
+	meimm_msg(mm, "pooled: offset=0x%zX paddr=0x%llX size=%zu\n",
+		offset, (unsigned long long)mm->handle, size);
+	return 0;
+fail:
+	meimm_pool.fallbacks++;
+	pthread_mutex_unlock(&meimm_pool.lock);
+	return ENOMEM;
+}
+
+static void meimm_pool_put(struct meimm *mm)
+{
+	unsigned int order;
+	size_t index;
+	size_t buddy;
+
+	pthread_mutex_lock(&meimm_pool.lock);
+	index = meimm_pool_index(mm->ptr);
+	order = meimm_pool.map[index] & MEIMM_POOL_ORDER_MASK;
+	meimm_pool.map[index] = 0;
+	meimm_pool.in_use -= (size_t)1 << order;
+	meimm_pool.requested -= mm->size;
+
+	/* Merge with the buddy for as long as it is free and whole */
+	while (order < meimm_pool.order) {
+		buddy = index ^ ((size_t)1 << (order - MEIMM_POOL_MIN_ORDER));
+		if (meimm_pool.map[buddy] != (MEIMM_POOL_FREE | order))
+			break;
+		meimm_pool_unlink(buddy, order);
+		index &= ~((size_t)1 << (order - MEIMM_POOL_MIN_ORDER));
+		order++;
+	}
+	meimm_pool_push(index, order);
+	pthread_mutex_unlock(&meimm_pool.lock);
+
+	mm->ptr = NULL;
+	mm->handle = 0;
+	mm->status = MEI_MM_STATUS_INIT;
+}
+
+/*****************************************************************************
+ * DMA slot ring
+ *
+ * Lock free for one producer and one consumer thread: each side only
+ * writes its own counter and reads the other one with acquire
+ * ordering, so a slot's contents are visible before its commit or
+ * release is.
+ *****************************************************************************/
+#define MEIMM_RING_ALIGN 64
+
+int meimm_ring_init(struct meimm_ring *ring, unsigned int slots,
+		    size_t slot_size, bool verbose)
+{
+	int ret;
+
+	if (!ring || slots == 0 || slot_size == 0)
+		return EINVAL;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->slot_size = (slot_size + MEIMM_RING_ALIGN - 1) &
+		~((size_t)MEIMM_RING_ALIGN - 1);
+	ring->slots = slots;
+
+	ring->lens = calloc(slots, sizeof(size_t));
+	if (!ring->lens)
+		return ENOMEM;
+
+	meimm_init(&ring->mm, verbose);
+	ret = meimm_alloc_map_memory(&ring->mm, ring->slot_size * slots);
+	if (ret) {
+		free(ring->lens);
+		ring->lens = NULL;
+		return ret;
+	}
+
+	meimm_msg(&ring->mm, "ring of %u slots x %zu bytes\n",
+		  slots, ring->slot_size);
+	return 0;
+}
+
+void meimm_ring_deinit(struct meimm_ring *ring)
+{
+	if (!ring || !ring->lens)
+		return;
+
+	meimm_free_memory(&ring->mm);
+	meimm_deinit(&ring->mm);
+	free(ring->lens);
+	ring->lens = NULL;
+}
+
+/*
+ * head and tail run modulo twice the slot count, which tells a full
+ * ring from an empty one for any number of slots
+ */
+static inline unsigned int meimm_ring_used(struct meimm_ring *ring,
+					   unsigned int head, unsigned int tail)
+{
+	return (head + 2 * ring->slots - tail) % (2 * ring->slots);
+}
+
+static inline unsigned int meimm_ring_next(struct meimm_ring *ring,
+					   unsigned int count)
+{
+	return (count + 1) % (2 * ring->slots);
+}
+
+void *meimm_ring_acquire(struct meimm_ring *ring)
+{
+	unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (meimm_ring_used(ring, ring->head, tail) == ring->slots)
+		return NULL;
+	return (unsigned char *)ring->mm.ptr +
+		(size_t)(ring->head % ring->slots) * ring->slot_size;
+}
+
+int meimm_ring_commit(struct meimm_ring *ring, size_t len)
+{
+	unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	size_t offset;
+	int ret;
+
+	if (meimm_ring_used(ring, ring->head, tail) == ring->slots ||
+	    len > ring->slot_size)
+		return EINVAL;
+
+	offset = (size_t)(ring->head % ring->slots) * ring->slot_size;
+	ring->lens[ring->head % ring->slots] = len;
+
+	/* Sync just this slot's payload, never the whole ring */
+	ret = len ? meimm_sync(&ring->mm,
+			       (unsigned char *)ring->mm.ptr + offset, len) : 0;
+	if (ret) {
+		ret = errno;
+		meimm_err(&ring->mm, "msync fialed %s\n", strerror(ret));
+		return ret;
+	}
+
+	__atomic_store_n(&ring->head, meimm_ring_next(ring, ring->head),
+			 __ATOMIC_RELEASE);
+	return 0;
+}
+
+void *meimm_ring_peek(struct meimm_ring *ring, size_t *len, uint64_t *paddr)
+{
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	size_t offset;
+
+	if (head == ring->tail)
+		return NULL;
+
+	offset = (size_t)(ring->tail % ring->slots) * ring->slot_size;
+	if (len)
+		*len = ring->lens[ring->tail % ring->slots];
+	if (paddr)
+		*paddr = ring->mm.handle + offset;
+	return (unsigned char *)ring->mm.ptr + offset;
+}
+
+void meimm_ring_release(struct meimm_ring *ring)
+{
+	if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail)
+		return;
+	__atomic_store_n(&ring->tail, meimm_ring_next(ring, ring->tail),
+			 __ATOMIC_RELEASE);
+}
@@ -67,6 +67,18 @@
 
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+/** most separate dirty runs a buffer tracks before merging them */
+#define MEIMM_DIRTY_RUNS 4
+
+/**
+    \brief written but not yet flushed bytes [start, end) of a buffer
+*/
+struct meimm_dirty_run {
+	size_t start;
+	size_t end;
+};
 
 /**
     \brief MEI memory  buffer
@@ -78,12 +90,88 @@ struct meimm {
 	void *ptr;
 	/** buffer size */
 	size_t size;
-	/** buffer handle */
-	unsigned long handle;
+	/** buffer device address */
+	uint64_t handle;
 	/** buffer status */
 	unsigned long status;
+	/** written but not yet flushed runs, disjoint and in no order */
+	struct meimm_dirty_run dirty[MEIMM_DIRTY_RUNS];
+	unsigned int dirty_runs;
+	/** meimm_batch_begin() nesting depth */
+	unsigned int batch;
 	/** operation verbosity */
 	bool verbose;
+	/** host memory with a simulated device address, see MEIMM_BACKEND */
+	bool simulated;
+	/** mapped from reserved huge pages, see MEIMM_MAP_HUGE */
+	bool huge;
+	/** accounting tag, see meimm_set_owner() */
+	const char *owner;
+	/** accounting slot the buffer is charged to, -1 if none */
+	int acct;
+};
+
+#define MEIMM_OWNER_LEN 16
+
+/**
+    \brief DMA memory charged to one owner tag, see meimm_get_usage()
+*/
+struct meimm_usage {
+	/** owner tag, "total" for the process totals */
+	char owner[MEIMM_OWNER_LEN];
+	/** bytes and buffers currently allocated */
+	uint64_t bytes;
+	uint32_t buffers;
+	/** high-water marks since start or meimm_reset_peaks() */
+	uint64_t peak_bytes;
+	uint32_t peak_buffers;
+	/** successful and failed allocations */
+	uint32_t allocs;
+	uint32_t failures;
+	/** size of the largest request that failed */
+	uint64_t largest_failed;
+};
+
+/**
+    \brief single producer, single consumer ring of DMA slots
+
+    The slots live back to back in one meimm buffer. head and tail
+    count committed and released slots modulo 2 * slots; the slot
+    for count i is at index i % slots.
+*/
+struct meimm_ring {
+	/** backing DMA buffer */
+	struct meimm mm;
+	/** bytes per slot, a multiple of 64 */
+	size_t slot_size;
+	/** number of slots */
+	unsigned int slots;
+	/** payload length of each committed slot */
+	size_t *lens;
+	/** slots committed by the producer */
+	unsigned int head;
+	/** slots released by the consumer */
+	unsigned int tail;
+};
+
+/**
+    \brief snapshot of the process chunk, see meimm_pool_get_stats()
+*/
+struct meimm_pool_stats {
+	/** bytes managed by the buddy allocator */
+	size_t chunk_size;
+	/** bytes in allocated blocks, including rounding */
+	size_t in_use;
+	/** bytes the callers asked for */
+	size_t requested;
+	/** largest block that can still be allocated */
+	size_t largest_free;
+	/** number of free blocks */
+	size_t free_blocks;
+	/** allocations served from the chunk */
+	unsigned long allocs;
+	/** allocations the chunk could not serve */
+	unsigned long fallbacks;
 };
 
 #ifdef __cplusplus
@@ -98,11 +186,167 @@ struct meimm *meimm_alloc(size_t size, bool verbose);
 void meimm_free(struct meimm *mm);
 
 int meimm_alloc_map_memory(struct meimm *mm, size_t buffer_size);
+
+/** buffer starts on a cache line, as every buffer already does */
+#define MEIMM_ALIGN_CACHELINE   0x1
+/** buffer starts on a page */
+#define MEIMM_ALIGN_PAGE        0x2
+/**
+ * dedicated mapping backed by huge pages where possible: hugetlb for
+ * host memory when pages are reserved, transparent huge page advice
+ * otherwise. The buffer never comes from the process chunk and host
+ * memory may be rounded up to a whole huge page.
+ */
+#define MEIMM_MAP_HUGE          0x4
+
+/**
+ * \brief meimm_alloc_map_memory() with MEIMM_ALIGN_* and MEIMM_MAP_* flags
+ *
+ * Returns 0 on success or an errno value.
+ */
+int meimm_alloc_map_memory_flags(struct meimm *mm, size_t buffer_size,
+				 unsigned int flags);
 int meimm_free_memory(struct meimm *mm);
 void *meimm_get_addr(struct meimm *mm);
 ssize_t meimm_get_size(struct meimm *mm);
+/**
+ * \brief copy len bytes from buf into the buffer at offset and flush them
+ *
+ * Large copies use non-temporal stores so the data, which only the
+ * firmware reads, does not push the caller's data out of the cache.
+ * Returns the destination inside the buffer, NULL on a bad range.
+ */
 void *meimm_memcpy(struct meimm *mm, off_t offset, const void *buf, size_t len);
 
+/**
+ * \brief copy len bytes at offset in the buffer out to buf
+ *
+ * Returns buf, NULL on a bad range.
+ */
+void *meimm_memcpy_from(struct meimm *mm, void *buf, off_t offset, size_t len);
+
+/**
+ * \brief record that [offset, offset + len) was written through
+ *        meimm_get_addr() and must be synced by the next flush
+ */
+void meimm_mark_dirty(struct meimm *mm, off_t offset, size_t len);
+
+/**
+ * \brief sync the pages written since the last flush
+ *
+ * Each run of dirty bytes is synced on its own, so writes far apart do
+ * not sync the pages between them. Runs less than a page apart are
+ * merged, and past MEIMM_DIRTY_RUNS a new run is merged into the
+ * closest one. Returns 0 or an errno value.
+ */
+int meimm_flush(struct meimm *mm);
+
+/**
+ * \brief defer flushing across several meimm_memcpy() calls
+ *
+ * Between meimm_batch_begin() and the matching meimm_batch_end()
+ * copies only record dirty runs; meimm_batch_end() flushes them
+ * once. Batches nest.
+ */
+void meimm_batch_begin(struct meimm *mm);
+int meimm_batch_end(struct meimm *mm);
+
+/**
+ * \brief charge the buffers mm allocates from now on to owner
+ *
+ * owner must stay valid while mm is in use, only the first
+ * MEIMM_OWNER_LEN - 1 characters tell owners apart. Untagged buffers
+ * are charged to "default". At most 15 owners are tracked, later ones
+ * are charged together to "other".
+ */
+void meimm_set_owner(struct meimm *mm, const char *owner);
+
+/**
+ * \brief usage of one owner, or the process totals when owner is NULL
+ *
+ * Returns 0, or ENOENT for an owner that never allocated.
+ */
+int meimm_get_usage(const char *owner, struct meimm_usage *usage);
+
+/**
+ * \brief copy up to max owner entries to usage, returns how many
+ */
+unsigned int meimm_get_usage_all(struct meimm_usage *usage, unsigned int max);
+
+/**
+ * \brief restart the high-water marks from the current usage
+ */
+void meimm_reset_peaks(void);
+
+/**
+ * \brief device (physical) address of a mapped buffer, 0 if not mapped
+ */
+uint64_t meimm_get_paddr(struct meimm *mm);
+
+/**
+ * \brief map one DMA chunk of chunk_size bytes for the whole process
+ *
+ * Subsequent meimm_alloc_map_memory() calls are served from the chunk
+ * by a user space buddy allocator, without any system call, and
+ * meimm_free_memory() returns them to it. Without a call, setting
+ * MEIMM_POOL_SIZE in the environment maps the chunk on the first
+ * meimm_alloc_map_memory().
+ * Returns 0 on success or an errno value.
+ */
+int meimm_pool_init(size_t chunk_size, bool verbose);
+
+/**
+ * \brief unmap and release the process chunk
+ *
+ * Returns EBUSY while buffers from the chunk are still allocated.
+ */
+int meimm_pool_deinit(void);
+
+/**
+ * \brief fill stats for the process chunk
+ *
+ * Returns ENOENT when meimm_pool_init() has not been called.
+ */
+int meimm_pool_get_stats(struct meimm_pool_stats *stats);
+
+/**
+ * \brief set up a ring of slots DMA slots of at least slot_size bytes
+ *
+ * The backing memory is allocated once with meimm_alloc_map_memory(),
+ * so it comes from the process chunk when there is one. Streaming
+ * through the ring needs no further allocation.
+ * Returns 0 on success or an errno value.
+ */
+int meimm_ring_init(struct meimm_ring *ring, unsigned int slots,
+		    size_t slot_size, bool verbose);
+void meimm_ring_deinit(struct meimm_ring *ring);
+
+/**
+ * \brief producer: next free slot to fill, NULL while the ring is full
+ */
+void *meimm_ring_acquire(struct meimm_ring *ring);
+
+/**
+ * \brief producer: publish the acquired slot holding len bytes
+ *
+ * Flushes only the len bytes written. Returns 0 or an errno value.
+ */
+int meimm_ring_commit(struct meimm_ring *ring, size_t len);
+
+/**
+ * \brief consumer: oldest committed slot, NULL while the ring is empty
+ *
+ * len and paddr, when not NULL, receive the payload length and the
+ * slot's device address to hand to the firmware.
+ */
+void *meimm_ring_peek(struct meimm_ring *ring, size_t *len,
+		      uint64_t *paddr);
+
+/**
+ * \brief consumer: hand the slot returned by meimm_ring_peek() back
+ */
+void meimm_ring_release(struct meimm_ring *ring);
+
 #ifdef __cplusplus
 }
 #endif /*  __cplusplus */
@@ -0,0 +1,189 @@
+/*
+ * Copy kernels for staging data in and out of DMA memory
+ *
+ * Data copied into a DMA buffer is read by the firmware, not by the
+ * CPU, so large copies use non-temporal stores that bypass the cache
+ * instead of evicting the caller's working set. Copies out of a DMA
+ * buffer use non-temporal loads where the CPU has them. The kernel is
+ * picked once from cpuid: AVX, then SSE2, then plain memcpy.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "meimm_copy.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#include <emmintrin.h>
+
+/* target() on functions using intrinsics needs gcc 4.9 or clang */
+#if defined(__clang__) || __GNUC__ > 4 || \
+	(__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#define MEIMM_COPY_TARGETS
+#include <immintrin.h>
+#include <smmintrin.h>
+#endif
+#endif /* __i386__ || __x86_64__ */
+
+typedef void (*meimm_copy_fn)(void *dst, const void *src, size_t len);
+
+/* memcpy() returns a pointer, so it cannot be called as a meimm_copy_fn */
+static void copy_plain(void *d, const void *s, size_t n)
+{
+	memcpy(d, s, n);
+}
+
+static pthread_once_t meimm_copy_once = PTHREAD_ONCE_INIT;
+static meimm_copy_fn meimm_copy_to_fn = copy_plain;
+static meimm_copy_fn meimm_copy_from_fn = copy_plain;
+
+#if defined(__SSE2__)
+static void meimm_copy_to_sse2(void *dst, const void *src, size_t len)
+{
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+	size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+
+	/* Streaming stores need an aligned destination */
+	if (head > len)
+		head = len;
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	len -= head;
+
+	for (; len >= 64; len -= 64, d += 64, s += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)s);
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+		__m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+		_mm_stream_si128((__m128i *)d, a);
+		_mm_stream_si128((__m128i *)(d + 16), b);
+		_mm_stream_si128((__m128i *)(d + 32), c);
+		_mm_stream_si128((__m128i *)(d + 48), e);
+	}
+	memcpy(d, s, len);
+}
+#endif /* __SSE2__ */
+
+#if defined(MEIMM_COPY_TARGETS)
+__attribute__((target("avx")))
+static void meimm_copy_to_avx(void *dst, const void *src, size_t len)
+{
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+	size_t head = (32 - ((uintptr_t)d & 31)) & 31;
+
+	if (head > len)
+		head = len;
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	len -= head;
+
+	for (; len >= 128; len -= 128, d += 128, s += 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)s);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+		__m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+		_mm256_stream_si256((__m256i *)d, a);
+		_mm256_stream_si256((__m256i *)(d + 32), b);
+		_mm256_stream_si256((__m256i *)(d + 64), c);
+		_mm256_stream_si256((__m256i *)(d + 96), e);
+	}
+	_mm256_zeroupper();
+	memcpy(d, s, len);
+}
+
+/*
+ * movntdqa only avoids the cache on write combining memory, on normal
+ * write back memory it is an ordinary load, so this never costs more
+ * than memcpy
+ */
+__attribute__((target("sse4.1")))
+static void meimm_copy_from_sse41(void *dst, const void *src, size_t len)
+{
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+	size_t head = (16 - ((uintptr_t)s & 15)) & 15;
+
+	if (head > len)
+		head = len;
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	len -= head;
+
+	for (; len >= 64; len -= 64, d += 64, s += 64) {
+		__m128i a = _mm_stream_load_si128((__m128i *)s);
+		__m128i b = _mm_stream_load_si128((__m128i *)(s + 16));
+		__m128i c = _mm_stream_load_si128((__m128i *)(s + 32));
+		__m128i e = _mm_stream_load_si128((__m128i *)(s + 48));
+		_mm_storeu_si128((__m128i *)d, a);
+		_mm_storeu_si128((__m128i *)(d + 16), b);
+		_mm_storeu_si128((__m128i *)(d + 32), c);
+		_mm_storeu_si128((__m128i *)(d + 48), e);
+	}
+	memcpy(d, s, len);
+}
+
+/* AVX needs the OS to save the ymm state as well as the CPU flag */
+static int meimm_copy_has_avx(unsigned int ecx)
+{
+	unsigned int lo, hi;
+
+	if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+		return 0;
+	__asm__ volatile ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+	return (lo & 6) == 6;
+}
+#endif /* MEIMM_COPY_TARGETS */
+
+static void meimm_copy_select(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return;
+#if defined(__SSE2__)
+	if (edx & bit_SSE2)
+		meimm_copy_to_fn = meimm_copy_to_sse2;
+#endif /* __SSE2__ */
+#if defined(MEIMM_COPY_TARGETS)
+	if (meimm_copy_has_avx(ecx))
+		meimm_copy_to_fn = meimm_copy_to_avx;
+	if (ecx & bit_SSE4_1)
+		meimm_copy_from_fn = meimm_copy_from_sse41;
+#endif /* MEIMM_COPY_TARGETS */
+#endif /* __i386__ || __x86_64__ */
+}
+
+void meimm_copy_to_device(void *dst, const void *src, size_t len)
+{
+	pthread_once(&meimm_copy_once, meimm_copy_select);
+
+	if (len < MEIMM_COPY_NT_THRESHOLD) {
+		memcpy(dst, src, len);
+		return;
+	}
+
+	meimm_copy_to_fn(dst, src, len);
+#if defined(__i386__) || defined(__x86_64__)
+	/* Streaming stores are weakly ordered, drain them before hand off */
+	__asm__ volatile ("sfence" ::: "memory");
+#endif
+}
+
+void meimm_copy_from_device(void *dst, const void *src, size_t len)
+{
+	pthread_once(&meimm_copy_once, meimm_copy_select);
+
+	if (len < MEIMM_COPY_NT_THRESHOLD) {
+		memcpy(dst, src, len);
+		return;
+	}
+
+	meimm_copy_from_fn(dst, src, len);
+}
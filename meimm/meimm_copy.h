@@ -0,0 +1,20 @@
+#ifndef __MEIMM_COPY_H__
+#define __MEIMM_COPY_H__
+
+#include <stddef.h>
+
+/*
+ * Copies of at least this many bytes use the non-temporal kernels,
+ * smaller ones are cheaper with memcpy and likely to stay cached anyway
+ */
+#ifndef MEIMM_COPY_NT_THRESHOLD
+#define MEIMM_COPY_NT_THRESHOLD (64 * 1024)
+#endif
+
+/* Copy into memory the device reads; stores are fenced on return */
+void meimm_copy_to_device(void *dst, const void *src, size_t len);
+
+/* Copy out of memory the device wrote */
+void meimm_copy_from_device(void *dst, const void *src, size_t len);
+
+#endif /* __MEIMM_COPY_H__ */